@@ -0,0 +1,1005 @@
+#include "khellofs.h"
+#include "hellofs_trace.h"
+
+/* A run of free blocks in a group's data block table slice, offsets are
+   relative to the slice */
+struct hellofs_free_extent {
+    struct rb_node offset_node;
+    struct rb_node length_node;
+    uint64_t offset;
+    uint64_t length;
+};
+
+static void hellofs_free_extent_link_length(struct hellofs_group_info *gi,
+                                            struct hellofs_free_extent *fe) {
+    struct rb_node **link = &gi->free_extents_by_length.rb_node;
+    struct rb_node *parent = NULL;
+    struct hellofs_free_extent *cur;
+
+    /* Ordered by length, then offset, so that equal fits go low first */
+    while (*link) {
+        parent = *link;
+        cur = rb_entry(parent, struct hellofs_free_extent, length_node);
+        if (fe->length < cur->length
+                || (fe->length == cur->length && fe->offset < cur->offset)) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+        }
+    }
+    rb_link_node(&fe->length_node, parent, link);
+    rb_insert_color(&fe->length_node, &gi->free_extents_by_length);
+}
+
+static void hellofs_free_extent_link_offset(struct hellofs_group_info *gi,
+                                            struct hellofs_free_extent *fe) {
+    struct rb_node **link = &gi->free_extents_by_offset.rb_node;
+    struct rb_node *parent = NULL;
+    struct hellofs_free_extent *cur;
+
+    while (*link) {
+        parent = *link;
+        cur = rb_entry(parent, struct hellofs_free_extent, offset_node);
+        if (fe->offset < cur->offset) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+        }
+    }
+    rb_link_node(&fe->offset_node, parent, link);
+    rb_insert_color(&fe->offset_node, &gi->free_extents_by_offset);
+}
+
+static void hellofs_free_extent_erase(struct hellofs_group_info *gi,
+                                      struct hellofs_free_extent *fe) {
+    rb_erase(&fe->offset_node, &gi->free_extents_by_offset);
+    rb_erase(&fe->length_node, &gi->free_extents_by_length);
+    kfree(fe);
+}
+
+/* The last free extent starting at or before offset, NULL if none */
+static struct hellofs_free_extent *hellofs_free_extent_before(
+        struct hellofs_group_info *gi, uint64_t offset) {
+    struct rb_node *node = gi->free_extents_by_offset.rb_node;
+    struct hellofs_free_extent *fe;
+    struct hellofs_free_extent *before = NULL;
+
+    while (node) {
+        fe = rb_entry(node, struct hellofs_free_extent, offset_node);
+        if (fe->offset <= offset) {
+            before = fe;
+            node = node->rb_right;
+        } else {
+            node = node->rb_left;
+        }
+    }
+    return before;
+}
+
+/* The shortest free extent of at least count blocks. If there is none,
+   the longest one, which is shorter. */
+static struct hellofs_free_extent *hellofs_free_extent_best_fit(
+        struct hellofs_group_info *gi, uint64_t count) {
+    struct rb_node *node = gi->free_extents_by_length.rb_node;
+    struct hellofs_free_extent *fe;
+    struct hellofs_free_extent *fit = NULL;
+
+    while (node) {
+        fe = rb_entry(node, struct hellofs_free_extent, length_node);
+        if (fe->length >= count) {
+            fit = fe;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+    if (!fit && (node = rb_last(&gi->free_extents_by_length))) {
+        fit = rb_entry(node, struct hellofs_free_extent, length_node);
+    }
+    return fit;
+}
+
+/* Give length blocks at offset back to the tree, merged with the free
+   extents right before and after them */
+static int hellofs_free_extent_add(struct hellofs_group_info *gi,
+                                   uint64_t offset, uint64_t length) {
+    struct hellofs_free_extent *prev, *next;
+    struct rb_node *node;
+
+    prev = hellofs_free_extent_before(gi, offset);
+    if (prev) {
+        node = rb_next(&prev->offset_node);
+    } else {
+        node = rb_first(&gi->free_extents_by_offset);
+    }
+    next = node ? rb_entry(node, struct hellofs_free_extent, offset_node)
+                : NULL;
+    if (prev && prev->offset + prev->length != offset) {
+        prev = NULL;
+    }
+    if (next && offset + length != next->offset) {
+        next = NULL;
+    }
+
+    if (prev) {
+        rb_erase(&prev->length_node, &gi->free_extents_by_length);
+        prev->length += length;
+        if (next) {
+            prev->length += next->length;
+            hellofs_free_extent_erase(gi, next);
+        }
+        hellofs_free_extent_link_length(gi, prev);
+        return 0;
+    }
+    if (next) {
+        rb_erase(&next->length_node, &gi->free_extents_by_length);
+        next->offset = offset;
+        next->length += length;
+        hellofs_free_extent_link_length(gi, next);
+        return 0;
+    }
+
+    next = kmalloc(sizeof(*next), GFP_NOFS);
+    if (!next) {
+        return -ENOMEM;
+    }
+    next->offset = offset;
+    next->length = length;
+    hellofs_free_extent_link_offset(gi, next);
+    hellofs_free_extent_link_length(gi, next);
+    return 0;
+}
+
+/* Take length blocks at offset out of fe, which holds them. Taking from
+   the middle splits fe, which needs memory. */
+static int hellofs_free_extent_take(struct hellofs_group_info *gi,
+                                    struct hellofs_free_extent *fe,
+                                    uint64_t offset, uint64_t length) {
+    struct hellofs_free_extent *tail;
+    uint64_t end = fe->offset + fe->length;
+
+    if (offset > fe->offset && offset + length < end) {
+        tail = kmalloc(sizeof(*tail), GFP_NOFS);
+        if (!tail) {
+            return -ENOMEM;
+        }
+        tail->offset = offset + length;
+        tail->length = end - tail->offset;
+        hellofs_free_extent_link_offset(gi, tail);
+        hellofs_free_extent_link_length(gi, tail);
+    } else if (offset == fe->offset && offset + length == end) {
+        hellofs_free_extent_erase(gi, fe);
+        return 0;
+    }
+
+    rb_erase(&fe->length_node, &gi->free_extents_by_length);
+    if (offset == fe->offset) {
+        fe->offset += length;
+        fe->length -= length;
+    } else {
+        fe->length = offset - fe->offset;
+    }
+    hellofs_free_extent_link_length(gi, fe);
+    return 0;
+}
+
+static void hellofs_free_extents_release(struct hellofs_group_info *gi) {
+    struct rb_node *node;
+
+    while ((node = rb_first(&gi->free_extents_by_offset))) {
+        hellofs_free_extent_erase(
+            gi, rb_entry(node, struct hellofs_free_extent, offset_node));
+    }
+}
+
+/* Build the free extent tree of a group from its data block bitmap. The
+   number of bits looked at is added to scanned. */
+static int hellofs_free_extents_load(struct super_block *sb,
+                                     struct hellofs_group_info *gi,
+                                     struct buffer_head *bh,
+                                     uint64_t *scanned) {
+    uint64_t size;
+    unsigned long start, end;
+    int ret;
+
+    size = min(HELLOFS_SB(sb)->data_blocks_per_group,
+               (uint64_t)bh->b_size * BITS_IN_BYTE);
+    start = find_next_zero_bit_le(bh->b_data, size, 0);
+    while (start < size) {
+        end = find_next_bit_le(bh->b_data, size, start);
+        ret = hellofs_free_extent_add(gi, start, end - start);
+        if (0 != ret) {
+            hellofs_free_extents_release(gi);
+            return ret;
+        }
+        start = end < size ? find_next_zero_bit_le(bh->b_data, size, end)
+                           : size;
+    }
+    *scanned += size;
+    return 0;
+}
+
+int hellofs_load_groups(struct super_block *sb) {
+    struct hellofs_sb_info *sbi;
+    struct hellofs_superblock *hellofs_sb;
+    struct hellofs_group_desc *gd;
+    uint64_t desc_blocks;
+    uint64_t free_inodes;
+    uint64_t free_data_blocks;
+    uint64_t i;
+    int ret;
+
+    sbi = HELLOFS_SB_INFO(sb);
+    hellofs_sb = HELLOFS_SB(sb);
+
+    if (unlikely(0 == hellofs_sb->group_count
+            || 0 == hellofs_sb->inodes_per_group
+            || 0 == hellofs_sb->data_blocks_per_group
+            || hellofs_sb->inodes_per_group
+                > HELLOFS_MAX_BLOCKS_PER_GROUP(hellofs_sb->blocksize)
+            || hellofs_sb->data_blocks_per_group
+                > HELLOFS_MAX_BLOCKS_PER_GROUP(hellofs_sb->blocksize))) {
+        printk(KERN_ERR "hellofs has invalid block group geometry\n");
+        return -EINVAL;
+    }
+
+    desc_blocks = HELLOFS_GROUP_DESC_TABLE_BLOCKS_HSB(hellofs_sb);
+    sbi->group_desc_bhs = kcalloc(desc_blocks, sizeof(struct buffer_head *),
+                                  GFP_KERNEL);
+    sbi->groups = vzalloc(hellofs_sb->group_count
+                          * sizeof(struct hellofs_group_info));
+    if (!sbi->group_desc_bhs || !sbi->groups) {
+        return -ENOMEM;
+    }
+
+    /* Group descriptors stay pinned, bitmaps are read on first use */
+    for (i = 0; i < desc_blocks; i++) {
+        sbi->group_desc_bhs[i] = sb_bread(
+            sb, HELLOFS_GROUP_DESC_TABLE_START_BLOCK_NO + i);
+        if (!sbi->group_desc_bhs[i]) {
+            printk(KERN_ERR "Failed to read group descriptor block %llu\n",
+                   HELLOFS_GROUP_DESC_TABLE_START_BLOCK_NO + i);
+            return -EIO;
+        }
+    }
+    /* The free counts of the group descriptors are authoritative, the
+       per-cpu counters cache their sums for statfs */
+    free_inodes = 0;
+    free_data_blocks = 0;
+    for (i = 0; i < hellofs_sb->group_count; i++) {
+        mutex_init(&sbi->groups[i].lock);
+        gd = HELLOFS_GROUP_DESC(sb, i);
+        free_inodes += gd->free_inodes_count;
+        free_data_blocks += gd->free_data_blocks_count;
+    }
+
+    ret = percpu_counter_init(&sbi->free_inodes, free_inodes);
+    if (0 != ret) {
+        return ret;
+    }
+    ret = percpu_counter_init(&sbi->free_data_blocks, free_data_blocks);
+    if (0 != ret) {
+        return ret;
+    }
+    spin_lock_init(&sbi->reserve_lock);
+    return percpu_counter_init(&sbi->reserved_data_blocks, 0);
+}
+
+/* Copy the used counts into the in-memory superblock and dirty it.
+   Only done at sync and unmount, allocations never touch the superblock. */
+void hellofs_fold_counters(struct super_block *sb) {
+    struct hellofs_sb_info *sbi;
+    struct hellofs_superblock *hellofs_sb;
+    struct hellofs_handle handle;
+
+    sbi = HELLOFS_SB_INFO(sb);
+    hellofs_sb = HELLOFS_SB(sb);
+
+    hellofs_journal_start(sb, &handle);
+    lock_buffer(sbi->sb_bh);
+    hellofs_sb->inode_count = hellofs_sb->inode_table_size
+                              - percpu_counter_sum_positive(&sbi->free_inodes);
+    hellofs_sb->data_block_count
+        = hellofs_sb->data_block_table_size
+          - percpu_counter_sum_positive(&sbi->free_data_blocks);
+    unlock_buffer(sbi->sb_bh);
+    hellofs_journal_dirty(sb, sbi->sb_bh);
+    hellofs_journal_stop(&handle);
+}
+
+void hellofs_release_groups(struct super_block *sb) {
+    struct hellofs_sb_info *sbi;
+    struct hellofs_superblock *hellofs_sb;
+    uint64_t i;
+
+    sbi = HELLOFS_SB_INFO(sb);
+    hellofs_sb = HELLOFS_SB(sb);
+
+    percpu_counter_destroy(&sbi->free_inodes);
+    percpu_counter_destroy(&sbi->free_data_blocks);
+    percpu_counter_destroy(&sbi->reserved_data_blocks);
+
+    if (sbi->groups) {
+        for (i = 0; i < hellofs_sb->group_count; i++) {
+            hellofs_free_extents_release(&sbi->groups[i]);
+            brelse(sbi->groups[i].inode_bitmap_bh);
+            brelse(sbi->groups[i].data_block_bitmap_bh);
+        }
+        vfree(sbi->groups);
+        sbi->groups = NULL;
+    }
+
+    if (sbi->group_desc_bhs) {
+        for (i = 0; i < HELLOFS_GROUP_DESC_TABLE_BLOCKS_HSB(hellofs_sb); i++) {
+            brelse(sbi->group_desc_bhs[i]);
+        }
+        kfree(sbi->group_desc_bhs);
+        sbi->group_desc_bhs = NULL;
+    }
+}
+
+/* Read the inode or data block bitmap of a group on first use and pin
+   it. The data block bitmap comes with the group's free extent tree.
+   Caller holds the group lock. */
+static struct buffer_head *hellofs_group_bitmap(struct super_block *sb,
+                                                uint64_t group_no,
+                                                int for_inode,
+                                                uint64_t *scanned) {
+    struct hellofs_group_info *gi;
+    struct hellofs_group_desc *gd;
+    struct buffer_head *bh;
+    uint64_t block_no;
+    int ret;
+
+    gi = HELLOFS_GROUP_INFO(sb, group_no);
+    gd = HELLOFS_GROUP_DESC(sb, group_no);
+    bh = for_inode ? gi->inode_bitmap_bh : gi->data_block_bitmap_bh;
+    if (bh) {
+        return bh;
+    }
+
+    block_no = for_inode ? gd->inode_bitmap_block_no
+                         : gd->data_block_bitmap_block_no;
+    bh = sb_bread(sb, block_no);
+    if (!bh) {
+        printk(KERN_ERR "Failed to read bitmap block %llu\n", block_no);
+        return ERR_PTR(-EIO);
+    }
+
+    if (for_inode) {
+        gi->inode_bitmap_bh = bh;
+        return bh;
+    }
+    ret = hellofs_free_extents_load(sb, gi, bh, scanned);
+    if (0 != ret) {
+        brelse(bh);
+        return ERR_PTR(ret);
+    }
+    gi->data_block_bitmap_bh = bh;
+    return bh;
+}
+
+/* Find and set a zero bit in a pinned bitmap buffer, searching a word
+   at a time from start and wrapping around to the beginning. The caller
+   journals the bitmap. The number of bits looked at is added to
+   scanned. */
+static int hellofs_alloc_bit(struct buffer_head *bh, uint64_t size,
+                             uint64_t start, uint64_t *out_bit,
+                             uint64_t *scanned) {
+    unsigned long bit;
+
+    size = min(size, (uint64_t)bh->b_size * BITS_IN_BYTE);
+    if (start >= size) {
+        start = 0;
+    }
+
+    bit = find_next_zero_bit_le(bh->b_data, size, start);
+    if (bit < size) {
+        *scanned += bit - start + 1;
+    } else {
+        bit = find_next_zero_bit_le(bh->b_data, start, 0);
+        if (bit >= start) {
+            *scanned += size;
+            return -ENOSPC;
+        }
+        *scanned += size - start + bit + 1;
+    }
+
+    __set_bit_le(bit, bh->b_data);
+
+    *out_bit = bit;
+    return 0;
+}
+
+/* Allocate up to count data blocks at goal (an offset inside the group)
+   if it is free, so that a file keeps growing in place, or else where
+   they fit best. Returns how many were allocated, which is less than
+   count when the group has no run that long. Caller holds the group
+   lock. */
+static int hellofs_group_alloc_data(struct super_block *sb,
+                                    uint64_t group_no, uint64_t goal,
+                                    uint64_t count, uint64_t *out_offset,
+                                    uint64_t *out_count, uint64_t *scanned) {
+    struct hellofs_group_info *gi;
+    struct hellofs_group_desc *gd;
+    struct hellofs_free_extent *fe;
+    struct buffer_head *bh;
+    uint64_t offset;
+    uint64_t i;
+    int ret;
+
+    gi = HELLOFS_GROUP_INFO(sb, group_no);
+    gd = HELLOFS_GROUP_DESC(sb, group_no);
+
+    if (0 == gd->free_data_blocks_count) {
+        return -ENOSPC;
+    }
+    bh = hellofs_group_bitmap(sb, group_no, 0, scanned);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
+
+    fe = hellofs_free_extent_before(gi, goal);
+    if (fe && goal < fe->offset + fe->length) {
+        offset = goal;
+    } else {
+        fe = hellofs_free_extent_best_fit(gi, count);
+        if (!fe) {
+            printk(KERN_ERR "Group %llu has %llu free data blocks but no "
+                            "free extent\n",
+                   group_no, gd->free_data_blocks_count);
+            return -ENOSPC;
+        }
+        offset = fe->offset;
+    }
+    count = min(count, fe->offset + fe->length - offset);
+
+    ret = hellofs_free_extent_take(gi, fe, offset, count);
+    if (0 != ret) {
+        return ret;
+    }
+    for (i = offset; i < offset + count; i++) {
+        __set_bit_le(i, bh->b_data);
+    }
+    gd->free_data_blocks_count -= count;
+    hellofs_journal_dirty(sb, bh);
+    hellofs_journal_dirty(sb, HELLOFS_GROUP_DESC_BH(sb, group_no));
+
+    *out_offset = offset;
+    *out_count = count;
+    return 0;
+}
+
+/* Allocate an inode from one group, starting at the group's cursor.
+   Caller holds the group lock. */
+static int hellofs_group_alloc_inode(struct super_block *sb,
+                                     uint64_t group_no, uint64_t *out_offset,
+                                     uint64_t *scanned) {
+    struct hellofs_group_info *gi;
+    struct hellofs_group_desc *gd;
+    struct buffer_head *bh;
+    int ret;
+
+    gi = HELLOFS_GROUP_INFO(sb, group_no);
+    gd = HELLOFS_GROUP_DESC(sb, group_no);
+
+    if (0 == gd->free_inodes_count) {
+        return -ENOSPC;
+    }
+    bh = hellofs_group_bitmap(sb, group_no, 1, scanned);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
+
+    ret = hellofs_alloc_bit(bh, HELLOFS_SB(sb)->inodes_per_group,
+                            gi->next_free_inode_offset, out_offset, scanned);
+    if (0 != ret) {
+        return ret;
+    }
+
+    gi->next_free_inode_offset = *out_offset + 1;
+    gd->free_inodes_count -= 1;
+    hellofs_journal_dirty(sb, bh);
+    hellofs_journal_dirty(sb, HELLOFS_GROUP_DESC_BH(sb, group_no));
+    return 0;
+}
+
+/* The i-th group to try: the preferred group first, then the others in
+   an order rotated by CPU, so that concurrent allocators which miss the
+   preferred group fan out to different groups. */
+static uint64_t hellofs_group_order(uint64_t preferred, uint64_t i,
+                                    uint64_t group_count, unsigned int cpu) {
+    if (0 == i) {
+        return preferred;
+    }
+    return (preferred + 1 + (cpu + i - 1) % (group_count - 1)) % group_count;
+}
+
+/* Allocate an inode, or up to count data blocks, trying the preferred
+   group first. goal is only used in the preferred group. */
+static int hellofs_alloc(struct super_block *sb, uint64_t preferred,
+                         int for_inode, uint64_t goal, uint64_t count,
+                         uint64_t *out_group_no, uint64_t *out_offset,
+                         uint64_t *out_count) {
+    struct hellofs_superblock *hellofs_sb;
+    struct hellofs_group_info *gi;
+    uint64_t group_no;
+    uint64_t groups_tried;
+    uint64_t scanned;
+    uint64_t i;
+    unsigned int cpu;
+    ktime_t start;
+    int pass;
+    int ret;
+
+    hellofs_sb = HELLOFS_SB(sb);
+    cpu = raw_smp_processor_id();
+    start = ktime_get();
+    group_no = 0;
+    groups_tried = 0;
+    scanned = 0;
+    ret = -ENOSPC;
+
+    /* The first pass skips groups whose lock is contended */
+    for (pass = 0; pass < 2; pass++) {
+        for (i = 0; i < hellofs_sb->group_count; i++) {
+            group_no = hellofs_group_order(preferred, i,
+                                           hellofs_sb->group_count, cpu);
+            gi = HELLOFS_GROUP_INFO(sb, group_no);
+
+            if (0 == pass) {
+                if (!mutex_trylock(&gi->lock)) {
+                    continue;
+                }
+            } else {
+                mutex_lock(&gi->lock);
+            }
+            groups_tried += 1;
+            if (for_inode) {
+                ret = hellofs_group_alloc_inode(sb, group_no, out_offset,
+                                                &scanned);
+                *out_count = 1;
+            } else {
+                ret = hellofs_group_alloc_data(
+                    sb, group_no,
+                    group_no == preferred ? goal : HELLOFS_NO_GOAL, count,
+                    out_offset, out_count, &scanned);
+            }
+            mutex_unlock(&gi->lock);
+
+            if (0 == ret) {
+                *out_group_no = group_no;
+                goto out;
+            }
+            if (-ENOSPC != ret) {
+                goto out;
+            }
+        }
+    }
+
+out:
+    trace_hellofs_alloc(sb, for_inode, preferred, group_no,
+                        0 == ret ? *out_offset : 0,
+                        0 == ret ? *out_count : 0, groups_tried, scanned,
+                        ret,
+                        hellofs_stat_end(sb, HELLOFS_STAT_ALLOC, start,
+                                         scanned));
+    return ret;
+}
+
+int hellofs_alloc_hellofs_inode(struct super_block *sb, struct inode *dir,
+                                umode_t mode, uint64_t *out_inode_no) {
+    struct hellofs_sb_info *sbi;
+    struct hellofs_superblock *hellofs_sb;
+    uint64_t preferred;
+    uint64_t group_no;
+    uint64_t offset;
+    uint64_t count;
+    int ret;
+
+    sbi = HELLOFS_SB_INFO(sb);
+    hellofs_sb = HELLOFS_SB(sb);
+
+    /* Files stay in the parent's group, directories are spread by CPU */
+    preferred = dir ? HELLOFS_INODE_GROUP_NO_HSB(hellofs_sb, dir->i_ino) : 0;
+    if (S_ISDIR(mode) && hellofs_sb->group_count > 1) {
+        preferred = (preferred + 1
+                     + raw_smp_processor_id() % (hellofs_sb->group_count - 1))
+                    % hellofs_sb->group_count;
+    }
+
+    ret = hellofs_alloc(sb, preferred, 1, HELLOFS_NO_GOAL, 1,
+                        &group_no, &offset, &count);
+    if (0 != ret) {
+        return ret;
+    }
+    *out_inode_no = group_no * hellofs_sb->inodes_per_group + offset;
+
+    percpu_counter_dec(&sbi->free_inodes);
+
+    return 0;
+}
+
+/* How many of count more data blocks can be reserved. The per-cpu
+   counters are only summed up when their cheap reads say space is
+   getting low. Caller holds sbi->reserve_lock. */
+static s64 hellofs_reservable(struct hellofs_sb_info *sbi, s64 count) {
+    s64 free, reserved;
+
+    free = percpu_counter_read_positive(&sbi->free_data_blocks);
+    reserved = percpu_counter_read_positive(&sbi->reserved_data_blocks);
+    if (free - reserved < count + 4 * percpu_counter_batch * nr_cpu_ids) {
+        free = percpu_counter_sum_positive(&sbi->free_data_blocks);
+        reserved = percpu_counter_sum_positive(&sbi->reserved_data_blocks);
+    }
+    return clamp_t(s64, free - reserved, 0, count);
+}
+
+/* Allocate a run of 1 to count contiguous data blocks. goal is the
+   absolute block no we would like the run to start at, or 0 if any.
+   reserved is set when the blocks were reserved beforehand, by delayed
+   blocks. Other allocations only take blocks nobody has reserved. */
+int hellofs_alloc_data_blocks(struct super_block *sb, uint64_t goal,
+                              uint64_t count, int reserved,
+                              uint64_t *out_data_block_no,
+                              uint64_t *out_count) {
+    struct hellofs_sb_info *sbi;
+    struct hellofs_superblock *hellofs_sb;
+    struct hellofs_group_desc *gd;
+    uint64_t preferred;
+    uint64_t goal_offset;
+    uint64_t group_no;
+    uint64_t offset;
+    int ret;
+
+    sbi = HELLOFS_SB_INFO(sb);
+    hellofs_sb = HELLOFS_SB(sb);
+
+    preferred = 0;
+    goal_offset = HELLOFS_NO_GOAL;
+    if (goal >= HELLOFS_GROUP_START_BLOCK_NO_HSB(hellofs_sb, 0)
+            && goal < HELLOFS_TOTAL_BLOCKS_HSB(hellofs_sb)) {
+        preferred = HELLOFS_BLOCK_GROUP_NO_HSB(hellofs_sb, goal);
+        gd = HELLOFS_GROUP_DESC(sb, preferred);
+        if (goal >= gd->data_block_table_block_no) {
+            goal_offset = goal - gd->data_block_table_block_no;
+        }
+    }
+
+    if (!reserved) {
+        /* Hold the blocks as reserved while allocating them, so that
+           concurrent reservations do not count them as free */
+        spin_lock(&sbi->reserve_lock);
+        count = hellofs_reservable(sbi, count);
+        percpu_counter_add(&sbi->reserved_data_blocks, count);
+        spin_unlock(&sbi->reserve_lock);
+        if (0 == count) {
+            return -ENOSPC;
+        }
+    }
+
+    ret = hellofs_alloc(sb, preferred, 0, goal_offset, count,
+                        &group_no, &offset, out_count);
+    if (0 == ret) {
+        gd = HELLOFS_GROUP_DESC(sb, group_no);
+        *out_data_block_no = gd->data_block_table_block_no + offset;
+        percpu_counter_sub(&sbi->free_data_blocks, *out_count);
+    }
+
+    if (!reserved) {
+        percpu_counter_sub(&sbi->reserved_data_blocks, count);
+    }
+    return ret;
+}
+
+/* Clear count bits from bit in a group's bitmap and give them back to the
+   group. Freed data blocks go back to the free extent tree as well.
+   Caller holds the group lock. */
+static void hellofs_group_free(struct super_block *sb, uint64_t group_no,
+                               int for_inode, uint64_t bit, uint64_t count) {
+    struct hellofs_group_info *gi;
+    struct hellofs_group_desc *gd;
+    struct buffer_head *bh;
+    uint64_t *free_count;
+    uint64_t run;
+    uint64_t scanned;
+    uint64_t i;
+
+    gi = HELLOFS_GROUP_INFO(sb, group_no);
+    gd = HELLOFS_GROUP_DESC(sb, group_no);
+    free_count = for_inode ? &gd->free_inodes_count
+                           : &gd->free_data_blocks_count;
+
+    scanned = 0;
+    bh = hellofs_group_bitmap(sb, group_no, for_inode, &scanned);
+    if (IS_ERR(bh)) {
+        printk(KERN_ERR "Failed to load bitmap of group %llu, "
+                        "leaking %llu entries\n",
+               group_no, count);
+        return;
+    }
+
+    /* run counts the bits cleared right before i */
+    run = 0;
+    for (i = bit; i <= bit + count; i++) {
+        if (i < bit + count && __test_and_clear_bit_le(i, bh->b_data)) {
+            *free_count += 1;
+            run += 1;
+            continue;
+        }
+        if (i < bit + count) {
+            printk(KERN_ERR "Freeing free bit %llu in group %llu\n",
+                   i, group_no);
+        }
+        if (!for_inode && run > 0
+                && 0 != hellofs_free_extent_add(gi, i - run, run)) {
+            printk(KERN_ERR "Out of memory, %llu free blocks of group %llu "
+                            "are not reused until remount\n",
+                   run, group_no);
+        }
+        run = 0;
+    }
+    hellofs_journal_dirty(sb, bh);
+    hellofs_journal_dirty(sb, HELLOFS_GROUP_DESC_BH(sb, group_no));
+
+    /* Let the next inode search start at the freed space */
+    if (for_inode && bit < gi->next_free_inode_offset) {
+        gi->next_free_inode_offset = bit;
+    }
+}
+
+void hellofs_free_hellofs_inode(struct super_block *sb, uint64_t inode_no) {
+    struct hellofs_sb_info *sbi;
+    struct hellofs_superblock *hellofs_sb;
+    struct hellofs_group_info *gi;
+    uint64_t group_no;
+
+    sbi = HELLOFS_SB_INFO(sb);
+    hellofs_sb = HELLOFS_SB(sb);
+    group_no = HELLOFS_INODE_GROUP_NO_HSB(hellofs_sb, inode_no);
+    gi = HELLOFS_GROUP_INFO(sb, group_no);
+
+    mutex_lock(&gi->lock);
+    hellofs_group_free(sb, group_no, 1,
+                       inode_no % hellofs_sb->inodes_per_group, 1);
+    mutex_unlock(&gi->lock);
+
+    percpu_counter_inc(&sbi->free_inodes);
+}
+
+/* Free count data blocks starting at block_no, the run may cross groups */
+void hellofs_free_data_blocks(struct super_block *sb, uint64_t block_no,
+                              uint64_t count) {
+    struct hellofs_sb_info *sbi;
+    struct hellofs_superblock *hellofs_sb;
+    struct hellofs_group_info *gi;
+    struct hellofs_group_desc *gd;
+    uint64_t group_no;
+    uint64_t offset;
+    uint64_t n;
+    uint64_t total;
+
+    sbi = HELLOFS_SB_INFO(sb);
+    hellofs_sb = HELLOFS_SB(sb);
+
+    hellofs_journal_forget(sb, block_no, count);
+    total = count;
+    while (count > 0) {
+        group_no = HELLOFS_BLOCK_GROUP_NO_HSB(hellofs_sb, block_no);
+        if (unlikely(block_no < HELLOFS_GROUP_START_BLOCK_NO_HSB(hellofs_sb, 0)
+                || group_no >= hellofs_sb->group_count
+                || block_no < HELLOFS_GROUP_DESC(sb, group_no)
+                                  ->data_block_table_block_no)) {
+            printk(KERN_ERR "Freeing block %llu outside data block tables\n",
+                   block_no);
+            total -= count;
+            break;
+        }
+        gd = HELLOFS_GROUP_DESC(sb, group_no);
+        offset = block_no - gd->data_block_table_block_no;
+        n = min(count, hellofs_sb->data_blocks_per_group - offset);
+
+        gi = HELLOFS_GROUP_INFO(sb, group_no);
+        mutex_lock(&gi->lock);
+        hellofs_group_free(sb, group_no, 0, offset, n);
+        mutex_unlock(&gi->lock);
+
+        block_no += n;
+        count -= n;
+    }
+
+    percpu_counter_add(&sbi->free_data_blocks, total);
+}
+
+/* A run of contiguous delayed blocks of an inode */
+struct hellofs_delayed_run {
+    struct rb_node node;
+    uint64_t iblock;
+    uint64_t count;
+};
+
+/* The last delayed run of hi starting at or before iblock, NULL if none */
+static struct hellofs_delayed_run *hellofs_delayed_run_before(
+        struct hellofs_inode_info *hi, uint64_t iblock) {
+    struct rb_node *node = hi->delayed_runs.rb_node;
+    struct hellofs_delayed_run *run;
+    struct hellofs_delayed_run *before = NULL;
+
+    while (node) {
+        run = rb_entry(node, struct hellofs_delayed_run, node);
+        if (run->iblock <= iblock) {
+            before = run;
+            node = node->rb_right;
+        } else {
+            node = node->rb_left;
+        }
+    }
+    return before;
+}
+
+static void hellofs_delayed_run_link(struct hellofs_inode_info *hi,
+                                     struct hellofs_delayed_run *run) {
+    struct rb_node **link = &hi->delayed_runs.rb_node;
+    struct rb_node *parent = NULL;
+    struct hellofs_delayed_run *cur;
+
+    while (*link) {
+        parent = *link;
+        cur = rb_entry(parent, struct hellofs_delayed_run, node);
+        if (run->iblock < cur->iblock) {
+            link = &parent->rb_left;
+        } else {
+            link = &parent->rb_right;
+        }
+    }
+    rb_link_node(&run->node, parent, link);
+    rb_insert_color(&run->node, &hi->delayed_runs);
+    hi->delayed_run_count += 1;
+}
+
+static void hellofs_delayed_run_erase(struct hellofs_inode_info *hi,
+                                      struct hellofs_delayed_run *run) {
+    rb_erase(&run->node, &hi->delayed_runs);
+    hi->delayed_run_count -= 1;
+    kfree(run);
+}
+
+/* Reserve a data block for delayed block iblock of inode, so that
+   writeback is sure to find one. The first delayed block of an inode
+   without an extent block reserves one for it too, in case the extents
+   allocated at writeback spill out of the inode. Each run of contiguous
+   delayed blocks may end up in an extent of its own, so a block which
+   does not extend a run counts against the extents the inode can hold.
+   -EFBIG means it could not hold them all unless the delayed blocks are
+   written back first. */
+int hellofs_reserve_data_block(struct inode *inode, uint64_t iblock) {
+    struct hellofs_sb_info *sbi = HELLOFS_SB_INFO(inode->i_sb);
+    struct hellofs_inode_info *hi = HELLOFS_I(inode);
+    struct hellofs_delayed_run *prev, *next;
+    struct hellofs_delayed_run *run = NULL;
+    struct rb_node *node;
+    uint64_t count;
+    int ret;
+
+again:
+    spin_lock(&hi->reserve_lock);
+    prev = hellofs_delayed_run_before(hi, iblock);
+    if (prev) {
+        node = rb_next(&prev->node);
+    } else {
+        node = rb_first(&hi->delayed_runs);
+    }
+    next = node ? rb_entry(node, struct hellofs_delayed_run, node) : NULL;
+    if (prev && prev->iblock + prev->count != iblock) {
+        prev = NULL;
+    }
+    if (next && iblock + 1 != next->iblock) {
+        next = NULL;
+    }
+
+    if (!prev && !next) {
+        if (ACCESS_ONCE(hi->hellofs_inode.extent_count)
+                + hi->delayed_run_count
+                >= HELLOFS_MAX_EXTENTS_HSB(HELLOFS_SB(inode->i_sb))) {
+            ret = -EFBIG;
+            goto out;
+        }
+        if (!run) {
+            spin_unlock(&hi->reserve_lock);
+            run = kmalloc(sizeof(*run), GFP_NOFS);
+            if (!run) {
+                return -ENOMEM;
+            }
+            goto again;
+        }
+    }
+
+    count = 1;
+    if (0 == hi->reserved_data_blocks
+            && 0 == hi->hellofs_inode.extent_block_no) {
+        count += 1;
+    }
+    spin_lock(&sbi->reserve_lock);
+    if (hellofs_reservable(sbi, count) < count) {
+        spin_unlock(&sbi->reserve_lock);
+        ret = -ENOSPC;
+        goto out;
+    }
+    percpu_counter_add(&sbi->reserved_data_blocks, count);
+    spin_unlock(&sbi->reserve_lock);
+    hi->reserved_data_blocks += 1;
+    hi->reserved_extent_blocks += count - 1;
+
+    if (prev) {
+        prev->count += 1;
+        if (next) {
+            /* The block bridges prev and next */
+            prev->count += next->count;
+            hellofs_delayed_run_erase(hi, next);
+        }
+    } else if (next) {
+        next->iblock -= 1;
+        next->count += 1;
+    } else {
+        run->iblock = iblock;
+        run->count = 1;
+        hellofs_delayed_run_link(hi, run);
+        run = NULL;
+    }
+    ret = 0;
+
+out:
+    spin_unlock(&hi->reserve_lock);
+    kfree(run);
+    return ret;
+}
+
+/* Give back the reservations of the count delayed blocks of inode from
+   iblock, because they have been allocated or dropped. The extent block
+   reservation goes with the last of them. Taking blocks out of the
+   middle of a run splits it, which needs memory. */
+void hellofs_release_data_blocks(struct inode *inode, uint64_t iblock,
+                                 uint64_t count) {
+    struct hellofs_sb_info *sbi = HELLOFS_SB_INFO(inode->i_sb);
+    struct hellofs_inode_info *hi = HELLOFS_I(inode);
+    struct hellofs_delayed_run *run;
+    struct hellofs_delayed_run *tail = NULL;
+    uint64_t end;
+
+again:
+    spin_lock(&hi->reserve_lock);
+    run = hellofs_delayed_run_before(hi, iblock);
+    if (WARN_ON(!run || iblock + count > run->iblock + run->count)) {
+        /* Not delayed blocks after all, the counts are still released */
+    } else if (run->iblock == iblock && run->count == count) {
+        hellofs_delayed_run_erase(hi, run);
+    } else if (run->iblock == iblock) {
+        run->iblock += count;
+        run->count -= count;
+    } else if (iblock + count == run->iblock + run->count) {
+        run->count -= count;
+    } else if (!tail) {
+        spin_unlock(&hi->reserve_lock);
+        tail = kmalloc(sizeof(*tail), GFP_NOFS | __GFP_NOFAIL);
+        goto again;
+    } else {
+        end = run->iblock + run->count;
+        run->count = iblock - run->iblock;
+        tail->iblock = iblock + count;
+        tail->count = end - tail->iblock;
+        hellofs_delayed_run_link(hi, tail);
+        tail = NULL;
+    }
+
+    if (WARN_ON(count > hi->reserved_data_blocks)) {
+        count = hi->reserved_data_blocks;
+    }
+    hi->reserved_data_blocks -= count;
+    if (0 == hi->reserved_data_blocks) {
+        count += hi->reserved_extent_blocks;
+        hi->reserved_extent_blocks = 0;
+    }
+    percpu_counter_sub(&sbi->reserved_data_blocks, count);
+    spin_unlock(&hi->reserve_lock);
+    kfree(tail);
+}
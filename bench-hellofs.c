@@ -0,0 +1,280 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "libhellofs.h"
+
+/* Microbenchmarks of the hellofs on-disk algorithms through libhellofs,
+   run against an image fresh from mkfs-hellofs. Every run does the same
+   operations with the same names and data, so runs are comparable. */
+
+#define BENCH_DIR_NAME "bench"
+#define BENCH_SMALL_SIZE 64
+#define BENCH_LARGE_CHUNK (64 * 1024)
+
+struct bench_timer {
+    struct timespec start;
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+};
+
+static void bench_start(struct libhellofs *fs, struct bench_timer *timer) {
+    timer->blocks_read = fs->blocks_read;
+    timer->blocks_written = fs->blocks_written;
+    clock_gettime(CLOCK_MONOTONIC, &timer->start);
+}
+
+static void bench_end(struct libhellofs *fs, struct bench_timer *timer,
+                      const char *name, uint64_t ops) {
+    struct timespec end;
+    uint64_t ns;
+
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    ns = (end.tv_sec - timer->start.tv_sec) * 1000000000ULL
+         + end.tv_nsec - timer->start.tv_nsec;
+    printf("%-14s %10llu %12.3f %12.1f %12llu %12llu\n", name,
+           (unsigned long long)ops, ns / 1e6, ops ? (double)ns / ops : 0.0,
+           (unsigned long long)(fs->blocks_read - timer->blocks_read),
+           (unsigned long long)(fs->blocks_written - timer->blocks_written));
+}
+
+static void bench_name(char *buf, size_t len, char prefix, uint64_t i) {
+    snprintf(buf, len, "%c%08llu", prefix, (unsigned long long)i);
+}
+
+// Data is a function of the position, so reads can be checked
+static void bench_fill(char *buf, size_t len, uint64_t pos) {
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        buf[i] = (char)((pos + i) * 31 + 7);
+    }
+}
+
+static int bench_count_entry(void *arg, const char *name, int name_len,
+                             uint64_t inode_no, uint8_t file_type) {
+    *(uint64_t *)arg += 1;
+    return 0;
+}
+
+static int bench_fail(const char *what, long long err) {
+    fprintf(stderr, "%s failed: %s\n", what, strerror((int)-err));
+    return -1;
+}
+
+static int bench_run(struct libhellofs *fs, uint64_t file_count,
+                     uint64_t large_size) {
+    struct bench_timer timer;
+    struct hellofs_inode root;
+    struct hellofs_inode dir;
+    struct hellofs_inode inode;
+    char name[32];
+    char small[BENCH_SMALL_SIZE];
+    char expected[BENCH_LARGE_CHUNK];
+    char *chunk;
+    uint64_t inode_no;
+    uint64_t entries;
+    uint64_t pos;
+    uint64_t i;
+    size_t len;
+    ssize_t n;
+    int ret;
+
+    ret = libhellofs_get_inode(fs, HELLOFS_ROOTDIR_INODE_NO, &root);
+    if (0 != ret) {
+        return bench_fail("reading the root inode", ret);
+    }
+    ret = libhellofs_create(fs, &root, BENCH_DIR_NAME,
+                            S_IFDIR | S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH,
+                            &dir);
+    if (0 != ret) {
+        return bench_fail("creating " BENCH_DIR_NAME
+                          " (is the image fresh from mkfs?)", ret);
+    }
+
+    printf("%-14s %10s %12s %12s %12s %12s\n", "workload", "ops", "total_ms",
+           "ns/op", "blocks_read", "blocks_wr");
+
+    bench_start(fs, &timer);
+    for (i = 0; i < file_count; i++) {
+        bench_name(name, sizeof(name), 'f', i);
+        ret = libhellofs_create(fs, &dir, name,
+                                S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP
+                                | S_IROTH, &inode);
+        if (0 != ret) {
+            return bench_fail("create", ret);
+        }
+    }
+    bench_end(fs, &timer, "create", file_count);
+
+    bench_start(fs, &timer);
+    for (i = 0; i < file_count; i++) {
+        bench_name(name, sizeof(name), 'f', i);
+        ret = libhellofs_lookup(fs, &dir, name, strlen(name), &inode_no);
+        if (0 != ret) {
+            return bench_fail("lookup hit", ret);
+        }
+    }
+    bench_end(fs, &timer, "lookup_hit", file_count);
+
+    bench_start(fs, &timer);
+    for (i = 0; i < file_count; i++) {
+        bench_name(name, sizeof(name), 'm', i);
+        ret = libhellofs_lookup(fs, &dir, name, strlen(name), &inode_no);
+        if (-ENOENT != ret) {
+            return bench_fail("lookup miss", 0 == ret ? -EEXIST : ret);
+        }
+    }
+    bench_end(fs, &timer, "lookup_miss", file_count);
+
+    bench_start(fs, &timer);
+    entries = 0;
+    ret = libhellofs_readdir(fs, &dir, bench_count_entry, &entries);
+    if (0 != ret) {
+        return bench_fail("readdir", ret);
+    }
+    bench_end(fs, &timer, "readdir", entries);
+    if (entries != file_count) {
+        fprintf(stderr, "readdir returned %llu entries, expected %llu\n",
+                (unsigned long long)entries, (unsigned long long)file_count);
+        return -1;
+    }
+
+    // Small files stay inline, each write and read is one inode
+    bench_start(fs, &timer);
+    for (i = 0; i < file_count; i++) {
+        bench_name(name, sizeof(name), 'f', i);
+        ret = libhellofs_lookup(fs, &dir, name, strlen(name), &inode_no);
+        if (0 == ret) {
+            ret = libhellofs_get_inode(fs, inode_no, &inode);
+        }
+        if (0 != ret) {
+            return bench_fail("small write", ret);
+        }
+        bench_fill(small, sizeof(small), i);
+        n = libhellofs_pwrite(fs, &inode, small, sizeof(small), 0);
+        if (n != sizeof(small)) {
+            return bench_fail("small write", n < 0 ? n : -EIO);
+        }
+    }
+    bench_end(fs, &timer, "small_write", file_count);
+
+    bench_start(fs, &timer);
+    for (i = 0; i < file_count; i++) {
+        bench_name(name, sizeof(name), 'f', i);
+        ret = libhellofs_lookup(fs, &dir, name, strlen(name), &inode_no);
+        if (0 == ret) {
+            ret = libhellofs_get_inode(fs, inode_no, &inode);
+        }
+        if (0 != ret) {
+            return bench_fail("small read", ret);
+        }
+        n = libhellofs_pread(fs, &inode, small, sizeof(small), 0);
+        bench_fill(expected, sizeof(small), i);
+        if (n != sizeof(small) || 0 != memcmp(small, expected, sizeof(small))) {
+            fprintf(stderr, "small read of %s returned wrong data\n", name);
+            return -1;
+        }
+    }
+    bench_end(fs, &timer, "small_read", file_count);
+
+    chunk = malloc(BENCH_LARGE_CHUNK);
+    if (!chunk) {
+        return bench_fail("allocating buffers", -ENOMEM);
+    }
+    ret = libhellofs_create(fs, &dir, "large",
+                            S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH,
+                            &inode);
+    if (0 != ret) {
+        free(chunk);
+        return bench_fail("creating large", ret);
+    }
+
+    bench_start(fs, &timer);
+    for (pos = 0; pos < large_size; pos += len) {
+        len = large_size - pos < BENCH_LARGE_CHUNK ? large_size - pos
+                                                   : BENCH_LARGE_CHUNK;
+        bench_fill(chunk, len, pos);
+        n = libhellofs_pwrite(fs, &inode, chunk, len, pos);
+        if (n != (ssize_t)len) {
+            free(chunk);
+            return bench_fail("large write", n < 0 ? n : -ENOSPC);
+        }
+    }
+    bench_end(fs, &timer, "large_write",
+              (large_size + BENCH_LARGE_CHUNK - 1) / BENCH_LARGE_CHUNK);
+
+    bench_start(fs, &timer);
+    for (pos = 0; pos < large_size; pos += len) {
+        len = large_size - pos < BENCH_LARGE_CHUNK ? large_size - pos
+                                                   : BENCH_LARGE_CHUNK;
+        n = libhellofs_pread(fs, &inode, chunk, len, pos);
+        bench_fill(expected, len, pos);
+        if (n != (ssize_t)len || 0 != memcmp(chunk, expected, len)) {
+            fprintf(stderr, "large read at %llu returned wrong data\n",
+                    (unsigned long long)pos);
+            free(chunk);
+            return -1;
+        }
+    }
+    bench_end(fs, &timer, "large_read",
+              (large_size + BENCH_LARGE_CHUNK - 1) / BENCH_LARGE_CHUNK);
+    printf("large file: %llu bytes in %llu extents\n",
+           (unsigned long long)inode.file_size,
+           (unsigned long long)inode.extent_count);
+
+    free(chunk);
+    return 0;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-n files] [-s large_file_bytes] image\n"
+            "Runs the workloads against an image fresh from mkfs-hellofs,\n"
+            "which is modified.\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    struct libhellofs *fs;
+    uint64_t file_count;
+    uint64_t large_size;
+    int opt;
+    int ret;
+
+    file_count = 256;
+    large_size = 1024 * 1024;
+    while (-1 != (opt = getopt(argc, argv, "n:s:h"))) {
+        switch (opt) {
+        case 'n':
+            file_count = strtoull(optarg, NULL, 0);
+            break;
+        case 's':
+            large_size = strtoull(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 'h' == opt ? 0 : -1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return -1;
+    }
+
+    ret = libhellofs_open(argv[optind], &fs);
+    if (0 != ret) {
+        return bench_fail("opening the image", ret);
+    }
+
+    ret = bench_run(fs, file_count, large_size);
+
+    if (0 != libhellofs_close(fs)) {
+        fprintf(stderr, "Failed to write back the image\n");
+        ret = -1;
+    }
+    return ret;
+}
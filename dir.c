@@ -1,25 +1,907 @@
 #include "khellofs.h"
+#include "hellofs_trace.h"
 
-int hellofs_readdir(struct file *filp, void *dirent, filldir_t filldir) {
-    loff_t pos;
-    struct inode *inode;
+/* Read logical block `logical` of a directory. With create set, a missing
+   block is allocated and zeroed. Returns NULL if the block is a hole. */
+struct buffer_head *hellofs_dir_bread(struct inode *dir, uint64_t logical,
+                                      int create, int *err) {
     struct super_block *sb;
     struct buffer_head *bh;
-    struct hellofs_inode *hellofs_inode;
+    uint64_t block_no;
+    uint64_t count;
+    int new;
+
+    sb = dir->i_sb;
+
+    *err = hellofs_extent_map(dir, logical, &block_no, &count);
+    if (0 == *err) {
+        bh = sb_bread(sb, block_no);
+        if (!bh) {
+            *err = -EIO;
+        }
+        return bh;
+    }
+    if (-ENOENT != *err || !create) {
+        return NULL;
+    }
+
+    *err = hellofs_extent_alloc(dir, logical, 1, 0, &block_no, &count, &new);
+    if (0 != *err) {
+        /* Out of extents is out of space for a directory */
+        if (-EFBIG == *err) {
+            *err = -ENOSPC;
+        }
+        return NULL;
+    }
+    if (!new) {
+        bh = sb_bread(sb, block_no);
+        if (!bh) {
+            *err = -EIO;
+        }
+        return bh;
+    }
+
+    bh = sb_getblk(sb, block_no);
+    BUG_ON(!bh);
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    hellofs_journal_dirty_inode(bh, dir);
+    return bh;
+}
+
+static inline uint64_t hellofs_dir_leaf_count(struct inode *dir) {
+    return HELLOFS_INODE(dir)->file_size >> dir->i_sb->s_blocksize_bits;
+}
+
+static inline uint64_t hellofs_dir_index_size(struct inode *dir) {
+    return HELLOFS_INODE(dir)->dir_index_block_count
+           * HELLOFS_DIR_INDEX_ENTRIES_PER_BLOCK_HSB(HELLOFS_SB(dir->i_sb));
+}
+
+/* Sanity check a record at offset in a leaf block, so that a corrupted
+   block can not make us loop forever or run off the buffer */
+static inline int hellofs_dir_record_ok(struct super_block *sb,
+                                        struct hellofs_dir_record *dir_record,
+                                        uint64_t offset) {
+    return dir_record->rec_len >= HELLOFS_DIR_REC_LEN(0)
+           && 0 == dir_record->rec_len % 8
+           && offset + dir_record->rec_len <= sb->s_blocksize
+           && HELLOFS_DIR_REC_LEN(dir_record->name_len) <= dir_record->rec_len;
+}
+
+static void hellofs_leaf_init(struct super_block *sb, struct buffer_head *bh) {
+    struct hellofs_dir_record *dir_record;
+
+    dir_record = (struct hellofs_dir_record *)bh->b_data;
+    dir_record->inode_no = 0;
+    dir_record->rec_len = sb->s_blocksize;
+    dir_record->name_len = 0;
+    dir_record->file_type = HELLOFS_FT_UNKNOWN;
+}
+
+/* Search one leaf block for name. Also returns the record before it, which
+   absorbs its space when it is deleted. */
+static int hellofs_leaf_find(struct super_block *sb, struct buffer_head *bh,
+                             const struct qstr *name,
+                             struct hellofs_dir_record **out_record,
+                             struct hellofs_dir_record **out_prev) {
     struct hellofs_dir_record *dir_record;
+    struct hellofs_dir_record *prev;
+    uint64_t offset;
+
+    prev = NULL;
+    for (offset = 0; offset < sb->s_blocksize; offset += dir_record->rec_len) {
+        dir_record = (struct hellofs_dir_record *)(bh->b_data + offset);
+        if (unlikely(!hellofs_dir_record_ok(sb, dir_record, offset))) {
+            printk(KERN_ERR "Corrupted directory block %llu\n",
+                   (uint64_t)bh->b_blocknr);
+            return -EIO;
+        }
+        if (dir_record->name_len == name->len
+                && 0 == memcmp(dir_record->filename, name->name, name->len)) {
+            *out_record = dir_record;
+            *out_prev = prev;
+            return 0;
+        }
+        prev = dir_record;
+    }
+    return -ENOENT;
+}
+
+/* Give a new directory its first, empty, leaf block */
+int hellofs_dir_init(struct inode *dir) {
+    struct buffer_head *bh;
+    int err;
+
+    bh = hellofs_dir_bread(dir, 0, 1, &err);
+    if (!bh) {
+        return err;
+    }
+    hellofs_leaf_init(dir->i_sb, bh);
+    hellofs_journal_dirty_inode(bh, dir);
+    brelse(bh);
+
+    HELLOFS_INODE(dir)->file_size = dir->i_sb->s_blocksize;
+    i_size_write(dir, HELLOFS_INODE(dir)->file_size);
+    return 0;
+}
+
+/* Put a record into the first gap large enough, either an unused record
+   or the slack after a used one, which is split off */
+static int hellofs_leaf_add(struct super_block *sb, struct buffer_head *bh,
+                            const struct qstr *name, uint64_t inode_no,
+                            uint8_t file_type) {
+    struct hellofs_dir_record *dir_record;
+    struct hellofs_dir_record *new_record;
+    uint64_t offset;
+    uint64_t used;
+    uint64_t needed;
+
+    needed = HELLOFS_DIR_REC_LEN(name->len);
+    for (offset = 0; offset < sb->s_blocksize; offset += dir_record->rec_len) {
+        dir_record = (struct hellofs_dir_record *)(bh->b_data + offset);
+        if (unlikely(!hellofs_dir_record_ok(sb, dir_record, offset))) {
+            printk(KERN_ERR "Corrupted directory block %llu\n",
+                   (uint64_t)bh->b_blocknr);
+            return -EIO;
+        }
+
+        used = dir_record->name_len ? HELLOFS_DIR_REC_LEN(dir_record->name_len)
+                                    : 0;
+        if (dir_record->rec_len - used < needed) {
+            continue;
+        }
+
+        if (used) {
+            new_record = (struct hellofs_dir_record *)((char *)dir_record + used);
+            new_record->rec_len = dir_record->rec_len - used;
+            dir_record->rec_len = used;
+            dir_record = new_record;
+        }
+        dir_record->inode_no = inode_no;
+        dir_record->name_len = name->len;
+        dir_record->file_type = file_type;
+        memcpy(dir_record->filename, name->name, name->len);
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+/* Merge a record into the one before it. The first record of a block has
+   no predecessor and is marked unused instead. */
+static void hellofs_leaf_delete(struct hellofs_dir_record *dir_record,
+                                struct hellofs_dir_record *prev) {
+    if (prev) {
+        prev->rec_len += dir_record->rec_len;
+    } else {
+        dir_record->inode_no = 0;
+        dir_record->name_len = 0;
+        dir_record->file_type = HELLOFS_FT_UNKNOWN;
+    }
+}
+
+/* The largest record which fits into a leaf */
+static uint16_t hellofs_leaf_gap(struct super_block *sb,
+                                 struct buffer_head *bh) {
+    struct hellofs_dir_record *dir_record;
+    uint64_t offset;
+    uint64_t used;
+    uint16_t gap;
+
+    gap = 0;
+    for (offset = 0; offset < sb->s_blocksize; offset += dir_record->rec_len) {
+        dir_record = (struct hellofs_dir_record *)(bh->b_data + offset);
+        if (unlikely(!hellofs_dir_record_ok(sb, dir_record, offset))) {
+            return 0;
+        }
+        used = dir_record->name_len ? HELLOFS_DIR_REC_LEN(dir_record->name_len)
+                                    : 0;
+        gap = max_t(uint16_t, gap, dir_record->rec_len - used);
+    }
+    return gap;
+}
+
+/* Read the gap of every leaf into the free space map of a directory, so
+   that inserts find room freed anywhere instead of appending leaves */
+static int hellofs_dir_gaps_load(struct inode *dir) {
+    struct hellofs_inode_info *hi;
+    struct buffer_head *bh;
+    uint64_t leaf, leaf_count;
+    int err;
+
+    hi = HELLOFS_I(dir);
+    leaf_count = hellofs_dir_leaf_count(dir);
+
+    hi->dir_leaf_gap_capacity = leaf_count;
+    hi->dir_leaf_gaps = kmalloc(hi->dir_leaf_gap_capacity * sizeof(uint16_t),
+                                GFP_NOFS);
+    if (!hi->dir_leaf_gaps) {
+        hi->dir_leaf_gap_capacity = 0;
+        return -ENOMEM;
+    }
+
+    for (leaf = 0; leaf < leaf_count; leaf++) {
+        bh = hellofs_dir_bread(dir, leaf, 0, &err);
+        if (!bh) {
+            kfree(hi->dir_leaf_gaps);
+            hi->dir_leaf_gaps = NULL;
+            hi->dir_leaf_gap_capacity = 0;
+            return err ? err : -EIO;
+        }
+        hi->dir_leaf_gaps[leaf] = hellofs_leaf_gap(dir->i_sb, bh);
+        brelse(bh);
+    }
+    hi->dir_leaf_gap_count = leaf_count;
+    return 0;
+}
+
+/* Record the gap of a leaf which changed or was appended. Should the map
+   not grow, it is dropped and read again by a later insert. */
+static void hellofs_dir_gaps_update(struct inode *dir, uint64_t leaf,
+                                    struct buffer_head *bh) {
+    struct hellofs_inode_info *hi;
+    uint16_t *gaps;
+
+    hi = HELLOFS_I(dir);
+    if (!hi->dir_leaf_gaps || leaf > hi->dir_leaf_gap_count) {
+        return;
+    }
+
+    if (leaf == hi->dir_leaf_gap_capacity) {
+        gaps = krealloc(hi->dir_leaf_gaps,
+                        2 * hi->dir_leaf_gap_capacity * sizeof(uint16_t),
+                        GFP_NOFS);
+        if (!gaps) {
+            kfree(hi->dir_leaf_gaps);
+            hi->dir_leaf_gaps = NULL;
+            hi->dir_leaf_gap_count = 0;
+            hi->dir_leaf_gap_capacity = 0;
+            return;
+        }
+        hi->dir_leaf_gaps = gaps;
+        hi->dir_leaf_gap_capacity *= 2;
+    }
+
+    hi->dir_leaf_gaps[leaf] = hellofs_leaf_gap(dir->i_sb, bh);
+    if (leaf == hi->dir_leaf_gap_count) {
+        hi->dir_leaf_gap_count += 1;
+    }
+}
+
+/* Find a leaf with room for needed bytes in the free space map, starting
+   from the hinted leaf so that inserts rotate over the leaves with room.
+   Returns the leaf count if there is none. */
+static uint64_t hellofs_dir_gaps_find(struct inode *dir, uint64_t needed) {
+    struct hellofs_inode_info *hi;
+    uint64_t leaf, n;
+
+    hi = HELLOFS_I(dir);
+    leaf = hi->hellofs_inode.dir_free_leaf_block_no;
+    for (n = 0; n < hi->dir_leaf_gap_count; n++) {
+        if (leaf >= hi->dir_leaf_gap_count) {
+            leaf = 0;
+        }
+        if (hi->dir_leaf_gaps[leaf] >= needed) {
+            return leaf;
+        }
+        leaf += 1;
+    }
+    return hi->dir_leaf_gap_count;
+}
+
+/* Walks the probe sequence of an index slot, keeping the index block of
+   the current slot referenced */
+struct hellofs_index_cursor {
+    struct inode *dir;
+    uint64_t slot;
+    uint64_t block;
+    struct buffer_head *bh;
+};
+
+static struct hellofs_dir_index_entry *hellofs_index_entry(
+        struct hellofs_index_cursor *cursor, int *err) {
+    uint64_t per_block;
+    uint64_t block;
+
+    per_block = HELLOFS_DIR_INDEX_ENTRIES_PER_BLOCK_HSB(
+                    HELLOFS_SB(cursor->dir->i_sb));
+    block = cursor->slot / per_block;
+
+    if (!cursor->bh || cursor->block != block) {
+        brelse(cursor->bh);
+        cursor->block = block;
+        cursor->bh = hellofs_dir_bread(cursor->dir,
+                                       HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO + block,
+                                       0, err);
+        if (!cursor->bh) {
+            if (0 == *err) {
+                *err = -EIO;
+            }
+            return NULL;
+        }
+    }
+
+    return (struct hellofs_dir_index_entry *)cursor->bh->b_data
+           + cursor->slot % per_block;
+}
+
+static int hellofs_index_insert(struct inode *dir, uint32_t hash,
+                                uint64_t leaf_block_no) {
+    struct hellofs_index_cursor cursor = { .dir = dir, .bh = NULL };
+    struct hellofs_dir_index_entry *entry;
+    uint64_t size;
+    uint64_t n;
+    int err = -ENOSPC;
+
+    size = hellofs_dir_index_size(dir);
+    cursor.slot = hash % size;
+    for (n = 0; n < size; n++) {
+        entry = hellofs_index_entry(&cursor, &err);
+        if (!entry) {
+            break;
+        }
+        if (HELLOFS_DIR_INDEX_EMPTY == entry->leaf_block_no) {
+            entry->hash = hash;
+            entry->leaf_block_no = leaf_block_no;
+            hellofs_journal_dirty_inode(cursor.bh, dir);
+            err = 0;
+            break;
+        }
+        cursor.slot = (cursor.slot + 1) % size;
+        err = -ENOSPC;
+    }
+
+    brelse(cursor.bh);
+    return err;
+}
+
+/* Wipe the index blocks and hash the records of the leaf blocks into them */
+static int hellofs_index_fill(struct inode *dir) {
+    struct super_block *sb;
+    struct hellofs_dir_record *dir_record;
+    struct buffer_head *bh;
+    uint64_t leaf, i, offset;
+    int err;
+
+    sb = dir->i_sb;
+
+    for (i = 0; i < HELLOFS_INODE(dir)->dir_index_block_count; i++) {
+        bh = hellofs_dir_bread(dir, HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO + i,
+                               0, &err);
+        if (!bh) {
+            return err ? err : -EIO;
+        }
+        memset(bh->b_data, 0xff, bh->b_size);
+        hellofs_journal_dirty_inode(bh, dir);
+        brelse(bh);
+    }
+
+    for (leaf = 0; leaf < hellofs_dir_leaf_count(dir); leaf++) {
+        bh = hellofs_dir_bread(dir, leaf, 0, &err);
+        if (!bh) {
+            return err ? err : -EIO;
+        }
+        for (offset = 0; offset < sb->s_blocksize;
+                offset += dir_record->rec_len) {
+            dir_record = (struct hellofs_dir_record *)(bh->b_data + offset);
+            if (unlikely(!hellofs_dir_record_ok(sb, dir_record, offset))) {
+                brelse(bh);
+                return -EIO;
+            }
+            if (0 == dir_record->name_len) {
+                continue;
+            }
+            err = hellofs_index_insert(
+                dir,
+                hellofs_name_hash(dir_record->filename, dir_record->name_len),
+                leaf);
+            if (0 != err) {
+                brelse(bh);
+                return err;
+            }
+        }
+        brelse(bh);
+    }
+
+    return 0;
+}
+
+/* Index blocks for children records: the smallest power of two which
+   keeps the index at most 3/4 full, as mkfs-hellofs sizes it */
+static uint64_t hellofs_index_block_count(struct inode *dir,
+                                          uint64_t children) {
+    uint64_t per_block;
+    uint64_t block_count;
+
+    per_block = HELLOFS_DIR_INDEX_ENTRIES_PER_BLOCK_HSB(HELLOFS_SB(dir->i_sb));
+    block_count = 1;
+    while (children * 4 > block_count * per_block * 3) {
+        block_count *= 2;
+    }
+    return block_count;
+}
+
+/* (Re)build the index with block_count blocks from the leaf blocks. The
+   blocks are all allocated before the old index is wiped, so that running
+   out of space leaves it intact. Should the rebuild itself fail, the
+   directory goes without an index and is searched leaf by leaf until the
+   next record added builds it again. */
+static int hellofs_index_build(struct inode *dir, uint64_t block_count) {
+    struct buffer_head *bh;
     uint64_t i;
+    int err;
 
-    pos = filp->f_pos;
-    inode = filp->f_dentry->d_inode;
-    sb = inode->i_sb;
-    hellofs_inode = HELLOFS_INODE(inode);
+    for (i = 0; i < block_count; i++) {
+        bh = hellofs_dir_bread(dir, HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO + i,
+                               1, &err);
+        if (!bh) {
+            return err;
+        }
+        brelse(bh);
+    }
+
+    HELLOFS_INODE(dir)->dir_index_block_count = block_count;
+    err = hellofs_index_fill(dir);
+    if (0 != err) {
+        HELLOFS_INODE(dir)->dir_index_block_count = 0;
+    }
+    mark_inode_dirty(dir);
+    return err;
+}
+
+/* Remove the index entry of a name which lived in leaf_block_no. Entries
+   after it in the probe sequence are shifted back into the hole unless
+   their home slot lies after the hole, so no tombstones are needed. */
+static int hellofs_index_remove(struct inode *dir, uint32_t hash,
+                                uint64_t leaf_block_no) {
+    struct hellofs_index_cursor hole = { .dir = dir, .bh = NULL };
+    struct hellofs_index_cursor scan = { .dir = dir, .bh = NULL };
+    struct hellofs_dir_index_entry *entry;
+    struct hellofs_dir_index_entry *moved;
+    uint64_t size, n, home;
+    int err = -ENOENT;
+
+    size = hellofs_dir_index_size(dir);
+    hole.slot = hash % size;
+    for (n = 0; n < size; n++) {
+        entry = hellofs_index_entry(&hole, &err);
+        if (!entry) {
+            goto out;
+        }
+        if (HELLOFS_DIR_INDEX_EMPTY == entry->leaf_block_no) {
+            err = -ENOENT;
+            goto out;
+        }
+        if (entry->hash == hash && entry->leaf_block_no == leaf_block_no) {
+            break;
+        }
+        hole.slot = (hole.slot + 1) % size;
+    }
+    if (n == size) {
+        err = -ENOENT;
+        goto out;
+    }
+
+    scan.slot = hole.slot;
+    for (;;) {
+        scan.slot = (scan.slot + 1) % size;
+        moved = hellofs_index_entry(&scan, &err);
+        if (!moved) {
+            goto out;
+        }
+        if (HELLOFS_DIR_INDEX_EMPTY == moved->leaf_block_no) {
+            break;
+        }
+
+        home = moved->hash % size;
+        if (hole.slot < scan.slot ? (hole.slot < home && home <= scan.slot)
+                                  : (hole.slot < home || home <= scan.slot)) {
+            continue;
+        }
+
+        entry = hellofs_index_entry(&hole, &err);
+        if (!entry) {
+            goto out;
+        }
+        *entry = *moved;
+        hellofs_journal_dirty_inode(hole.bh, dir);
+        hole.slot = scan.slot;
+    }
+
+    entry = hellofs_index_entry(&hole, &err);
+    if (!entry) {
+        goto out;
+    }
+    entry->hash = HELLOFS_DIR_INDEX_EMPTY;
+    entry->leaf_block_no = HELLOFS_DIR_INDEX_EMPTY;
+    hellofs_journal_dirty_inode(hole.bh, dir);
+    err = 0;
+
+out:
+    brelse(scan.bh);
+    brelse(hole.bh);
+    return err;
+}
+
+/* Where a record lives, the leaf buffer is referenced */
+struct hellofs_dir_slot {
+    uint64_t leaf_block_no;
+    struct buffer_head *bh;
+    struct hellofs_dir_record *dir_record;
+    struct hellofs_dir_record *prev;
+};
+
+/* Look name up in directory dir. Small directories are a single leaf
+   block, larger ones go through the hash index so that only the leaf
+   blocks holding a matching hash are read. */
+static int hellofs_dir_find(struct inode *dir, const struct qstr *name,
+                            struct hellofs_dir_slot *slot) {
+    struct super_block *sb;
+    struct hellofs_index_cursor cursor = { .dir = dir, .bh = NULL };
+    struct hellofs_dir_index_entry *entry;
+    uint64_t size, n, leaf;
+    uint32_t hash;
+    int err = 0;
+
+    sb = dir->i_sb;
+
+    if (0 == HELLOFS_INODE(dir)->dir_index_block_count) {
+        for (leaf = 0; leaf < hellofs_dir_leaf_count(dir); leaf++) {
+            slot->bh = hellofs_dir_bread(dir, leaf, 0, &err);
+            if (!slot->bh) {
+                return err ? err : -EIO;
+            }
+            err = hellofs_leaf_find(sb, slot->bh, name, &slot->dir_record,
+                                    &slot->prev);
+            if (-ENOENT != err) {
+                if (0 != err) {
+                    brelse(slot->bh);
+                }
+                slot->leaf_block_no = leaf;
+                return err;
+            }
+            brelse(slot->bh);
+        }
+        return -ENOENT;
+    }
+
+    hash = hellofs_name_hash(name->name, name->len);
+    size = hellofs_dir_index_size(dir);
+    cursor.slot = hash % size;
+    err = -ENOENT;
+    for (n = 0; n < size; n++) {
+        entry = hellofs_index_entry(&cursor, &err);
+        if (!entry) {
+            break;
+        }
+        if (HELLOFS_DIR_INDEX_EMPTY == entry->leaf_block_no) {
+            err = -ENOENT;
+            break;
+        }
+        if (entry->hash == hash) {
+            leaf = entry->leaf_block_no;
+            slot->bh = hellofs_dir_bread(dir, leaf, 0, &err);
+            if (!slot->bh) {
+                err = err ? err : -EIO;
+                break;
+            }
+            err = hellofs_leaf_find(sb, slot->bh, name, &slot->dir_record,
+                                    &slot->prev);
+            if (-ENOENT != err) {
+                if (0 != err) {
+                    brelse(slot->bh);
+                }
+                slot->leaf_block_no = leaf;
+                break;
+            }
+            brelse(slot->bh);
+        }
+        cursor.slot = (cursor.slot + 1) % size;
+        err = -ENOENT;
+    }
+
+    brelse(cursor.bh);
+    return err;
+}
+
+int hellofs_find_dir_record(struct inode *dir, const struct qstr *name,
+                            uint64_t *out_inode_no) {
+    struct hellofs_dir_slot slot;
+    int err;
+
+    err = hellofs_dir_find(dir, name, &slot);
+    if (0 == err) {
+        *out_inode_no = slot.dir_record->inode_no;
+        brelse(slot.bh);
+    }
+    return err;
+}
+
+/* Add a record to a leaf with enough room: the leaf which last had a
+   record deleted, then the last leaf. Should both be full, the leaf gaps
+   are read into a free space map which finds any leaf with room from then
+   on, else a new leaf is appended. Keeps the index up to date, if that
+   fails the record is taken out again so that the caller can drop the
+   inode. Caller holds dir->i_mutex. */
+int hellofs_add_dir_record(struct super_block *sb, struct inode *dir,
+                           struct dentry *dentry, struct inode *inode) {
+    struct hellofs_inode *parent_hellofs_inode;
+    struct hellofs_dir_record *dir_record;
+    struct hellofs_dir_record *prev;
+    struct buffer_head *bh;
+    uint64_t candidates[2];
+    uint64_t leaf, leaf_count, index_size;
+    uint8_t file_type;
+    int i;
+    int err;
+
+    parent_hellofs_inode = HELLOFS_INODE(dir);
+    file_type = HELLOFS_FILE_TYPE(inode->i_mode);
+
+    if (dentry->d_name.len > HELLOFS_FILENAME_MAXLEN) {
+        return -ENAMETOOLONG;
+    }
+
+    leaf_count = hellofs_dir_leaf_count(dir);
+    candidates[0] = parent_hellofs_inode->dir_free_leaf_block_no;
+    candidates[1] = leaf_count - 1;
+
+    err = -ENOSPC;
+    for (i = 0; i < 2 && -ENOSPC == err && !HELLOFS_I(dir)->dir_leaf_gaps;
+            i++) {
+        leaf = candidates[i];
+        if (leaf >= leaf_count || (1 == i && leaf == candidates[0])) {
+            continue;
+        }
+        bh = hellofs_dir_bread(dir, leaf, 0, &err);
+        if (!bh) {
+            return err ? err : -EIO;
+        }
+        err = hellofs_leaf_add(sb, bh, &dentry->d_name, inode->i_ino,
+                               file_type);
+        if (0 != err) {
+            brelse(bh);
+        }
+    }
+    if (-ENOSPC == err && leaf_count > 1) {
+        if (!HELLOFS_I(dir)->dir_leaf_gaps) {
+            err = hellofs_dir_gaps_load(dir);
+            if (0 != err) {
+                return err;
+            }
+        }
+        err = -ENOSPC;
+        leaf = hellofs_dir_gaps_find(
+                   dir, HELLOFS_DIR_REC_LEN(dentry->d_name.len));
+        if (leaf < leaf_count) {
+            bh = hellofs_dir_bread(dir, leaf, 0, &err);
+            if (!bh) {
+                return err ? err : -EIO;
+            }
+            err = hellofs_leaf_add(sb, bh, &dentry->d_name, inode->i_ino,
+                                   file_type);
+            if (0 != err) {
+                brelse(bh);
+            }
+        }
+    }
+    if (-ENOSPC == err) {
+        leaf = leaf_count;
+        bh = hellofs_dir_bread(dir, leaf, 1, &err);
+        if (!bh) {
+            return err;
+        }
+        hellofs_leaf_init(sb, bh);
+        err = hellofs_leaf_add(sb, bh, &dentry->d_name, inode->i_ino,
+                               file_type);
+        parent_hellofs_inode->file_size = (leaf + 1) << sb->s_blocksize_bits;
+        i_size_write(dir, parent_hellofs_inode->file_size);
+        if (0 != err) {
+            hellofs_journal_dirty_inode(bh, dir);
+            hellofs_dir_gaps_update(dir, leaf, bh);
+            brelse(bh);
+        }
+    }
+    if (0 != err) {
+        return err;
+    }
+    hellofs_journal_dirty_inode(bh, dir);
+    hellofs_dir_gaps_update(dir, leaf, bh);
+    if (leaf != parent_hellofs_inode->dir_free_leaf_block_no) {
+        /* The hinted leaf is full, try this one next time */
+        parent_hellofs_inode->dir_free_leaf_block_no = leaf;
+    }
+
+    parent_hellofs_inode->dir_children_count += 1;
+    mark_inode_dirty(dir);
+
+    /* Index the directory once it outgrows one leaf, and grow the index
+       whenever it becomes 3/4 full. An index lost to a failed rebuild is
+       sized for all the children when it is built again. */
+    index_size = hellofs_dir_index_size(dir);
+    if (0 == index_size
+            || parent_hellofs_inode->dir_children_count * 4
+               > index_size * 3) {
+        if (hellofs_dir_leaf_count(dir) > 1) {
+            err = hellofs_index_build(
+                dir, hellofs_index_block_count(
+                         dir, parent_hellofs_inode->dir_children_count));
+        }
+    } else {
+        err = hellofs_index_insert(
+            dir, hellofs_name_hash(dentry->d_name.name, dentry->d_name.len),
+            leaf);
+    }
+
+    if (0 != err) {
+        if (0 == hellofs_leaf_find(sb, bh, &dentry->d_name, &dir_record,
+                                   &prev)) {
+            hellofs_leaf_delete(dir_record, prev);
+            hellofs_journal_dirty_inode(bh, dir);
+            hellofs_dir_gaps_update(dir, leaf, bh);
+        }
+        parent_hellofs_inode->dir_children_count -= 1;
+        mark_inode_dirty(dir);
+    }
+    brelse(bh);
+    return err;
+}
+
+/* Remove name from directory dir, its space merges into the previous
+   record of the leaf. Caller holds dir->i_mutex. */
+int hellofs_delete_dir_record(struct inode *dir, const struct qstr *name) {
+    struct hellofs_inode *parent_hellofs_inode;
+    struct hellofs_dir_slot slot;
+    int err;
+
+    parent_hellofs_inode = HELLOFS_INODE(dir);
 
-    if (pos) {
-        // TODO @Sankar: we use a hack of reading pos to figure if we have filled in data.
+    err = hellofs_dir_find(dir, name, &slot);
+    if (0 != err) {
+        return err;
+    }
+
+    hellofs_leaf_delete(slot.dir_record, slot.prev);
+    hellofs_journal_dirty_inode(slot.bh, dir);
+    hellofs_dir_gaps_update(dir, slot.leaf_block_no, slot.bh);
+    brelse(slot.bh);
+
+    parent_hellofs_inode->dir_children_count -= 1;
+    parent_hellofs_inode->dir_free_leaf_block_no = slot.leaf_block_no;
+    mark_inode_dirty(dir);
+
+    if (0 == parent_hellofs_inode->dir_index_block_count) {
         return 0;
     }
+    return hellofs_index_remove(dir, hellofs_name_hash(name->name, name->len),
+                                slot.leaf_block_no);
+}
+
+static const unsigned char hellofs_dt_types[] = {
+    [HELLOFS_FT_UNKNOWN] = DT_UNKNOWN,
+    [HELLOFS_FT_REG_FILE] = DT_REG,
+    [HELLOFS_FT_DIR] = DT_DIR,
+};
+
+static inline unsigned char hellofs_dt_type(
+        struct hellofs_dir_record *dir_record) {
+    if (dir_record->file_type >= ARRAY_SIZE(hellofs_dt_types)) {
+        return DT_UNKNOWN;
+    }
+    return hellofs_dt_types[dir_record->file_type];
+}
 
-    printk(KERN_INFO "readdir: hellofs_inode->inode_no=%llu", hellofs_inode->inode_no);
+/* Start reads of the inode table blocks of the records of a leaf from
+   offset start on, so that the stat() calls which usually follow readdir
+   find them cached instead of reading them one at a time. Inodes created
+   together share a table block, only changes of block are issued. */
+static void hellofs_dir_readahead_inodes(struct super_block *sb,
+                                         struct buffer_head *bh,
+                                         uint64_t start) {
+    struct hellofs_superblock *hellofs_sb;
+    struct hellofs_dir_record *dir_record;
+    struct blk_plug plug;
+    uint64_t offset;
+    uint64_t block_no;
+    uint64_t last_block_no;
+
+    hellofs_sb = HELLOFS_SB(sb);
+    last_block_no = HELLOFS_SUPERBLOCK_BLOCK_NO;
+
+    blk_start_plug(&plug);
+    for (offset = 0; offset < sb->s_blocksize;
+            offset += dir_record->rec_len) {
+        dir_record = (struct hellofs_dir_record *)(bh->b_data + offset);
+        if (unlikely(!hellofs_dir_record_ok(sb, dir_record, offset))) {
+            break;
+        }
+        if (offset < start || 0 == dir_record->name_len
+                || dir_record->inode_no >= hellofs_sb->inode_table_size) {
+            continue;
+        }
+
+        block_no = HELLOFS_INODE_BLOCK_NO(sb, dir_record->inode_no);
+        if (block_no != last_block_no) {
+            sb_breadahead(sb, block_no);
+            last_block_no = block_no;
+        }
+    }
+    blk_finish_plug(&plug);
+}
+
+/* The position of a record is its byte offset in the leaf area, i.e.
+   leaf block * blocksize + offset in the block. Records never move, so a
+   position stays valid between calls. A position whose record was merged
+   away by a deletion resumes at the next record. */
+static int hellofs_iterate_leaves(struct inode *dir, struct dir_context *ctx,
+                                  uint64_t *entries, uint64_t *blocks) {
+    struct super_block *sb;
+    struct buffer_head *bh;
+    struct hellofs_dir_record *dir_record;
+    uint64_t leaf, offset;
+    loff_t pos;
+    int err;
+
+    sb = dir->i_sb;
+
+    for (leaf = ctx->pos >> sb->s_blocksize_bits;
+            leaf < hellofs_dir_leaf_count(dir); leaf++) {
+        bh = hellofs_dir_bread(dir, leaf, 0, &err);
+        if (!bh) {
+            return err ? err : -EIO;
+        }
+        *blocks += 1;
+
+        pos = leaf << sb->s_blocksize_bits;
+        hellofs_dir_readahead_inodes(sb, bh,
+                                     ctx->pos > pos ? ctx->pos - pos : 0);
+
+        for (offset = 0; offset < sb->s_blocksize;
+                offset += dir_record->rec_len) {
+            dir_record = (struct hellofs_dir_record *)(bh->b_data + offset);
+            if (unlikely(!hellofs_dir_record_ok(sb, dir_record, offset))) {
+                brelse(bh);
+                return -EIO;
+            }
+
+            pos = (leaf << sb->s_blocksize_bits) + offset;
+            if (pos < ctx->pos) {
+                continue;
+            }
+            ctx->pos = pos;
+            if (0 == dir_record->name_len) {
+                continue;
+            }
+
+            /* Stop when the user buffer is full, this record is emitted
+               first by the next call */
+            if (!dir_emit(ctx, dir_record->filename, dir_record->name_len,
+                          dir_record->inode_no, hellofs_dt_type(dir_record))) {
+                brelse(bh);
+                return 0;
+            }
+            *entries += 1;
+        }
+        brelse(bh);
+
+        ctx->pos = (leaf + 1) << sb->s_blocksize_bits;
+    }
+
+    return 0;
+}
+
+int hellofs_iterate(struct file *filp, struct dir_context *ctx) {
+    struct inode *inode;
+    struct hellofs_inode *hellofs_inode;
+    uint64_t entries, blocks;
+    loff_t start_pos;
+    ktime_t start;
+    int ret;
+
+    inode = filp->f_dentry->d_inode;
+    hellofs_inode = HELLOFS_INODE(inode);
 
     if (unlikely(!S_ISDIR(hellofs_inode->mode))) {
         printk(KERN_ERR
@@ -29,18 +911,28 @@ int hellofs_readdir(struct file *filp, void *dirent, filldir_t filldir) {
         return -ENOTDIR;
     }
 
-    bh = sb_bread(sb, hellofs_inode->data_block_no);
-    BUG_ON(!bh);
+    start = ktime_get();
+    start_pos = ctx->pos;
+    entries = 0;
+    blocks = 0;
+    ret = hellofs_iterate_leaves(inode, ctx, &entries, &blocks);
+    trace_hellofs_readdir(inode, start_pos, ctx->pos, entries, blocks, ret,
+                          hellofs_stat_end(inode->i_sb, HELLOFS_STAT_READDIR,
+                                           start, blocks));
+    return ret;
+}
 
-    dir_record = (struct hellofs_dir_record *)bh->b_data;
-    for (i = 0; i < hellofs_inode->dir_children_count; i++) {
-        filldir(dirent, dir_record->filename, HELLOFS_FILENAME_MAXLEN, pos,
-                dir_record->inode_no, DT_UNKNOWN);
-        filp->f_pos += sizeof(struct hellofs_dir_record);
-        pos += sizeof(struct hellofs_dir_record);
-        dir_record++;
-    }
-    brelse(bh);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 11, 0)
+int hellofs_readdir(struct file *filp, void *dirent, filldir_t filldir) {
+    struct dir_context ctx = {
+        .actor = filldir,
+        .dirent = dirent,
+        .pos = filp->f_pos,
+    };
+    int ret;
 
-    return 0;
+    ret = hellofs_iterate(filp, &ctx);
+    filp->f_pos = ctx.pos;
+    return ret;
 }
+#endif
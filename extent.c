@@ -0,0 +1,468 @@
+#include "khellofs.h"
+
+/* Extents with index >= HELLOFS_INODE_EXTENTS live in the extent block,
+   whose buffer_head is passed in as bh. */
+static struct hellofs_extent *hellofs_extent_at(
+        struct hellofs_inode *hellofs_inode, struct buffer_head *bh,
+        uint64_t index) {
+    if (index < HELLOFS_INODE_EXTENTS) {
+        return &hellofs_inode->extents[index];
+    }
+    return (struct hellofs_extent *)bh->b_data
+           + (index - HELLOFS_INODE_EXTENTS);
+}
+
+/* Returns NULL if the inode has no extent block, ERR_PTR(-EIO) if it
+   can not be read */
+static struct buffer_head *hellofs_read_extent_block(
+        struct super_block *sb, struct hellofs_inode *hellofs_inode) {
+    struct buffer_head *bh;
+
+    if (0 == hellofs_inode->extent_block_no) {
+        return NULL;
+    }
+
+    bh = sb_bread(sb, hellofs_inode->extent_block_no);
+    if (!bh) {
+        printk(KERN_ERR "Unable to read extent block %llu of inode %llu\n",
+               hellofs_inode->extent_block_no, hellofs_inode->inode_no);
+        return ERR_PTR(-EIO);
+    }
+    return bh;
+}
+
+/* Binary search the last extent whose logical_block_no <= iblock.
+   Returns extent_count if there is no such extent. */
+static uint64_t hellofs_extent_search(struct hellofs_inode *hellofs_inode,
+                                      struct buffer_head *bh,
+                                      uint64_t iblock) {
+    uint64_t lo, hi, mid;
+
+    lo = 0;
+    hi = hellofs_inode->extent_count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (hellofs_extent_at(hellofs_inode, bh, mid)->logical_block_no
+                <= iblock) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+
+    return lo > 0 ? lo - 1 : hellofs_inode->extent_count;
+}
+
+/* Map iblock through the extent which holds it. Returns -ENOENT if it
+   is a hole. */
+static int hellofs_extent_lookup(struct hellofs_inode *hellofs_inode,
+                                 struct buffer_head *bh, uint64_t iblock,
+                                 uint64_t *out_block_no, uint64_t *out_count) {
+    struct hellofs_extent *extent;
+    uint64_t i;
+
+    i = hellofs_extent_search(hellofs_inode, bh, iblock);
+    if (i < hellofs_inode->extent_count) {
+        extent = hellofs_extent_at(hellofs_inode, bh, i);
+        if (iblock < extent->logical_block_no + extent->length) {
+            *out_block_no = extent->physical_block_no
+                            + (iblock - extent->logical_block_no);
+            *out_count = extent->length
+                         - (iblock - extent->logical_block_no);
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+int hellofs_extent_map(struct inode *inode, uint64_t iblock,
+                       uint64_t *out_block_no, uint64_t *out_count) {
+    struct super_block *sb = inode->i_sb;
+    struct hellofs_inode *hellofs_inode = HELLOFS_INODE(inode);
+    struct buffer_head *bh;
+    int ret;
+
+    down_read(&HELLOFS_I(inode)->extent_sem);
+    bh = hellofs_read_extent_block(sb, hellofs_inode);
+    if (IS_ERR(bh)) {
+        ret = PTR_ERR(bh);
+        goto out;
+    }
+
+    ret = hellofs_extent_lookup(hellofs_inode, bh, iblock, out_block_no,
+                                out_count);
+
+    brelse(bh);
+out:
+    up_read(&HELLOFS_I(inode)->extent_sem);
+    return ret;
+}
+
+/* Allocate an empty extent block when extents first spill out of the inode.
+   The block is kept afterwards, extent_block_no == 0 means there is none. */
+static struct buffer_head *hellofs_new_extent_block(
+        struct super_block *sb, struct hellofs_inode *hellofs_inode,
+        uint64_t goal, int reserved) {
+    struct buffer_head *bh;
+    uint64_t count;
+    int ret;
+
+    ret = hellofs_alloc_data_blocks(sb, goal, 1, reserved,
+                                    &hellofs_inode->extent_block_no, &count);
+    if (0 != ret) {
+        return ERR_PTR(ret);
+    }
+
+    bh = sb_getblk(sb, hellofs_inode->extent_block_no);
+    if (unlikely(!bh)) {
+        hellofs_free_data_blocks(sb, hellofs_inode->extent_block_no, 1);
+        hellofs_inode->extent_block_no = 0;
+        return ERR_PTR(-ENOMEM);
+    }
+    lock_buffer(bh);
+    memset(bh->b_data, 0, bh->b_size);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    return bh;
+}
+
+/* Record that length file blocks from iblock, currently a hole, are
+   backed by data blocks from block_no. Merges into the neighbouring
+   extents when they are contiguous on disk, otherwise inserts a new
+   extent. bh is the extent block, if the inode has one, and is released
+   here. delayed is set when the blocks were delayed, an extent block
+   they need may come out of their reservation. The caller dirties the
+   inode. */
+static int hellofs_extent_insert(struct inode *inode, struct buffer_head *bh,
+                                 uint64_t iblock, uint64_t block_no,
+                                 uint64_t length, int delayed) {
+    struct super_block *sb = inode->i_sb;
+    struct hellofs_inode *hellofs_inode = HELLOFS_INODE(inode);
+    struct hellofs_superblock *hellofs_sb;
+    struct hellofs_extent *prev, *next;
+    uint64_t i, pos, count;
+    int ret;
+
+    hellofs_sb = HELLOFS_SB(sb);
+    count = hellofs_inode->extent_count;
+
+    i = hellofs_extent_search(hellofs_inode, bh, iblock);
+    prev = NULL;
+    next = NULL;
+    if (i < count) {
+        prev = hellofs_extent_at(hellofs_inode, bh, i);
+        pos = i + 1;
+    } else {
+        pos = 0;
+    }
+    if (pos < count) {
+        next = hellofs_extent_at(hellofs_inode, bh, pos);
+    }
+
+    if (prev && prev->logical_block_no + prev->length == iblock
+            && prev->physical_block_no + prev->length == block_no) {
+        prev->length += length;
+        if (next && next->logical_block_no == iblock + length
+                && next->physical_block_no == block_no + length) {
+            /* The new block bridges prev and next, drop next */
+            prev->length += next->length;
+            for (i = pos; i + 1 < count; i++) {
+                *hellofs_extent_at(hellofs_inode, bh, i)
+                    = *hellofs_extent_at(hellofs_inode, bh, i + 1);
+            }
+            hellofs_inode->extent_count -= 1;
+        }
+        ret = 0;
+        goto out;
+    }
+
+    if (next && next->logical_block_no == iblock + length
+            && next->physical_block_no == block_no + length) {
+        next->logical_block_no -= length;
+        next->physical_block_no -= length;
+        next->length += length;
+        ret = 0;
+        goto out;
+    }
+
+    if (count >= HELLOFS_MAX_EXTENTS_HSB(hellofs_sb)) {
+        ret = -EFBIG;
+        goto out;
+    }
+    if (count >= HELLOFS_INODE_EXTENTS && !bh) {
+        /* Before the new run rather than after it, where the run grows */
+        bh = hellofs_new_extent_block(
+            sb, hellofs_inode, block_no - 1,
+            delayed && ACCESS_ONCE(HELLOFS_I(inode)->reserved_extent_blocks));
+        if (IS_ERR(bh)) {
+            ret = PTR_ERR(bh);
+            bh = NULL;
+            goto out;
+        }
+    }
+
+    for (i = count; i > pos; i--) {
+        *hellofs_extent_at(hellofs_inode, bh, i)
+            = *hellofs_extent_at(hellofs_inode, bh, i - 1);
+    }
+    next = hellofs_extent_at(hellofs_inode, bh, pos);
+    next->logical_block_no = iblock;
+    next->physical_block_no = block_no;
+    next->length = length;
+    hellofs_inode->extent_count += 1;
+    ret = 0;
+
+out:
+    if (bh) {
+        if (0 == ret) {
+            /* Committed with the inode, or flushed by writeback and
+               fsync of the inode without a journal */
+            hellofs_journal_dirty_inode(bh, inode);
+        }
+        brelse(bh);
+    }
+    return ret;
+}
+
+/* Prefer the block right after the nearest extent before iblock, so that
+   sequential writes keep extending it. The first block of an inode goes
+   to the data block table of the inode's group, and so does the first
+   directory index block, which lies far past the last leaf extent. */
+static uint64_t hellofs_extent_goal(struct super_block *sb,
+                                    struct hellofs_inode *hellofs_inode,
+                                    struct buffer_head *bh,
+                                    uint64_t iblock) {
+    struct hellofs_extent *extent;
+    uint64_t goal;
+    uint64_t i;
+
+    i = hellofs_extent_search(hellofs_inode, bh, iblock);
+    if (i < hellofs_inode->extent_count
+            && iblock >= HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO
+            && hellofs_extent_at(hellofs_inode, bh, i)->logical_block_no
+               < HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO) {
+        i = hellofs_inode->extent_count;
+    }
+    if (i < hellofs_inode->extent_count) {
+        extent = hellofs_extent_at(hellofs_inode, bh, i);
+        goal = extent->physical_block_no
+               + (iblock - extent->logical_block_no);
+    } else {
+        goal = HELLOFS_GROUP_DESC(sb, HELLOFS_INODE_GROUP_NO_HSB(
+                   HELLOFS_SB(sb), hellofs_inode->inode_no))
+               ->data_block_table_block_no;
+    }
+
+    return goal;
+}
+
+/* How many of the max_blocks file blocks from iblock, which is a hole,
+   the hole spans */
+static uint64_t hellofs_extent_hole_length(struct hellofs_inode *hellofs_inode,
+                                           struct buffer_head *bh,
+                                           uint64_t iblock,
+                                           uint64_t max_blocks) {
+    struct hellofs_extent *next;
+    uint64_t i;
+
+    i = hellofs_extent_search(hellofs_inode, bh, iblock);
+    i = i < hellofs_inode->extent_count ? i + 1 : 0;
+    if (i < hellofs_inode->extent_count) {
+        next = hellofs_extent_at(hellofs_inode, bh, i);
+        max_blocks = min(max_blocks, next->logical_block_no - iblock);
+    }
+
+    return max_blocks;
+}
+
+/* Allocate data blocks for up to max_blocks file blocks of the hole at
+   iblock, as one contiguous run. Returns the run in out_block_no and
+   out_count, which may be shorter than asked for, and sets out_new.
+   Besides the write path under i_mutex, page faults and writeback
+   allocate without it, so the extents are guarded by extent_sem. Direct
+   I/O holds only i_mutex and writeback only the page lock, so the hole
+   may have been filled since the caller looked. Its mapping is returned
+   then, with out_new cleared. The handle is started first, a commit never
+   waits for extent_sem. delayed is set when the blocks are for delayed
+   blocks, which hold reservations. Other allocations leave an extent
+   for each run of those, so that writeback does not run out of extents
+   as long as it finds each run a contiguous range of free blocks. */
+int hellofs_extent_alloc(struct inode *inode, uint64_t iblock,
+                         uint64_t max_blocks, int delayed,
+                         uint64_t *out_block_no, uint64_t *out_count,
+                         int *out_new) {
+    struct super_block *sb = inode->i_sb;
+    struct hellofs_inode *hellofs_inode = HELLOFS_INODE(inode);
+    struct hellofs_handle handle;
+    struct buffer_head *bh;
+    uint64_t reserved;
+    int ret;
+
+    *out_new = 0;
+    max_blocks = max(max_blocks, 1ULL);
+
+    hellofs_journal_start(sb, &handle);
+    down_write(&HELLOFS_I(inode)->extent_sem);
+    bh = hellofs_read_extent_block(sb, hellofs_inode);
+    if (IS_ERR(bh)) {
+        ret = PTR_ERR(bh);
+        goto out;
+    }
+
+    ret = hellofs_extent_lookup(hellofs_inode, bh, iblock, out_block_no,
+                                out_count);
+    if (0 == ret) {
+        *out_count = min(*out_count, max_blocks);
+        brelse(bh);
+        goto out;
+    }
+
+    reserved = ACCESS_ONCE(HELLOFS_I(inode)->delayed_run_count);
+    if (!delayed && 0 != reserved
+            && hellofs_inode->extent_count + reserved
+               >= HELLOFS_MAX_EXTENTS_HSB(HELLOFS_SB(sb))) {
+        ret = -EFBIG;
+        brelse(bh);
+        goto out;
+    }
+
+    max_blocks = hellofs_extent_hole_length(hellofs_inode, bh, iblock,
+                                            max_blocks);
+    ret = hellofs_alloc_data_blocks(
+        sb, hellofs_extent_goal(sb, hellofs_inode, bh, iblock), max_blocks,
+        delayed, out_block_no, out_count);
+    if (0 != ret) {
+        brelse(bh);
+        goto out;
+    }
+
+    ret = hellofs_extent_insert(inode, bh, iblock, *out_block_no,
+                                *out_count, delayed);
+    if (0 != ret) {
+        hellofs_free_data_blocks(sb, *out_block_no, *out_count);
+        goto out;
+    }
+
+    *out_new = 1;
+
+out:
+    up_write(&HELLOFS_I(inode)->extent_sem);
+    /* Copying the inode into its slot takes extent_sem */
+    if (*out_new) {
+        mark_inode_dirty(inode);
+    }
+    hellofs_journal_stop(&handle);
+    return ret;
+}
+
+/* Give back every data block of an inode, and its extent block. Called
+   when the last link is gone and nobody holds the inode any more. Nothing
+   is freed if the extent block can not be read. */
+int hellofs_extent_free_all(struct inode *inode) {
+    struct super_block *sb = inode->i_sb;
+    struct hellofs_inode *hellofs_inode = HELLOFS_INODE(inode);
+    struct buffer_head *bh;
+    struct hellofs_extent *extent;
+    uint64_t i, j;
+
+    bh = hellofs_read_extent_block(sb, hellofs_inode);
+    if (IS_ERR(bh)) {
+        return PTR_ERR(bh);
+    }
+    for (i = 0; i < hellofs_inode->extent_count; i++) {
+        extent = hellofs_extent_at(hellofs_inode, bh, i);
+        if (S_ISDIR(inode->i_mode)) {
+            /* Directory blocks are cached in the block device mapping,
+               drop them so that stale dirty buffers never hit the disk
+               once the blocks are reused */
+            for (j = 0; j < extent->length; j++) {
+                bforget(sb_find_get_block(sb, extent->physical_block_no + j));
+            }
+        }
+        hellofs_free_data_blocks(sb, extent->physical_block_no,
+                                 extent->length);
+    }
+    if (bh) {
+        bforget(bh);
+        hellofs_free_data_blocks(sb, hellofs_inode->extent_block_no, 1);
+        hellofs_inode->extent_block_no = 0;
+    }
+    hellofs_inode->extent_count = 0;
+    return 0;
+}
+
+/* Free the data blocks of the file blocks from iblock on, after the file
+   was truncated. An extent which straddles iblock is cut short. Once the
+   extents fit in the inode again the extent block goes too, unless
+   delayed blocks count on it. */
+int hellofs_extent_truncate(struct inode *inode, uint64_t iblock) {
+    struct super_block *sb = inode->i_sb;
+    struct hellofs_inode_info *hi = HELLOFS_I(inode);
+    struct hellofs_inode *hellofs_inode = HELLOFS_INODE(inode);
+    struct hellofs_handle handle;
+    struct buffer_head *bh;
+    struct hellofs_extent *extent;
+    uint64_t i, keep, cut;
+    uint64_t block_no;
+    int ret;
+
+    hellofs_journal_start(sb, &handle);
+    down_write(&hi->extent_sem);
+    bh = hellofs_read_extent_block(sb, hellofs_inode);
+    if (IS_ERR(bh)) {
+        ret = PTR_ERR(bh);
+        goto out;
+    }
+
+    keep = 0;
+    i = hellofs_extent_search(hellofs_inode, bh, iblock);
+    if (i < hellofs_inode->extent_count) {
+        extent = hellofs_extent_at(hellofs_inode, bh, i);
+        keep = i;
+        if (iblock > extent->logical_block_no) {
+            keep = i + 1;
+            if (iblock < extent->logical_block_no + extent->length) {
+                cut = iblock - extent->logical_block_no;
+                hellofs_free_data_blocks(sb, extent->physical_block_no + cut,
+                                         extent->length - cut);
+                extent->length = cut;
+            }
+        }
+    }
+    for (i = keep; i < hellofs_inode->extent_count; i++) {
+        extent = hellofs_extent_at(hellofs_inode, bh, i);
+        hellofs_free_data_blocks(sb, extent->physical_block_no,
+                                 extent->length);
+    }
+    hellofs_inode->extent_count = keep;
+
+    if (bh) {
+        /* hellofs_reserve_data_block() looks at extent_block_no under
+           reserve_lock */
+        block_no = 0;
+        spin_lock(&hi->reserve_lock);
+        if (keep <= HELLOFS_INODE_EXTENTS && 0 == hi->reserved_data_blocks) {
+            block_no = hellofs_inode->extent_block_no;
+            hellofs_inode->extent_block_no = 0;
+        }
+        spin_unlock(&hi->reserve_lock);
+
+        if (0 != block_no) {
+            bforget(bh);
+            hellofs_free_data_blocks(sb, block_no, 1);
+        } else {
+            hellofs_journal_dirty_inode(bh, inode);
+            brelse(bh);
+        }
+    }
+
+    ret = 0;
+
+out:
+    up_write(&hi->extent_sem);
+    if (0 == ret) {
+        mark_inode_dirty(inode);
+    }
+    hellofs_journal_stop(&handle);
+    return ret;
+}
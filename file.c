@@ -1,94 +1,562 @@
 #include "khellofs.h"
+#include "hellofs_trace.h"
 
-ssize_t hellofs_read(struct file *filp, char __user *buf, size_t len,
-                     loff_t *ppos) {
+/* Map file block iblock to a disk block through the inode's extents,
+   allocating data blocks for holes when create is set. A mapped block
+   reports in b_size how much of the requested range is contiguous on
+   disk, so that mpage builds one bio per extent. Holes are filled with
+   as long a run as the allocator finds for the requested range, direct
+   I/O asks for all of it at once. */
+int hellofs_get_block(struct inode *inode, sector_t iblock,
+                      struct buffer_head *bh_result, int create) {
     struct super_block *sb;
-    struct inode *inode;
-    struct hellofs_inode *hellofs_inode;
-    struct buffer_head *bh;
-    char *buffer;
-    int nbytes;
+    uint64_t block_no;
+    uint64_t count;
+    uint64_t max_blocks;
+    int delayed;
+    int new;
+    int ret;
 
-    inode = filp->f_path.dentry->d_inode;
     sb = inode->i_sb;
-    hellofs_inode = HELLOFS_INODE(inode);
-    
-    if (*ppos >= hellofs_inode->file_size) {
+    max_blocks = bh_result->b_size >> inode->i_blkbits;
+
+    ret = hellofs_extent_map(inode, iblock, &block_no, &count);
+    if (0 == ret) {
+        map_bh(bh_result, sb, block_no);
+        if (max_blocks > 1) {
+            bh_result->b_size = min(count, max_blocks) << inode->i_blkbits;
+        }
+        return 0;
+    }
+    if (-ENOENT != ret) {
+        return ret;
+    }
+    if (!create) {
+        /* A hole, report it a block at a time */
+        bh_result->b_size = 1 << inode->i_blkbits;
         return 0;
     }
 
-    bh = sb_bread(sb, hellofs_inode->data_block_no);
-    if (!bh) {
-        printk(KERN_ERR "Failed to read data block %llu\n",
-               hellofs_inode->data_block_no);
+    /* block_write_full_page() allocates the delayed blocks which
+       hellofs_writepages() did not, their reservation is used up */
+    delayed = buffer_delay(bh_result);
+    ret = hellofs_extent_alloc(inode, iblock, max_blocks, delayed, &block_no,
+                               &count, &new);
+    if (0 != ret) {
+        printk(KERN_ERR "Unable to allocate block %llu of inode %lu. "
+                        "Error code: %d\n",
+               (uint64_t)iblock, inode->i_ino, ret);
+        return ret;
+    }
+    if (delayed) {
+        hellofs_release_data_blocks(inode, iblock, count);
+    }
+
+    map_bh(bh_result, sb, block_no);
+    bh_result->b_size = count << inode->i_blkbits;
+    if (new) {
+        set_buffer_new(bh_result);
+    }
+    return 0;
+}
+
+/* Block a buffered write is about to fill. A hole only reserves a data
+   block, and the buffer is left unmapped with BH_Delay set, so that
+   mpage never writes it. The data block is chosen at writeback, when
+   the final size of the file and the dirty range are known. Writes to
+   a delayed block after the first one find it still reserved. */
+int hellofs_get_block_delay(struct inode *inode, sector_t iblock,
+                            struct buffer_head *bh_result, int create) {
+    int ret;
+
+    if (buffer_delay(bh_result)) {
         return 0;
     }
+    ret = hellofs_get_block(inode, iblock, bh_result, 0);
+    if (0 != ret || buffer_mapped(bh_result)) {
+        return ret;
+    }
+
+    ret = hellofs_reserve_data_block(inode, iblock);
+    if (0 != ret) {
+        return ret;
+    }
+    /* __block_write_begin() looks up b_blocknr of new buffers in the
+       block device, which holds no such block */
+    bh_result->b_bdev = inode->i_sb->s_bdev;
+    bh_result->b_blocknr = (sector_t)-1;
+    set_buffer_new(bh_result);
+    set_buffer_delay(bh_result);
+    return 0;
+}
+
+int hellofs_readpage(struct file *filp, struct page *page) {
+    struct inode *inode = page->mapping->host;
 
-    buffer = (char *)bh->b_data + *ppos;
-    nbytes = min((size_t)(hellofs_inode->file_size - *ppos), len);
+    if (hellofs_has_inline_data(inode)) {
+        return hellofs_inline_readpage(inode, page);
+    }
+    return mpage_readpage(page, hellofs_get_block);
+}
 
-    if (copy_to_user(buf, buffer, nbytes)) {
-        brelse(bh);
-        printk(KERN_ERR
-               "Error copying file content to userspace buffer\n");
-        return -EFAULT;
+/* Readahead maps whole extents at a time and merges them into large
+   bios. Inline files have nothing on disk, their pages are filled by
+   hellofs_readpage() when they are read. */
+int hellofs_readpages(struct file *filp, struct address_space *mapping,
+                      struct list_head *pages, unsigned nr_pages) {
+    if (hellofs_has_inline_data(mapping->host)) {
+        return 0;
     }
+    return mpage_readpages(mapping, pages, nr_pages, hellofs_get_block);
+}
 
-    brelse(bh);
-    *ppos += nbytes;
-    return nbytes;
+int hellofs_writepage(struct page *page, struct writeback_control *wbc) {
+    struct inode *inode = page->mapping->host;
+
+    if (hellofs_has_inline_data(inode)) {
+        return hellofs_inline_writepage(inode, page);
+    }
+    return block_write_full_page(page, hellofs_get_block, wbc);
 }
 
-/* TODO We didn't use address_space/pagecache here.
-   If we hook file_operations.write = do_sync_write,
-   and file_operations.aio_write = generic_file_aio_write,
-   we will use write to pagecache instead. */
-ssize_t hellofs_write(struct file *filp, const char __user *buf, size_t len,
-                      loff_t *ppos) {
-    struct super_block *sb;
-    struct inode *inode;
-    struct hellofs_inode *hellofs_inode;
-    struct buffer_head *bh;
-    struct hellofs_superblock *hellofs_sb;
-    char *buffer;
+/* Whether page may hold delayed blocks to be allocated by writeback */
+static int hellofs_delalloc_page(struct inode *inode, struct page *page,
+                                 pgoff_t end) {
+    return page->mapping == inode->i_mapping && page->index <= end
+           && PageDirty(page) && page_has_buffers(page);
+}
+
+/* Map the delayed buffers of the locked pages of pvec which fall in the
+   count file blocks from iblock to the data blocks from block_no */
+static void hellofs_delalloc_map_buffers(struct inode *inode,
+                                         struct pagevec *pvec, pgoff_t end,
+                                         uint64_t iblock, uint64_t block_no,
+                                         uint64_t count) {
+    struct buffer_head *head, *bh;
+    struct page *page;
+    uint64_t cur;
+    unsigned i;
+
+    for (i = 0; i < pagevec_count(pvec); i++) {
+        page = pvec->pages[i];
+        if (!hellofs_delalloc_page(inode, page, end)) {
+            continue;
+        }
+        cur = (uint64_t)page->index << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+        bh = head = page_buffers(page);
+        do {
+            if (buffer_delay(bh) && !buffer_mapped(bh)
+                    && cur >= iblock && cur < iblock + count) {
+                map_bh(bh, inode->i_sb, block_no + (cur - iblock));
+                clear_buffer_delay(bh);
+                unmap_underlying_metadata(bh->b_bdev, bh->b_blocknr);
+            }
+            cur += 1;
+        } while ((bh = bh->b_this_page) != head);
+    }
+}
+
+/* Allocate data blocks for a run of count delayed blocks from iblock,
+   as few extents as the free space allows */
+static int hellofs_delalloc_map_run(struct inode *inode,
+                                    struct pagevec *pvec, pgoff_t end,
+                                    uint64_t iblock, uint64_t count) {
+    uint64_t block_no;
+    uint64_t n;
+    int new;
     int ret;
 
-    inode = filp->f_path.dentry->d_inode;
-    sb = inode->i_sb;
-    hellofs_inode = HELLOFS_INODE(inode);
-    hellofs_sb = HELLOFS_SB(sb);
+    while (count > 0) {
+        ret = hellofs_extent_alloc(inode, iblock, count, 1, &block_no, &n,
+                                   &new);
+        if (0 != ret) {
+            return ret;
+        }
+        hellofs_delalloc_map_buffers(inode, pvec, end, iblock, block_no, n);
+        hellofs_release_data_blocks(inode, iblock, n);
+        iblock += n;
+        count -= n;
+    }
+    return 0;
+}
 
-    ret = generic_write_checks(filp, ppos, &len, 0);
-    if (ret) {
-        return ret;
+/* Allocate the delayed blocks of the locked pages of pvec, run by run */
+static int hellofs_delalloc_map_pagevec(struct inode *inode,
+                                        struct pagevec *pvec, pgoff_t end) {
+    struct buffer_head *head, *bh;
+    struct page *page;
+    uint64_t run_start = 0;
+    uint64_t run_count = 0;
+    uint64_t cur;
+    unsigned i;
+    int ret;
+
+    for (i = 0; i < pagevec_count(pvec); i++) {
+        page = pvec->pages[i];
+        if (!hellofs_delalloc_page(inode, page, end)) {
+            continue;
+        }
+        cur = (uint64_t)page->index << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+        bh = head = page_buffers(page);
+        do {
+            if (buffer_delay(bh) && !buffer_mapped(bh)) {
+                if (run_count > 0 && cur != run_start + run_count) {
+                    ret = hellofs_delalloc_map_run(inode, pvec, end,
+                                                   run_start, run_count);
+                    if (0 != ret) {
+                        return ret;
+                    }
+                    run_count = 0;
+                }
+                if (0 == run_count) {
+                    run_start = cur;
+                }
+                run_count += 1;
+            }
+            cur += 1;
+        } while ((bh = bh->b_this_page) != head);
+    }
+
+    if (run_count > 0) {
+        return hellofs_delalloc_map_run(inode, pvec, end, run_start,
+                                        run_count);
+    }
+    return 0;
+}
+
+/* Choose data blocks for the delayed blocks of the dirty pages writeback
+   is about to write, a pagevec of pages at a time. Each run continues
+   the extent before it, so a file written in small appends still ends
+   up in a few long extents. Blocks that fail to allocate here are tried
+   again by hellofs_writepage(), which reports the error. Pages dirtied
+   meanwhile keep unmapped delayed buffers, mpage hands those pages to
+   hellofs_writepage() as well. */
+static void hellofs_delalloc_map_pages(struct address_space *mapping,
+                                       struct writeback_control *wbc) {
+    struct inode *inode = mapping->host;
+    struct pagevec pvec;
+    pgoff_t index, end;
+    unsigned i, n;
+    int ret;
+
+    if (wbc->range_cyclic) {
+        index = 0;
+        end = -1;
+    } else {
+        index = wbc->range_start >> PAGE_CACHE_SHIFT;
+        end = wbc->range_end >> PAGE_CACHE_SHIFT;
+    }
+
+    pagevec_init(&pvec, 0);
+    ret = 0;
+    while (0 == ret && index <= end) {
+        n = pagevec_lookup_tag(&pvec, mapping, &index, PAGECACHE_TAG_DIRTY,
+                               min(end - index, (pgoff_t)PAGEVEC_SIZE - 1)
+                               + 1);
+        if (0 == n) {
+            break;
+        }
+        /* In index order, like write_cache_pages() */
+        for (i = 0; i < n; i++) {
+            lock_page(pvec.pages[i]);
+        }
+        ret = hellofs_delalloc_map_pagevec(inode, &pvec, end);
+        for (i = 0; i < n; i++) {
+            unlock_page(pvec.pages[i]);
+        }
+        pagevec_release(&pvec);
+        cond_resched();
+    }
+}
+
+/* Writeback walks the dirty pages and merges pages which are contiguous
+   on disk into large bios. Delayed blocks get their data blocks first.
+   Inline files go through hellofs_writepage(), which copies page 0 back
+   into the inode. */
+int hellofs_writepages(struct address_space *mapping,
+                       struct writeback_control *wbc) {
+    if (hellofs_has_inline_data(mapping->host)) {
+        return generic_writepages(mapping, wbc);
+    }
+    if (ACCESS_ONCE(HELLOFS_I(mapping->host)->reserved_data_blocks)) {
+        hellofs_delalloc_map_pages(mapping, wbc);
+    }
+    return mpage_writepages(mapping, wbc, hellofs_get_block);
+}
+
+/* Delayed blocks of the invalidated part of the page are never written,
+   give their reservations back */
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 11, 0)
+void hellofs_invalidatepage(struct page *page, unsigned long offset) {
+    unsigned int stop = PAGE_CACHE_SIZE;
+#else
+void hellofs_invalidatepage(struct page *page, unsigned int offset,
+                            unsigned int length) {
+    unsigned int stop = offset + length;
+#endif
+    struct inode *inode = page->mapping->host;
+    struct buffer_head *head, *bh;
+    unsigned int block_start = 0;
+    uint64_t iblock;
+
+    if (page_has_buffers(page)) {
+        iblock = (uint64_t)page->index
+                 << (PAGE_CACHE_SHIFT - inode->i_blkbits);
+        bh = head = page_buffers(page);
+        do {
+            if (block_start >= offset && block_start + bh->b_size <= stop
+                    && buffer_delay(bh)) {
+                clear_buffer_delay(bh);
+                hellofs_release_data_blocks(inode, iblock, 1);
+            }
+            block_start += bh->b_size;
+            iblock += 1;
+        } while ((bh = bh->b_this_page) != head);
     }
 
-    bh = sb_bread(sb, hellofs_inode->data_block_no);
-    if (!bh) {
-        printk(KERN_ERR "Failed to read data block %llu\n",
-               hellofs_inode->data_block_no);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 11, 0)
+    block_invalidatepage(page, offset);
+#else
+    block_invalidatepage(page, offset, length);
+#endif
+}
+
+/* A delayed block may not be reserved when the inode could not hold an
+   extent for each run of delayed blocks. Writeback allocates them, which
+   usually leaves them in a few extents. Their data blocks are chosen
+   before the pages are submitted, so the I/O is not waited for. Returns
+   whether there were any, i.e. whether it is worth trying again. */
+static int hellofs_delalloc_flush(struct inode *inode) {
+    if (0 == ACCESS_ONCE(HELLOFS_I(inode)->reserved_data_blocks)) {
         return 0;
     }
+    filemap_flush(inode->i_mapping);
+    return 1;
+}
+
+/* Drop what a failed write left past i_size: pages, the reservations of
+   their delayed blocks, and blocks direct I/O allocated */
+static void hellofs_write_failed(struct address_space *mapping, loff_t to) {
+    struct inode *inode = mapping->host;
+
+    if (to > inode->i_size) {
+        truncate_pagecache(inode, to, inode->i_size);
+        hellofs_extent_truncate(
+            inode, (inode->i_size + inode->i_sb->s_blocksize - 1)
+                   >> inode->i_sb->s_blocksize_bits);
+    }
+}
+
+int hellofs_write_begin(struct file *filp, struct address_space *mapping,
+                        loff_t pos, unsigned len, unsigned flags,
+                        struct page **pagep, void **fsdata) {
+    struct inode *inode = mapping->host;
+    int retried;
+    int ret;
+
+    /* Small files keep their data in the inode until a write outgrows it */
+    if (hellofs_has_inline_data(inode)) {
+        if (pos + len <= HELLOFS_INLINE_DATA_SIZE) {
+            return hellofs_inline_write_begin(mapping, pos, len, flags,
+                                              pagep);
+        }
+        ret = hellofs_inline_convert(inode, flags);
+        if (unlikely(ret)) {
+            return ret;
+        }
+    }
+
+    retried = 0;
+retry:
+    ret = block_write_begin(mapping, pos, len, flags, pagep,
+                            hellofs_get_block_delay);
+    if (unlikely(ret)) {
+        hellofs_write_failed(mapping, pos + len);
+        if (-EFBIG == ret && !retried && hellofs_delalloc_flush(inode)) {
+            retried = 1;
+            goto retry;
+        }
+    }
+    return ret;
+}
+
+/* generic_write_end() updates i_size and dirties the inode, the new size
+   reaches the on-disk inode through hellofs_dirty_inode(). File data is
+   left dirty in pagecache, holes only reserved, and writeback allocates
+   and flushes them. */
+int hellofs_write_end(struct file *filp, struct address_space *mapping,
+                      loff_t pos, unsigned len, unsigned copied,
+                      struct page *page, void *fsdata) {
+    int ret;
+
+    if (hellofs_has_inline_data(mapping->host)) {
+        return hellofs_inline_write_end(mapping, pos, len, copied, page);
+    }
+
+    ret = generic_write_end(filp, mapping, pos, len, copied, page, fsdata);
+    if (ret < len) {
+        hellofs_write_failed(mapping, pos + len);
+    }
+    return ret;
+}
+
+/* O_DIRECT moves data straight between user memory and the device
+   through hellofs_get_block(). Inline files have no blocks, returning 0
+   lets the caller fall back to the buffered path, which converts the
+   file when a write outgrows the inode. */
+ssize_t hellofs_direct_IO(int rw, struct kiocb *iocb,
+                          const struct iovec *iov, loff_t offset,
+                          unsigned long nr_segs) {
+    struct address_space *mapping = iocb->ki_filp->f_mapping;
+    struct inode *inode = mapping->host;
+    ssize_t ret;
+
+    if (hellofs_has_inline_data(inode)) {
+        return 0;
+    }
+
+    ret = blockdev_direct_IO(rw, iocb, inode, iov, offset, nr_segs,
+                             hellofs_get_block);
+    if (ret < 0 && (rw & WRITE)) {
+        hellofs_write_failed(mapping, offset + iov_length(iov, nr_segs));
+    }
+    return ret;
+}
+
+/* Delayed blocks have no block to report until they are written */
+sector_t hellofs_bmap(struct address_space *mapping, sector_t block) {
+    if (ACCESS_ONCE(HELLOFS_I(mapping->host)->reserved_data_blocks)) {
+        filemap_write_and_wait(mapping);
+    }
+    return generic_block_bmap(mapping, block, hellofs_get_block);
+}
+
+/* block_page_mkwrite(), trying again after writing back the delayed
+   blocks when the inode can not hold an extent for each run of them */
+static int hellofs_block_page_mkwrite(struct vm_area_struct *vma,
+                                      struct vm_fault *vmf) {
+    struct inode *inode = vma->vm_file->f_mapping->host;
+    int ret;
 
-    buffer = (char *)bh->b_data + *ppos;
-    if (copy_from_user(buffer, buf, len)) {
-        brelse(bh);
-        printk(KERN_ERR
-               "Error copying file content from userspace buffer "
-               "to kernel space\n");
-        return -EFAULT;
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vma->vm_file);
+    ret = __block_page_mkwrite(vma, vmf, hellofs_get_block_delay);
+    if (-EFBIG == ret && hellofs_delalloc_flush(inode)) {
+        ret = __block_page_mkwrite(vma, vmf, hellofs_get_block_delay);
     }
-    *ppos += len;
+    sb_end_pagefault(inode->i_sb);
+    return block_page_mkwrite_return(ret);
+}
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+/* Called before a page of a shared writable mapping is first written.
+   Blocks are reserved here rather than at writeback, so that a full
+   disk is reported to the faulting task instead of losing the data. */
+static int hellofs_page_mkwrite(struct vm_area_struct *vma,
+                                struct vm_fault *vmf) {
+    struct inode *inode = vma->vm_file->f_mapping->host;
+    struct page *page = vmf->page;
+    int ret;
 
-    hellofs_inode->file_size = max((size_t)(hellofs_inode->file_size),
-                                   (size_t)(*ppos));
-    hellofs_save_hellofs_inode(sb, hellofs_inode);
+    if (!hellofs_has_inline_data(inode)) {
+        return hellofs_block_page_mkwrite(vma, vmf);
+    }
 
-    /* TODO We didn't update file size here. To be frank I don't know how. */
+    /* An inline file can not grow through mmap, so the page is only
+       dirtied and hellofs_writepage() copies it back into the inode */
+    sb_start_pagefault(inode->i_sb);
+    file_update_time(vma->vm_file);
+    lock_page(page);
+    if (page->mapping != inode->i_mapping) {
+        unlock_page(page);
+        ret = VM_FAULT_NOPAGE;
+    } else if (!hellofs_has_inline_data(inode)) {
+        /* Converted by a write meanwhile */
+        unlock_page(page);
+        sb_end_pagefault(inode->i_sb);
+        return hellofs_block_page_mkwrite(vma, vmf);
+    } else {
+        set_page_dirty(page);
+        wait_for_stable_page(page);
+        ret = VM_FAULT_LOCKED;
+    }
+    sb_end_pagefault(inode->i_sb);
+    return ret;
+}
+
+static const struct vm_operations_struct hellofs_file_vm_ops = {
+    .fault = filemap_fault,
+    .page_mkwrite = hellofs_page_mkwrite,
+    .remap_pages = generic_file_remap_pages,
+};
+
+/* Pages are faulted in through the pagecache, i.e. hellofs_readpage() */
+int hellofs_file_mmap(struct file *file, struct vm_area_struct *vma) {
+    struct address_space *mapping = file->f_mapping;
+
+    if (!mapping->a_ops->readpage) {
+        return -ENOEXEC;
+    }
+
+    file_accessed(file);
+    vma->vm_ops = &hellofs_file_vm_ops;
+    return 0;
+}
 
-    return len;
+ssize_t hellofs_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
+                              unsigned long nr_segs, loff_t pos) {
+    struct inode *inode = iocb->ki_filp->f_mapping->host;
+    ktime_t start = ktime_get();
+    ssize_t ret;
+
+    ret = generic_file_aio_read(iocb, iov, nr_segs, pos);
+    trace_hellofs_read(inode, pos, ret,
+                       hellofs_stat_end(inode->i_sb, HELLOFS_STAT_READ, start,
+                                        ret > 0 ? ret : 0));
+    return ret;
+}
+
+ssize_t hellofs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
+                               unsigned long nr_segs, loff_t pos) {
+    struct inode *inode = iocb->ki_filp->f_mapping->host;
+    ktime_t start = ktime_get();
+    ssize_t ret;
+
+    ret = generic_file_aio_write(iocb, iov, nr_segs, pos);
+    trace_hellofs_write(inode, pos, ret,
+                        hellofs_stat_end(inode->i_sb, HELLOFS_STAT_WRITE,
+                                         start, ret > 0 ? ret : 0));
+    return ret;
+}
+
+/* With a journal the inode and the metadata it depends on joined a
+   transaction when they were changed, so writing the data and committing
+   that transaction is all there is to do. The commit flushes the disk
+   cache, if it is on disk already the cache is flushed alone, so fsync
+   pays for one flush. Without a journal, as in ext2, the bitmaps and
+   group descriptors the allocations changed are only marked dirty, and
+   generic_file_fsync() writes neither them nor the cache. Both are done
+   here, so that the blocks of the file are not handed out again after a
+   crash. */
+int hellofs_fsync(struct file *file, loff_t start, loff_t end, int datasync) {
+    struct inode *inode = file->f_mapping->host;
+    struct super_block *sb = inode->i_sb;
+    int ret;
+
+    if (HELLOFS_SB_INFO(sb)->journal) {
+        ret = filemap_write_and_wait_range(file->f_mapping, start, end);
+        if (0 != ret) {
+            return ret;
+        }
+        return hellofs_journal_fsync_inode(inode);
+    }
+
+    ret = generic_file_fsync(file, start, end, datasync);
+    if (0 != ret) {
+        return ret;
+    }
+    ret = sync_blockdev(sb->s_bdev);
+    if (0 != ret) {
+        return ret;
+    }
+    return blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
 }
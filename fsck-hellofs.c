@@ -0,0 +1,843 @@
+#include <unistd.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "hellofs.h"
+
+/* Checks a hellofs image. The directory tree is walked from the root by a
+   pool of threads, each taking directories from a shared queue, to build
+   the bitmaps the groups should have. These are then compared with the
+   bitmaps on disk a word at a time, again group by group in parallel.
+   With -y, the bitmaps, group free counts and superblock counts are
+   rewritten from the tree. Other damage is only reported.
+
+   Exit codes follow e2fsck: 0 clean, 1 errors corrected, 4 errors left
+   uncorrected, 8 operational error. */
+
+#define FSCK_OK 0
+#define FSCK_CORRECTED 1
+#define FSCK_UNCORRECTED 4
+#define FSCK_ERROR 8
+
+#define BITS_IN_WORD 64
+#define FSCK_MAX_THREADS 256
+
+struct fsck {
+    char *image;
+    size_t image_len;
+    int repair;
+
+    struct hellofs_superblock *hellofs_sb;
+    struct hellofs_group_desc *group_descs;
+
+    // Bitmaps rebuilt from the tree, words_per_bitmap words per group
+    uint64_t words_per_bitmap;
+    uint64_t *inode_bitmaps;
+    uint64_t *data_block_bitmaps;
+
+    // Directories waiting to be checked, and how many are being checked
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    uint64_t *dirs;
+    uint64_t dir_count;
+    uint64_t dir_capacity;
+    uint64_t busy;
+    int failed;
+
+    // Next group to compare
+    uint64_t next_group;
+
+    // Updated atomically
+    uint64_t errors;
+    uint64_t fixable_errors;
+    uint64_t inodes_seen;
+    uint64_t dirs_seen;
+    uint64_t blocks_seen;
+    // Set bits of the rebuilt bitmaps, summed by the group pass
+    uint64_t used_inodes;
+    uint64_t used_data_blocks;
+};
+
+static void fsck_error(struct fsck *fsck, int fixable, const char *fmt, ...) {
+    va_list args;
+
+    __atomic_fetch_add(fixable ? &fsck->fixable_errors : &fsck->errors, 1,
+                       __ATOMIC_RELAXED);
+
+    flockfile(stdout);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    putchar('\n');
+    funlockfile(stdout);
+}
+
+static inline char *fsck_block(struct fsck *fsck, uint64_t block_no) {
+    return fsck->image + block_no * fsck->hellofs_sb->blocksize;
+}
+
+static inline struct hellofs_inode *fsck_inode(struct fsck *fsck,
+                                               uint64_t inode_no) {
+    struct hellofs_superblock *hellofs_sb = fsck->hellofs_sb;
+    struct hellofs_group_desc *gd;
+    uint64_t offset;
+
+    gd = &fsck->group_descs[HELLOFS_INODE_GROUP_NO_HSB(hellofs_sb, inode_no)];
+    offset = inode_no % hellofs_sb->inodes_per_group;
+    return (struct hellofs_inode *)fsck_block(
+               fsck, gd->inode_table_block_no
+                     + offset / HELLOFS_INODES_PER_BLOCK_HSB(hellofs_sb))
+           + offset % HELLOFS_INODES_PER_BLOCK_HSB(hellofs_sb);
+}
+
+/* Set a bit of an expected bitmap. Returns the old value, so that a second
+   claim of the same inode or block is noticed. */
+static inline int fsck_mark(struct fsck *fsck, uint64_t *bitmaps,
+                            uint64_t group_no, uint64_t offset) {
+    uint64_t *word;
+    uint64_t bit;
+
+    word = bitmaps + group_no * fsck->words_per_bitmap + offset / BITS_IN_WORD;
+    bit = 1ULL << (offset % BITS_IN_WORD);
+    return 0 != (__atomic_fetch_or(word, bit, __ATOMIC_RELAXED) & bit);
+}
+
+/* Whether count blocks from block_no all lie in the data block table of
+   one group. Returns the group in out_group_no. */
+static int fsck_data_blocks_ok(struct fsck *fsck, uint64_t block_no,
+                               uint64_t count, uint64_t *out_group_no) {
+    struct hellofs_superblock *hellofs_sb = fsck->hellofs_sb;
+    struct hellofs_group_desc *gd;
+    uint64_t group_no;
+
+    if (0 == count
+            || block_no < HELLOFS_GROUP_START_BLOCK_NO_HSB(hellofs_sb, 0)
+            || block_no >= HELLOFS_TOTAL_BLOCKS_HSB(hellofs_sb)) {
+        return 0;
+    }
+    group_no = HELLOFS_BLOCK_GROUP_NO_HSB(hellofs_sb, block_no);
+    gd = &fsck->group_descs[group_no];
+    if (block_no < gd->data_block_table_block_no
+            || block_no - gd->data_block_table_block_no + count
+               > hellofs_sb->data_blocks_per_group) {
+        return 0;
+    }
+    *out_group_no = group_no;
+    return 1;
+}
+
+static void fsck_claim_blocks(struct fsck *fsck, uint64_t inode_no,
+                              uint64_t block_no, uint64_t count) {
+    struct hellofs_group_desc *gd;
+    uint64_t group_no;
+    uint64_t i;
+
+    if (!fsck_data_blocks_ok(fsck, block_no, count, &group_no)) {
+        fsck_error(fsck, 0, "Inode %llu: blocks %llu+%llu are not data blocks",
+                   (unsigned long long)inode_no, (unsigned long long)block_no,
+                   (unsigned long long)count);
+        return;
+    }
+
+    gd = &fsck->group_descs[group_no];
+    for (i = 0; i < count; i++) {
+        if (fsck_mark(fsck, fsck->data_block_bitmaps, group_no,
+                      block_no + i - gd->data_block_table_block_no)) {
+            fsck_error(fsck, 0, "Inode %llu: block %llu is used twice",
+                       (unsigned long long)inode_no,
+                       (unsigned long long)(block_no + i));
+        }
+    }
+    __atomic_fetch_add(&fsck->blocks_seen, count, __ATOMIC_RELAXED);
+}
+
+/* The extents of an inode are in the inode and then in its extent block */
+static struct hellofs_extent *fsck_extent_at(struct fsck *fsck,
+                                             struct hellofs_inode *inode,
+                                             uint64_t index) {
+    if (index < HELLOFS_INODE_EXTENTS) {
+        return &inode->extents[index];
+    }
+    return (struct hellofs_extent *)fsck_block(fsck, inode->extent_block_no)
+           + (index - HELLOFS_INODE_EXTENTS);
+}
+
+/* Map file block iblock, 0 if it is a hole. Only used on inodes whose
+   extents were checked. */
+static uint64_t fsck_bmap(struct fsck *fsck, struct hellofs_inode *inode,
+                          uint64_t iblock) {
+    struct hellofs_extent *extent;
+    uint64_t lo, hi, mid;
+
+    lo = 0;
+    hi = inode->extent_count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (fsck_extent_at(fsck, inode, mid)->logical_block_no <= iblock) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (0 == lo) {
+        return 0;
+    }
+    extent = fsck_extent_at(fsck, inode, lo - 1);
+    if (iblock >= extent->logical_block_no + extent->length) {
+        return 0;
+    }
+    return extent->physical_block_no + (iblock - extent->logical_block_no);
+}
+
+/* Check the fields of a reachable inode and claim its blocks. Returns 0
+   if the inode is sound enough for its contents to be looked at. */
+static int fsck_check_inode(struct fsck *fsck, uint64_t inode_no) {
+    struct hellofs_superblock *hellofs_sb = fsck->hellofs_sb;
+    struct hellofs_inode *inode;
+    struct hellofs_extent *extent;
+    uint64_t group_no;
+    uint64_t next_logical;
+    uint64_t i;
+    int ret;
+
+    inode = fsck_inode(fsck, inode_no);
+    __atomic_fetch_add(&fsck->inodes_seen, 1, __ATOMIC_RELAXED);
+
+    if (inode->inode_no != inode_no) {
+        fsck_error(fsck, 0, "Inode %llu: slot holds inode number %llu",
+                   (unsigned long long)inode_no,
+                   (unsigned long long)inode->inode_no);
+        return -1;
+    }
+    if (!S_ISDIR(inode->mode) && !S_ISREG(inode->mode)) {
+        fsck_error(fsck, 0, "Inode %llu: bad mode %o",
+                   (unsigned long long)inode_no, (unsigned int)inode->mode);
+        return -1;
+    }
+
+    if (inode->flags & HELLOFS_INODE_INLINE_DATA) {
+        ret = 0;
+        if (S_ISDIR(inode->mode)) {
+            fsck_error(fsck, 0, "Inode %llu: directory with inline data",
+                       (unsigned long long)inode_no);
+            ret = -1;
+        }
+        if (inode->file_size > HELLOFS_INLINE_DATA_SIZE) {
+            fsck_error(fsck, 0, "Inode %llu: inline size %llu is too large",
+                       (unsigned long long)inode_no,
+                       (unsigned long long)inode->file_size);
+            ret = -1;
+        }
+        if (0 != inode->extent_count || 0 != inode->extent_block_no) {
+            fsck_error(fsck, 0, "Inode %llu: inline inode has extents",
+                       (unsigned long long)inode_no);
+            ret = -1;
+        }
+        return ret;
+    }
+
+    if (inode->extent_count
+            > HELLOFS_INODE_EXTENTS + HELLOFS_EXTENTS_PER_BLOCK_HSB(hellofs_sb)) {
+        fsck_error(fsck, 0, "Inode %llu: %llu extents",
+                   (unsigned long long)inode_no,
+                   (unsigned long long)inode->extent_count);
+        return -1;
+    }
+    if (inode->extent_block_no) {
+        if (!fsck_data_blocks_ok(fsck, inode->extent_block_no, 1, &group_no)) {
+            fsck_error(fsck, 0, "Inode %llu: bad extent block %llu",
+                       (unsigned long long)inode_no,
+                       (unsigned long long)inode->extent_block_no);
+            return -1;
+        }
+        fsck_claim_blocks(fsck, inode_no, inode->extent_block_no, 1);
+    } else if (inode->extent_count > HELLOFS_INODE_EXTENTS) {
+        fsck_error(fsck, 0, "Inode %llu: extents spill but no extent block",
+                   (unsigned long long)inode_no);
+        return -1;
+    }
+
+    ret = 0;
+    next_logical = 0;
+    for (i = 0; i < inode->extent_count; i++) {
+        extent = fsck_extent_at(fsck, inode, i);
+        if (0 == extent->length
+                || (i > 0 && extent->logical_block_no < next_logical)) {
+            fsck_error(fsck, 0, "Inode %llu: extent %llu is empty, "
+                                "unsorted or overlapping",
+                       (unsigned long long)inode_no, (unsigned long long)i);
+            ret = -1;
+            continue;
+        }
+        next_logical = extent->logical_block_no + extent->length;
+        fsck_claim_blocks(fsck, inode_no, extent->physical_block_no,
+                          extent->length);
+    }
+    return ret;
+}
+
+static void fsck_push_dir(struct fsck *fsck, uint64_t inode_no) {
+    uint64_t *dirs;
+
+    pthread_mutex_lock(&fsck->lock);
+    if (fsck->dir_count == fsck->dir_capacity) {
+        dirs = realloc(fsck->dirs, (fsck->dir_capacity * 2 + 64)
+                                   * sizeof(uint64_t));
+        if (!dirs) {
+            fsck->failed = 1;
+            pthread_mutex_unlock(&fsck->lock);
+            return;
+        }
+        fsck->dirs = dirs;
+        fsck->dir_capacity = fsck->dir_capacity * 2 + 64;
+    }
+    fsck->dirs[fsck->dir_count++] = inode_no;
+    pthread_cond_signal(&fsck->cond);
+    pthread_mutex_unlock(&fsck->lock);
+}
+
+static inline int fsck_dir_record_ok(struct fsck *fsck,
+                                     struct hellofs_dir_record *dir_record,
+                                     uint64_t offset) {
+    return dir_record->rec_len >= HELLOFS_DIR_REC_LEN(0)
+           && 0 == dir_record->rec_len % 8
+           && offset + dir_record->rec_len <= fsck->hellofs_sb->blocksize
+           && HELLOFS_DIR_REC_LEN(dir_record->name_len) <= dir_record->rec_len;
+}
+
+/* Whether the index of dir has an entry for (hash, leaf) */
+static int fsck_index_has(struct fsck *fsck, struct hellofs_inode *dir,
+                          uint32_t hash, uint64_t leaf) {
+    struct hellofs_dir_index_entry *entry;
+    uint64_t per_block, size, slot, n, block_no;
+
+    per_block = HELLOFS_DIR_INDEX_ENTRIES_PER_BLOCK_HSB(fsck->hellofs_sb);
+    size = dir->dir_index_block_count * per_block;
+    slot = hash % size;
+    for (n = 0; n < size; n++) {
+        block_no = fsck_bmap(fsck, dir, HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO
+                                        + slot / per_block);
+        if (0 == block_no) {
+            return 0;
+        }
+        entry = (struct hellofs_dir_index_entry *)fsck_block(fsck, block_no)
+                + slot % per_block;
+        if (HELLOFS_DIR_INDEX_EMPTY == entry->leaf_block_no) {
+            return 0;
+        }
+        if (entry->hash == hash && entry->leaf_block_no == leaf) {
+            return 1;
+        }
+        slot = (slot + 1) % size;
+    }
+    return 0;
+}
+
+/* Check the records of a directory, and the inodes they point to.
+   Subdirectories are queued for any worker to pick up. */
+static void fsck_check_dir(struct fsck *fsck, uint64_t dir_inode_no) {
+    struct hellofs_superblock *hellofs_sb = fsck->hellofs_sb;
+    struct hellofs_inode *dir;
+    struct hellofs_inode *child;
+    struct hellofs_dir_record *dir_record;
+    uint64_t leaf, leaf_count, offset, block_no;
+    uint64_t children;
+    uint64_t inode_no;
+    char *block;
+
+    dir = fsck_inode(fsck, dir_inode_no);
+    __atomic_fetch_add(&fsck->dirs_seen, 1, __ATOMIC_RELAXED);
+
+    if (0 == dir->file_size || 0 != dir->file_size % hellofs_sb->blocksize) {
+        fsck_error(fsck, 0, "Directory %llu: bad size %llu",
+                   (unsigned long long)dir_inode_no,
+                   (unsigned long long)dir->file_size);
+        return;
+    }
+
+    children = 0;
+    leaf_count = dir->file_size / hellofs_sb->blocksize;
+    for (leaf = 0; leaf < leaf_count; leaf++) {
+        block_no = fsck_bmap(fsck, dir, leaf);
+        if (0 == block_no) {
+            fsck_error(fsck, 0, "Directory %llu: leaf %llu is a hole",
+                       (unsigned long long)dir_inode_no,
+                       (unsigned long long)leaf);
+            continue;
+        }
+        block = fsck_block(fsck, block_no);
+
+        for (offset = 0; offset < hellofs_sb->blocksize;
+                offset += dir_record->rec_len) {
+            dir_record = (struct hellofs_dir_record *)(block + offset);
+            if (!fsck_dir_record_ok(fsck, dir_record, offset)) {
+                fsck_error(fsck, 0, "Directory %llu: leaf %llu is corrupted "
+                                    "at offset %llu",
+                           (unsigned long long)dir_inode_no,
+                           (unsigned long long)leaf,
+                           (unsigned long long)offset);
+                break;
+            }
+            if (0 == dir_record->name_len) {
+                continue;
+            }
+            children += 1;
+
+            if (dir->dir_index_block_count
+                    && !fsck_index_has(fsck, dir,
+                                       hellofs_name_hash(dir_record->filename,
+                                                         dir_record->name_len),
+                                       leaf)) {
+                fsck_error(fsck, 0, "Directory %llu: %.*s is not indexed",
+                           (unsigned long long)dir_inode_no,
+                           (int)dir_record->name_len, dir_record->filename);
+            }
+
+            inode_no = dir_record->inode_no;
+            if (inode_no >= hellofs_sb->inode_table_size) {
+                fsck_error(fsck, 0, "Directory %llu: %.*s points to bad "
+                                    "inode %llu",
+                           (unsigned long long)dir_inode_no,
+                           (int)dir_record->name_len, dir_record->filename,
+                           (unsigned long long)inode_no);
+                continue;
+            }
+            if (fsck_mark(fsck, fsck->inode_bitmaps,
+                          HELLOFS_INODE_GROUP_NO_HSB(hellofs_sb, inode_no),
+                          inode_no % hellofs_sb->inodes_per_group)) {
+                fsck_error(fsck, 0, "Directory %llu: %.*s links inode %llu, "
+                                    "which is linked elsewhere",
+                           (unsigned long long)dir_inode_no,
+                           (int)dir_record->name_len, dir_record->filename,
+                           (unsigned long long)inode_no);
+                continue;
+            }
+            if (0 != fsck_check_inode(fsck, inode_no)) {
+                continue;
+            }
+
+            child = fsck_inode(fsck, inode_no);
+            if (dir_record->file_type != HELLOFS_FILE_TYPE(child->mode)) {
+                fsck_error(fsck, 0, "Directory %llu: %.*s has file type %u, "
+                                    "inode %llu is %u",
+                           (unsigned long long)dir_inode_no,
+                           (int)dir_record->name_len, dir_record->filename,
+                           dir_record->file_type, (unsigned long long)inode_no,
+                           HELLOFS_FILE_TYPE(child->mode));
+            }
+            if (S_ISDIR(child->mode)) {
+                fsck_push_dir(fsck, inode_no);
+            }
+        }
+    }
+
+    if (children != dir->dir_children_count) {
+        fsck_error(fsck, 0, "Directory %llu: %llu records, children count "
+                            "says %llu",
+                   (unsigned long long)dir_inode_no,
+                   (unsigned long long)children,
+                   (unsigned long long)dir->dir_children_count);
+    }
+}
+
+static void *fsck_dir_worker(void *arg) {
+    struct fsck *fsck = arg;
+    uint64_t inode_no;
+
+    for (;;) {
+        pthread_mutex_lock(&fsck->lock);
+        while (0 == fsck->dir_count && fsck->busy > 0 && !fsck->failed) {
+            pthread_cond_wait(&fsck->cond, &fsck->lock);
+        }
+        if (0 == fsck->dir_count || fsck->failed) {
+            // Nothing queued and nobody left to queue more
+            pthread_cond_broadcast(&fsck->cond);
+            pthread_mutex_unlock(&fsck->lock);
+            return NULL;
+        }
+        inode_no = fsck->dirs[--fsck->dir_count];
+        fsck->busy += 1;
+        pthread_mutex_unlock(&fsck->lock);
+
+        fsck_check_dir(fsck, inode_no);
+
+        pthread_mutex_lock(&fsck->lock);
+        fsck->busy -= 1;
+        if (0 == fsck->busy && 0 == fsck->dir_count) {
+            pthread_cond_broadcast(&fsck->cond);
+        }
+        pthread_mutex_unlock(&fsck->lock);
+    }
+}
+
+/* Compare one bitmap of a group with the expected one a word at a time.
+   Returns the number of bits set in the expected bitmap. */
+static uint64_t fsck_compare_bitmap(struct fsck *fsck, uint64_t group_no,
+                                    const char *what, uint64_t *expected,
+                                    uint64_t *on_disk, uint64_t size) {
+    uint64_t words, i, mask;
+    uint64_t used, unreachable, lost;
+
+    words = (size + BITS_IN_WORD - 1) / BITS_IN_WORD;
+    used = 0;
+    unreachable = 0;
+    lost = 0;
+    for (i = 0; i < words; i++) {
+        mask = ~0ULL;
+        if (i == words - 1 && 0 != size % BITS_IN_WORD) {
+            mask = (1ULL << (size % BITS_IN_WORD)) - 1;
+        }
+        used += __builtin_popcountll(expected[i] & mask);
+        if (0 == ((expected[i] ^ on_disk[i]) & mask)) {
+            continue;
+        }
+        unreachable += __builtin_popcountll(on_disk[i] & ~expected[i] & mask);
+        lost += __builtin_popcountll(expected[i] & ~on_disk[i] & mask);
+    }
+
+    if (lost) {
+        fsck_error(fsck, 1, "Group %llu: %llu %s in use but marked free",
+                   (unsigned long long)group_no, (unsigned long long)lost,
+                   what);
+    }
+    if (unreachable) {
+        fsck_error(fsck, 1, "Group %llu: %llu %s marked in use but "
+                            "unreachable",
+                   (unsigned long long)group_no,
+                   (unsigned long long)unreachable, what);
+    }
+    if ((lost || unreachable) && fsck->repair) {
+        memcpy(on_disk, expected, words * sizeof(uint64_t));
+    }
+    return used;
+}
+
+static void fsck_check_group(struct fsck *fsck, uint64_t group_no) {
+    struct hellofs_superblock *hellofs_sb = fsck->hellofs_sb;
+    struct hellofs_group_desc *gd;
+    uint64_t used_inodes, used_data_blocks;
+
+    gd = &fsck->group_descs[group_no];
+    used_inodes = fsck_compare_bitmap(
+        fsck, group_no, "inodes",
+        fsck->inode_bitmaps + group_no * fsck->words_per_bitmap,
+        (uint64_t *)fsck_block(fsck, gd->inode_bitmap_block_no),
+        hellofs_sb->inodes_per_group);
+    used_data_blocks = fsck_compare_bitmap(
+        fsck, group_no, "data blocks",
+        fsck->data_block_bitmaps + group_no * fsck->words_per_bitmap,
+        (uint64_t *)fsck_block(fsck, gd->data_block_bitmap_block_no),
+        hellofs_sb->data_blocks_per_group);
+    __atomic_fetch_add(&fsck->used_inodes, used_inodes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&fsck->used_data_blocks, used_data_blocks,
+                       __ATOMIC_RELAXED);
+
+    if (gd->free_inodes_count != hellofs_sb->inodes_per_group - used_inodes
+            || gd->free_data_blocks_count
+               != hellofs_sb->data_blocks_per_group - used_data_blocks) {
+        fsck_error(fsck, 1, "Group %llu: free counts are %llu inodes, %llu "
+                            "data blocks, should be %llu, %llu",
+                   (unsigned long long)group_no,
+                   (unsigned long long)gd->free_inodes_count,
+                   (unsigned long long)gd->free_data_blocks_count,
+                   (unsigned long long)(hellofs_sb->inodes_per_group
+                                        - used_inodes),
+                   (unsigned long long)(hellofs_sb->data_blocks_per_group
+                                        - used_data_blocks));
+        if (fsck->repair) {
+            gd->free_inodes_count = hellofs_sb->inodes_per_group - used_inodes;
+            gd->free_data_blocks_count
+                = hellofs_sb->data_blocks_per_group - used_data_blocks;
+        }
+    }
+}
+
+static void *fsck_group_worker(void *arg) {
+    struct fsck *fsck = arg;
+    uint64_t group_no;
+
+    for (;;) {
+        group_no = __atomic_fetch_add(&fsck->next_group, 1, __ATOMIC_RELAXED);
+        if (group_no >= fsck->hellofs_sb->group_count) {
+            return NULL;
+        }
+        fsck_check_group(fsck, group_no);
+    }
+}
+
+static int fsck_run_workers(struct fsck *fsck, long thread_count,
+                            void *(*worker)(void *)) {
+    pthread_t threads[thread_count];
+    long i, started;
+
+    for (started = 0; started < thread_count; started++) {
+        if (0 != pthread_create(&threads[started], NULL, worker, fsck)) {
+            break;
+        }
+    }
+    if (0 == started) {
+        worker(fsck);
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    return 0;
+}
+
+/* The superblock and group descriptors must be sane before anything else
+   can be trusted */
+static int fsck_check_geometry(struct fsck *fsck) {
+    struct hellofs_superblock *hellofs_sb = fsck->hellofs_sb;
+    struct hellofs_group_desc *gd;
+    uint64_t group_start;
+    uint64_t i;
+
+    if (HELLOFS_MAGIC != hellofs_sb->magic) {
+        fprintf(stderr, "Bad magic number, not a hellofs image\n");
+        return -1;
+    }
+    if (hellofs_sb->blocksize < sizeof(struct hellofs_inode)
+            || 0 != hellofs_sb->blocksize % sizeof(uint64_t)
+            || 0 == hellofs_sb->group_count
+            || 0 == hellofs_sb->inodes_per_group
+            || 0 == hellofs_sb->data_blocks_per_group
+            || hellofs_sb->inodes_per_group
+                > HELLOFS_MAX_BLOCKS_PER_GROUP(hellofs_sb->blocksize)
+            || hellofs_sb->data_blocks_per_group
+                > HELLOFS_MAX_BLOCKS_PER_GROUP(hellofs_sb->blocksize)
+            || hellofs_sb->inode_table_size
+               != hellofs_sb->group_count * hellofs_sb->inodes_per_group
+            || hellofs_sb->data_block_table_size
+               != hellofs_sb->group_count * hellofs_sb->data_blocks_per_group) {
+        fprintf(stderr, "Bad block group geometry in the superblock\n");
+        return -1;
+    }
+    if (HELLOFS_JOURNAL_BLOCKS_HSB(hellofs_sb)
+            && (hellofs_sb->journal_start_block_no
+                != HELLOFS_TOTAL_BLOCKS_HSB(hellofs_sb)
+                || hellofs_sb->journal_block_count
+                   < HELLOFS_MIN_JOURNAL_BLOCKS)) {
+        fprintf(stderr, "Bad journal geometry in the superblock\n");
+        return -1;
+    }
+    if (HELLOFS_DEVICE_BLOCKS_HSB(hellofs_sb) * hellofs_sb->blocksize
+            > fsck->image_len) {
+        fprintf(stderr, "Image is smaller than the %llu blocks of the "
+                        "filesystem\n",
+                (unsigned long long)HELLOFS_DEVICE_BLOCKS_HSB(hellofs_sb));
+        return -1;
+    }
+
+    // The layout is fixed by the geometry, which mkfs-hellofs wrote
+    for (i = 0; i < hellofs_sb->group_count; i++) {
+        gd = &fsck->group_descs[i];
+        group_start = HELLOFS_GROUP_START_BLOCK_NO_HSB(hellofs_sb, i);
+        if (gd->inode_bitmap_block_no != group_start
+                || gd->data_block_bitmap_block_no != group_start + 1
+                || gd->inode_table_block_no != group_start + 2
+                || gd->data_block_table_block_no
+                   != group_start + 2
+                      + HELLOFS_INODE_TABLE_BLOCKS_PER_GROUP_HSB(hellofs_sb)) {
+            fprintf(stderr, "Group descriptor %llu is corrupted\n",
+                    (unsigned long long)i);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* The tree can only be checked once the log is replayed, which mounting
+   does. A log which starts with a descriptor of the expected sequence
+   holds transactions the kernel did not checkpoint. */
+static int fsck_journal_needs_replay(struct fsck *fsck) {
+    struct hellofs_superblock *hellofs_sb = fsck->hellofs_sb;
+    struct hellofs_journal_superblock *jsb;
+    struct hellofs_journal_header *header;
+
+    if (0 == HELLOFS_JOURNAL_BLOCKS_HSB(hellofs_sb)) {
+        return 0;
+    }
+    jsb = (struct hellofs_journal_superblock *)fsck_block(
+        fsck, hellofs_sb->journal_start_block_no);
+    header = (struct hellofs_journal_header *)fsck_block(
+        fsck, hellofs_sb->journal_start_block_no + 1);
+    if (HELLOFS_JOURNAL_MAGIC != jsb->magic) {
+        fsck_error(fsck, 0, "Journal superblock has a bad magic number");
+        return 0;
+    }
+    return HELLOFS_JOURNAL_MAGIC == header->magic
+           && HELLOFS_JOURNAL_DESCRIPTOR == header->type
+           && jsb->sequence == header->sequence;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr, "Usage: %s [-y] [-j threads] image\n"
+                    "  -y  repair bitmaps and free counts\n"
+                    "  -j  number of threads, default one per CPU\n", prog);
+}
+
+int main(int argc, char *argv[]) {
+    struct fsck fsck;
+    struct hellofs_superblock *hellofs_sb;
+    struct stat st;
+    uint64_t root_no;
+    long thread_count;
+    int fd;
+    int opt;
+    int ret;
+
+    memset(&fsck, 0, sizeof(fsck));
+    thread_count = sysconf(_SC_NPROCESSORS_ONLN);
+    while (-1 != (opt = getopt(argc, argv, "yj:h"))) {
+        switch (opt) {
+        case 'y':
+            fsck.repair = 1;
+            break;
+        case 'j':
+            thread_count = strtol(optarg, NULL, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 'h' == opt ? FSCK_OK : FSCK_ERROR;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return FSCK_ERROR;
+    }
+    if (thread_count < 1) {
+        thread_count = 1;
+    }
+    if (thread_count > FSCK_MAX_THREADS) {
+        thread_count = FSCK_MAX_THREADS;
+    }
+
+    fd = open(argv[optind], fsck.repair ? O_RDWR : O_RDONLY);
+    if (-1 == fd) {
+        perror("Error opening the image");
+        return FSCK_ERROR;
+    }
+    if (0 != fstat(fd, &st)) {
+        perror("Error reading the image size");
+        close(fd);
+        return FSCK_ERROR;
+    }
+    // Block devices report no size through stat
+    fsck.image_len = S_ISBLK(st.st_mode) ? (size_t)lseek(fd, 0, SEEK_END)
+                                          : (size_t)st.st_size;
+    if (fsck.image_len < 2 * HELLOFS_DEFAULT_BLOCKSIZE) {
+        fprintf(stderr, "Image is too small\n");
+        close(fd);
+        return FSCK_ERROR;
+    }
+
+    // The kernel reads blocks lazily the same way, through the page cache
+    fsck.image = mmap(NULL, fsck.image_len,
+                      PROT_READ | (fsck.repair ? PROT_WRITE : 0), MAP_SHARED,
+                      fd, 0);
+    close(fd);
+    if (MAP_FAILED == fsck.image) {
+        perror("Error mapping the image");
+        return FSCK_ERROR;
+    }
+
+    hellofs_sb = (struct hellofs_superblock *)fsck.image;
+    fsck.hellofs_sb = hellofs_sb;
+    fsck.group_descs = (struct hellofs_group_desc *)(
+        fsck.image
+        + HELLOFS_GROUP_DESC_TABLE_START_BLOCK_NO * hellofs_sb->blocksize);
+    if (0 != fsck_check_geometry(&fsck)) {
+        munmap(fsck.image, fsck.image_len);
+        return FSCK_ERROR;
+    }
+    if (fsck_journal_needs_replay(&fsck)) {
+        fprintf(stderr, "The journal holds transactions which are not "
+                        "checkpointed, mount the filesystem to replay them\n");
+        munmap(fsck.image, fsck.image_len);
+        return FSCK_UNCORRECTED;
+    }
+
+    fsck.words_per_bitmap = hellofs_sb->blocksize / sizeof(uint64_t);
+    fsck.inode_bitmaps = calloc(hellofs_sb->group_count
+                                * fsck.words_per_bitmap, sizeof(uint64_t));
+    fsck.data_block_bitmaps = calloc(hellofs_sb->group_count
+                                     * fsck.words_per_bitmap,
+                                     sizeof(uint64_t));
+    if (!fsck.inode_bitmaps || !fsck.data_block_bitmaps) {
+        fprintf(stderr, "Out of memory\n");
+        munmap(fsck.image, fsck.image_len);
+        return FSCK_ERROR;
+    }
+    pthread_mutex_init(&fsck.lock, NULL);
+    pthread_cond_init(&fsck.cond, NULL);
+
+    // Pass 1, walk the tree
+    root_no = HELLOFS_ROOTDIR_INODE_NO;
+    fsck_mark(&fsck, fsck.inode_bitmaps, 0, root_no);
+    if (0 == fsck_check_inode(&fsck, root_no)
+            && S_ISDIR(fsck_inode(&fsck, root_no)->mode)) {
+        fsck_push_dir(&fsck, root_no);
+        fsck_run_workers(&fsck, thread_count, fsck_dir_worker);
+    } else {
+        fsck_error(&fsck, 0, "Root inode is not a usable directory");
+    }
+    if (fsck.failed) {
+        fprintf(stderr, "Out of memory\n");
+        munmap(fsck.image, fsck.image_len);
+        return FSCK_ERROR;
+    }
+
+    // Pass 2, compare the bitmaps and free counts of every group
+    fsck_run_workers(&fsck, thread_count, fsck_group_worker);
+
+    // Pass 3, the superblock counts, which the kernel only updates at
+    // sync and unmount
+    if (hellofs_sb->inode_count != fsck.used_inodes
+            || hellofs_sb->data_block_count != fsck.used_data_blocks) {
+        fsck_error(&fsck, 1, "Superblock: used counts are %llu inodes, %llu "
+                             "data blocks, should be %llu, %llu",
+                   (unsigned long long)hellofs_sb->inode_count,
+                   (unsigned long long)hellofs_sb->data_block_count,
+                   (unsigned long long)fsck.used_inodes,
+                   (unsigned long long)fsck.used_data_blocks);
+        if (fsck.repair) {
+            hellofs_sb->inode_count = fsck.used_inodes;
+            hellofs_sb->data_block_count = fsck.used_data_blocks;
+        }
+    }
+
+    printf("%llu inodes, %llu directories, %llu data blocks in use, "
+           "checked with %ld threads\n",
+           (unsigned long long)fsck.inodes_seen,
+           (unsigned long long)fsck.dirs_seen,
+           (unsigned long long)fsck.blocks_seen, thread_count);
+
+    ret = FSCK_OK;
+    if (fsck.fixable_errors) {
+        ret = fsck.repair ? FSCK_CORRECTED : FSCK_UNCORRECTED;
+    }
+    if (fsck.errors) {
+        ret = FSCK_UNCORRECTED;
+    }
+    if (fsck.repair && fsck.fixable_errors
+            && 0 != msync(fsck.image, fsck.image_len, MS_SYNC)) {
+        perror("Error writing back the repairs");
+        ret = FSCK_ERROR;
+    }
+
+    munmap(fsck.image, fsck.image_len);
+    free(fsck.inode_bitmaps);
+    free(fsck.data_block_bitmaps);
+    free(fsck.dirs);
+    return ret;
+}
@@ -21,6 +21,22 @@ function unmount_fs() {
     rmmod ./hellofs.ko
 }
 
+function fail() {
+    echo "FAILED: $*"
+    exit 1
+}
+
+# The image has to be consistent after every unmount
+function check_fs_image() {
+    ./fsck-hellofs "$1" || fail "fsck of $1"
+}
+
+# Expects file $1 to hold $2 zero bytes from offset $3
+function expect_zeroes() {
+    cmp <(tail -c +$(($3 + 1)) "$1" | head -c "$2") <(head -c "$2" /dev/zero) \
+        || fail "$1 is not zero from $3"
+}
+
 function do_some_operations() {
     cd "$1"
 
@@ -72,6 +88,184 @@ function do_read_operations()
     cat hello_smaller
 }
 
+# A directory large enough to get a hash index
+function do_indexed_dir_tests() {
+    mkdir "$1/indexed"
+    for i in $(seq 1 400); do
+        touch "$1/indexed/file-with-a-longer-name-$i"
+    done
+    [ "$(ls "$1/indexed" | wc -l)" -eq 400 ] || fail "indexed dir listing"
+
+    # Negative lookups, and creates after them
+    for i in $(seq 401 420); do
+        [ ! -e "$1/indexed/file-with-a-longer-name-$i" ] \
+            || fail "lookup of missing file-$i"
+        echo "$i" > "$1/indexed/file-with-a-longer-name-$i"
+    done
+    [ "$(cat "$1/indexed/file-with-a-longer-name-410")" = 410 ] \
+        || fail "create in indexed dir"
+}
+
+function do_indexed_dir_read_operations() {
+    [ "$(cat "$1/indexed/file-with-a-longer-name-420")" = 420 ] \
+        || fail "indexed dir after remount"
+    [ ! -e "$1/indexed/file-with-a-longer-name-421" ] \
+        || fail "lookup of missing file after remount"
+}
+
+# Records of every name length, and their space reused after unlink
+function do_unlink_tests() {
+    mkdir "$1/names"
+    for len in $(seq 1 255); do
+        touch "$1/names/$(head -c "$len" /dev/zero | tr '\0' n)"
+    done
+    for len in $(seq 1 2 255); do
+        rm "$1/names/$(head -c "$len" /dev/zero | tr '\0' n)"
+    done
+    mkdir "$1/names/subdir"
+    [ "$(ls "$1/names" | wc -l)" -eq 128 ] || fail "listing after unlink"
+    [ "$(find "$1/names" -mindepth 1 -type d | wc -l)" -eq 1 ] \
+        || fail "file type of a directory record"
+
+    for i in $(seq 1 2 420); do
+        rm "$1/indexed/file-with-a-longer-name-$i"
+    done
+    [ ! -e "$1/indexed/file-with-a-longer-name-1" ] || fail "unlink"
+    [ -e "$1/indexed/file-with-a-longer-name-2" ] || fail "unlink of a neighbour"
+    [ "$(ls "$1/indexed" | wc -l)" -eq 210 ] || fail "listing after unlink"
+
+    rmdir "$1/names/subdir"
+    [ ! -e "$1/names/subdir" ] || fail "rmdir"
+    if rmdir "$1/names" 2>/dev/null; then
+        fail "rmdir of a non-empty directory"
+    fi
+}
+
+function do_unlink_read_operations() {
+    [ "$(ls "$1/names" | wc -l)" -eq 127 ] || fail "names after remount"
+    [ -e "$1/names/nn" ] && [ ! -e "$1/names/n" ] \
+        || fail "unlinked name after remount"
+    [ ! -e "$1/indexed/file-with-a-longer-name-419" ] \
+        || fail "unlinked file after remount"
+}
+
+function do_inline_tests() {
+    # Inline data, converted once the file outgrows the inode
+    echo -n "small" > "$1/inline"
+    [ "$(cat "$1/inline")" = small ] || fail "inline file"
+    head -c 10000 /dev/urandom > "$test_dir/random"
+    cat "$test_dir/random" >> "$1/inline"
+    cmp <(echo -n small; cat "$test_dir/random") "$1/inline" \
+        || fail "inline conversion"
+
+    # A write past the end leaves a hole which reads as zeroes
+    echo -n "ab" > "$1/gap"
+    echo -n "cd" | dd of="$1/gap" bs=1 seek=20 conv=notrunc 2>/dev/null
+    expect_zeroes "$1/gap" 18 2
+}
+
+function do_inline_read_operations() {
+    cmp <(echo -n small; cat "$test_dir/random") "$1/inline" \
+        || fail "inline conversion after remount"
+    expect_zeroes "$1/gap" 18 2
+}
+
+function do_direct_io_tests() {
+    head -c 262144 /dev/urandom > "$test_dir/direct"
+    dd if="$test_dir/direct" of="$1/direct" bs=65536 oflag=direct
+    dd if="$1/direct" of="$test_dir/direct.back" bs=65536 iflag=direct
+    cmp "$test_dir/direct" "$test_dir/direct.back" || fail "O_DIRECT"
+}
+
+function do_direct_io_read_operations() {
+    cmp "$test_dir/direct" "$1/direct" || fail "O_DIRECT after remount"
+}
+
+# Writes through a shared mapping, with xfs_io when it is installed
+function do_mmap_tests() {
+    command -v xfs_io > /dev/null || return 0
+    head -c 16384 /dev/zero > "$1/mapped"
+    xfs_io -c "mmap -w 0 16384" -c "mwrite -S 0x61 4096 4096" \
+           -c "msync -s 0 16384" "$1/mapped"
+    { head -c 4096 /dev/zero; head -c 4096 /dev/zero | tr '\0' a;
+      head -c 8192 /dev/zero; } > "$test_dir/mapped"
+    cmp "$test_dir/mapped" "$1/mapped" || fail "mmap write"
+}
+
+function do_mmap_read_operations() {
+    command -v xfs_io > /dev/null || return 0
+    cmp "$test_dir/mapped" "$1/mapped" || fail "mmap write after remount"
+}
+
+# sendfile splices both into and out of a file
+function do_splice_tests() {
+    command -v xfs_io > /dev/null || return 0
+    head -c 100000 /dev/urandom > "$test_dir/spliced"
+    xfs_io -f -c "sendfile -i $test_dir/spliced 0 100000" "$1/spliced"
+    cmp "$test_dir/spliced" "$1/spliced" || fail "sendfile to hellofs"
+    xfs_io -f -c "sendfile -i $1/spliced 0 100000" "$test_dir/spliced.back"
+    cmp "$test_dir/spliced" "$test_dir/spliced.back" \
+        || fail "sendfile from hellofs"
+}
+
+function do_splice_read_operations() {
+    command -v xfs_io > /dev/null || return 0
+    cmp "$test_dir/spliced" "$1/spliced" || fail "sendfile after remount"
+}
+
+# Truncate then extend, the old data must not come back
+function do_truncate_tests() {
+    head -c 50000 /dev/urandom > "$1/truncated"
+    truncate -s 100 "$1/truncated"
+    truncate -s 30000 "$1/truncated"
+    [ "$(stat -c %s "$1/truncated")" -eq 30000 ] || fail "truncate size"
+    expect_zeroes "$1/truncated" 29900 100
+    echo -n "small inline" > "$1/inline-truncated"
+    truncate -s 5 "$1/inline-truncated"
+    truncate -s 12 "$1/inline-truncated"
+    expect_zeroes "$1/inline-truncated" 7 5
+}
+
+function do_truncate_read_operations() {
+    expect_zeroes "$1/truncated" 29900 100
+    expect_zeroes "$1/inline-truncated" 7 5
+}
+
+# A full disk fails the write, and what was written reads back whole
+function do_enospc_tests() {
+    if tr '\0' x < /dev/zero | dd of="$1/fill" bs=4096 2>/dev/null; then
+        fail "filling the disk did not fail"
+    fi
+    sync
+    echo 3 > /proc/sys/vm/drop_caches
+    cmp <(tr '\0' x < /dev/zero | head -c "$(stat -c %s "$1/fill")") \
+        "$1/fill" || fail "data lost on a full disk"
+    rm "$1/fill"
+    echo "after ENOSPC" > "$1/after-enospc"
+}
+
+function do_enospc_read_operations() {
+    [ "$(cat "$1/after-enospc")" = "after ENOSPC" ] \
+        || fail "write after ENOSPC"
+}
+
+# Copy the image while it is mounted, after an fsync, as if the machine
+# had crashed. Mounting the copy replays its journal.
+function do_crash_test() {
+    mkdir "$1/crash"
+    for i in $(seq 1 50); do
+        echo "$i" > "$1/crash/file-$i"
+    done
+    head -c 100000 /dev/urandom > "$test_dir/crash-data"
+    dd if="$test_dir/crash-data" of="$1/crash/data" conv=fsync 2>/dev/null
+    cp "$2" "$3"
+}
+
+function do_crash_read_operations() {
+    cmp "$test_dir/crash-data" "$1/crash/data" || fail "fsync'ed data lost"
+    [ "$(ls "$1/crash" | wc -l)" -eq 51 ] || fail "crash dir"
+}
+
 function cleanup() {
     cd "$root_pwd"
     mount | grep -q "$test_mount_point" && umount -t hellofs "$test_mount_point"
@@ -93,15 +287,50 @@ do_some_operations "$test_mount_point"
 cd "$root_pwd"
 unmount_fs "$test_mount_point"
 
+check_fs_image "$test_dir/image"
+
 # run 2
 mount_fs_image "$test_dir/image" "$test_mount_point"
 do_read_operations "$test_mount_point"
 cd "$root_pwd"
 ls -lR "$test_mount_point"
 unmount_fs "$test_mount_point"
+check_fs_image "$test_dir/image"
+
+# run 3, regression tests
+mount_fs_image "$test_dir/image" "$test_mount_point"
+do_indexed_dir_tests "$test_mount_point"
+do_unlink_tests "$test_mount_point"
+do_inline_tests "$test_mount_point"
+do_direct_io_tests "$test_mount_point"
+do_mmap_tests "$test_mount_point"
+do_splice_tests "$test_mount_point"
+do_truncate_tests "$test_mount_point"
+do_enospc_tests "$test_mount_point"
+unmount_fs "$test_mount_point"
+check_fs_image "$test_dir/image"
+
+mount_fs_image "$test_dir/image" "$test_mount_point"
+do_indexed_dir_read_operations "$test_mount_point"
+do_unlink_read_operations "$test_mount_point"
+do_inline_read_operations "$test_mount_point"
+do_direct_io_read_operations "$test_mount_point"
+do_mmap_read_operations "$test_mount_point"
+do_splice_read_operations "$test_mount_point"
+do_truncate_read_operations "$test_mount_point"
+do_enospc_read_operations "$test_mount_point"
+do_crash_test "$test_mount_point" "$test_dir/image" "$test_dir/crashed"
+unmount_fs "$test_mount_point"
+check_fs_image "$test_dir/image"
+
+# run 4, replay the journal of the crashed copy
+mount_fs_image "$test_dir/crashed" "$test_mount_point"
+do_crash_read_operations "$test_mount_point"
+unmount_fs "$test_mount_point"
+check_fs_image "$test_dir/crashed"
 
 echo "Test finished successfully!"
 cleanup
 
 make clean
-rm -rf "$test_dir/image" "$test_mount_point"
+rm -rf "$test_dir" "$test_mount_point"
@@ -6,21 +6,60 @@
 #define HELLOFS_DEFAULT_BLOCKSIZE 4096
 #define HELLOFS_DEFAULT_INODE_TABLE_SIZE 1024
 #define HELLOFS_DEFAULT_DATA_BLOCK_TABLE_SIZE 1024
+#define HELLOFS_MAX_BLOCKS_PER_GROUP(blocksize) ((blocksize) * BITS_IN_BYTE)
 #define HELLOFS_FILENAME_MAXLEN 255
+#define HELLOFS_INODE_EXTENTS 4
+// Bytes of file data an inode slot can hold, pads the inode to 256 bytes
+#define HELLOFS_INLINE_DATA_SIZE 88
+#define HELLOFS_DEFAULT_JOURNAL_BLOCKS 256
+// Journal superblock, one descriptor, one logged block and the commit block
+#define HELLOFS_MIN_JOURNAL_BLOCKS 4
 
 /* Define filesystem structures */
 
-extern struct mutex hellofs_sb_lock;
+// File types stored in directory records
+#define HELLOFS_FT_UNKNOWN 0
+#define HELLOFS_FT_REG_FILE 1
+#define HELLOFS_FT_DIR 2
 
+// Variable-length directory record. The records of a leaf block tile it,
+// rec_len is the distance to the next record and includes any free space
+// after the name. A record whose name_len is 0 is unused. The filename is
+// not NUL terminated.
 struct hellofs_dir_record {
-    char filename[HELLOFS_FILENAME_MAXLEN];
     uint64_t inode_no;
+    uint16_t rec_len;
+    uint8_t name_len;
+    uint8_t file_type;
+    char filename[];
+};
+
+// Directories with more than one leaf block get a hash index. It is an
+// open addressing hash table of name hash to the leaf block holding the
+// name, stored in the directory's logical blocks starting from
+// HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO.
+struct hellofs_dir_index_entry {
+    uint32_t hash;
+    uint32_t leaf_block_no;
+};
+
+// A run of contiguous data blocks backing contiguous file blocks
+struct hellofs_extent {
+    uint64_t logical_block_no;
+    uint64_t physical_block_no;
+    uint64_t length;
 };
 
 struct hellofs_inode {
     mode_t mode;
     uint64_t inode_no;
-    uint64_t data_block_no;
+
+    // Extents are sorted by logical_block_no. The first
+    // HELLOFS_INODE_EXTENTS of them are stored in the inode,
+    // the rest spill into the extent block.
+    uint64_t extent_count;
+    struct hellofs_extent extents[HELLOFS_INODE_EXTENTS];
+    uint64_t extent_block_no;
 
     // TODO struct timespec is defined kenrel space,
     // but mkfs-hellofs.c is compiled in user space
@@ -28,12 +67,24 @@ struct hellofs_inode {
     struct timespec mtime;
     struct timespec ctime;*/
 
-    union {
-        uint64_t file_size;
-        uint64_t dir_children_count;
-    };
+    // For directories, the size of the leaf blocks
+    uint64_t file_size;
+    uint64_t dir_children_count;
+    // 0 while the directory has only one leaf block
+    uint64_t dir_index_block_count;
+    // A leaf block which had a record deleted, where inserts start to
+    // look for room
+    uint64_t dir_free_leaf_block_no;
+
+    uint64_t flags;
+    // File data of a small regular file, valid with HELLOFS_INODE_INLINE_DATA
+    char inline_data[HELLOFS_INLINE_DATA_SIZE];
 };
 
+// hellofs_inode.flags
+// The file has no extents, its data lives in inline_data
+#define HELLOFS_INODE_INLINE_DATA 0x1
+
 struct hellofs_superblock {
     uint64_t version;
     uint64_t magic;
@@ -44,16 +95,80 @@ struct hellofs_superblock {
 
     uint64_t data_block_table_size;
     uint64_t data_block_count;
+
+    // inode_table_size = group_count * inodes_per_group,
+    // data_block_table_size = group_count * data_blocks_per_group
+    uint64_t group_count;
+    uint64_t inodes_per_group;
+    uint64_t data_blocks_per_group;
+
+    // Since version 2. The metadata journal follows the last group,
+    // 0 blocks if the filesystem has none.
+    uint64_t journal_start_block_no;
+    uint64_t journal_block_count;
+};
+
+// Superblocks of version 2 and later describe the journal
+#define HELLOFS_JOURNAL_VERSION 2
+
+// The journal is a write-ahead log of metadata blocks. Its first block
+// is the hellofs_journal_superblock, the log fills the blocks after it.
+// Operations change bitmaps, group descriptors, inode table, directory
+// and extent blocks in memory. Committing a transaction appends full
+// copies of the blocks it changed to the log, and only then the blocks
+// are written to their home location (checkpointed). Once everything
+// logged is checkpointed, the log starts over from its first block.
+#define HELLOFS_JOURNAL_MAGIC 0x4a4c4f47
+
+struct hellofs_journal_superblock {
+    uint64_t magic;
+    // Sequence of the transaction the log starts with. Transactions
+    // before it are checkpointed.
+    uint64_t sequence;
+};
+
+// hellofs_journal_header.type
+// Lists the home block nos of the count blocks logged after it
+#define HELLOFS_JOURNAL_DESCRIPTOR 1
+// Lists count blocks freed by the transaction, copies of them logged by
+// it or by earlier transactions are not replayed
+#define HELLOFS_JOURNAL_REVOKE 2
+// Ends a transaction, checksum is the crc32 of its blocks before it
+#define HELLOFS_JOURNAL_COMMIT 3
+
+// Starts every descriptor, revoke and commit block. A transaction is
+// descriptor and revoke blocks of the same sequence, each descriptor
+// followed by its logged blocks, and the commit block.
+struct hellofs_journal_header {
+    uint32_t magic;
+    uint32_t type;
+    uint64_t sequence;
+    uint64_t count;
+    uint64_t checksum;
+    uint64_t block_nos[];
+};
+
+// Each block group has its own inode bitmap, data block bitmap,
+// slice of the inode table and slice of the data block table
+struct hellofs_group_desc {
+    uint64_t inode_bitmap_block_no;
+    uint64_t data_block_bitmap_block_no;
+    uint64_t inode_table_block_no;
+    uint64_t data_block_table_block_no;
+
+    uint64_t free_inodes_count;
+    uint64_t free_data_blocks_count;
 };
 
 static const uint64_t HELLOFS_SUPERBLOCK_BLOCK_NO = 0;
-static const uint64_t HELLOFS_INODE_BITMAP_BLOCK_NO = 1;
-static const uint64_t HELLOFS_DATA_BLOCK_BITMAP_BLOCK_NO = 2;
-static const uint64_t HELLOFS_INODE_TABLE_START_BLOCK_NO = 3;
+static const uint64_t HELLOFS_GROUP_DESC_TABLE_START_BLOCK_NO = 1;
 
 static const uint64_t HELLOFS_ROOTDIR_INODE_NO = 0;
+static const uint64_t HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO = 1ULL << 32;
+static const uint32_t HELLOFS_DIR_INDEX_EMPTY = 0xffffffff;
 // data block no is the absolute block number from start of device
-// data block no offset is the relative block offset from start of data block table
+// data block no offset is the relative block offset from start of
+// the data block table of its group
 static const uint64_t HELLOFS_ROOTDIR_DATA_BLOCK_NO_OFFSET = 0;
 
 /* Helper functions */
@@ -63,11 +178,122 @@ static inline uint64_t HELLOFS_INODES_PER_BLOCK_HSB(
     return hellofs_sb->blocksize / sizeof(struct hellofs_inode);
 }
 
-static inline uint64_t HELLOFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(
+// Space taken by a record with a name of name_len, 8 byte aligned
+static inline uint64_t HELLOFS_DIR_REC_LEN(uint64_t name_len) {
+    return (offsetof(struct hellofs_dir_record, filename) + name_len + 7)
+           & ~(uint64_t)7;
+}
+
+static inline uint8_t HELLOFS_FILE_TYPE(mode_t mode) {
+    if (S_ISDIR(mode)) {
+        return HELLOFS_FT_DIR;
+    }
+    if (S_ISREG(mode)) {
+        return HELLOFS_FT_REG_FILE;
+    }
+    return HELLOFS_FT_UNKNOWN;
+}
+
+static inline uint64_t HELLOFS_DIR_INDEX_ENTRIES_PER_BLOCK_HSB(
+        struct hellofs_superblock *hellofs_sb) {
+    return hellofs_sb->blocksize / sizeof(struct hellofs_dir_index_entry);
+}
+
+static inline uint64_t HELLOFS_EXTENTS_PER_BLOCK_HSB(
+        struct hellofs_superblock *hellofs_sb) {
+    return hellofs_sb->blocksize / sizeof(struct hellofs_extent);
+}
+
+/* The extents of an inode, HELLOFS_INODE_EXTENTS in the inode and the
+   rest in its extent block */
+static inline uint64_t HELLOFS_MAX_EXTENTS_HSB(
+        struct hellofs_superblock *hellofs_sb) {
+    return HELLOFS_INODE_EXTENTS + HELLOFS_EXTENTS_PER_BLOCK_HSB(hellofs_sb);
+}
+
+static inline uint64_t HELLOFS_GROUP_DESCS_PER_BLOCK_HSB(
+        struct hellofs_superblock *hellofs_sb) {
+    return hellofs_sb->blocksize / sizeof(struct hellofs_group_desc);
+}
+
+static inline uint64_t HELLOFS_GROUP_DESC_TABLE_BLOCKS_HSB(
+        struct hellofs_superblock *hellofs_sb) {
+    uint64_t per_block = HELLOFS_GROUP_DESCS_PER_BLOCK_HSB(hellofs_sb);
+    return (hellofs_sb->group_count + per_block - 1) / per_block;
+}
+
+static inline uint64_t HELLOFS_INODE_TABLE_BLOCKS_PER_GROUP_HSB(
+        struct hellofs_superblock *hellofs_sb) {
+    uint64_t per_block = HELLOFS_INODES_PER_BLOCK_HSB(hellofs_sb);
+    return (hellofs_sb->inodes_per_group + per_block - 1) / per_block;
+}
+
+// A group is laid out as inode bitmap, data block bitmap,
+// inode table slice and data block table slice
+static inline uint64_t HELLOFS_GROUP_BLOCKS_HSB(
+        struct hellofs_superblock *hellofs_sb) {
+    return 2 + HELLOFS_INODE_TABLE_BLOCKS_PER_GROUP_HSB(hellofs_sb)
+             + hellofs_sb->data_blocks_per_group;
+}
+
+static inline uint64_t HELLOFS_GROUP_START_BLOCK_NO_HSB(
+        struct hellofs_superblock *hellofs_sb, uint64_t group_no) {
+    return HELLOFS_GROUP_DESC_TABLE_START_BLOCK_NO
+           + HELLOFS_GROUP_DESC_TABLE_BLOCKS_HSB(hellofs_sb)
+           + group_no * HELLOFS_GROUP_BLOCKS_HSB(hellofs_sb);
+}
+
+// Which group an absolute block no falls into
+static inline uint64_t HELLOFS_BLOCK_GROUP_NO_HSB(
+        struct hellofs_superblock *hellofs_sb, uint64_t block_no) {
+    return (block_no - HELLOFS_GROUP_START_BLOCK_NO_HSB(hellofs_sb, 0))
+           / HELLOFS_GROUP_BLOCKS_HSB(hellofs_sb);
+}
+
+static inline uint64_t HELLOFS_INODE_GROUP_NO_HSB(
+        struct hellofs_superblock *hellofs_sb, uint64_t inode_no) {
+    return inode_no / hellofs_sb->inodes_per_group;
+}
+
+// FNV-1a hash of a file name, keys the directory index
+static inline uint32_t hellofs_name_hash(const char *name, size_t len) {
+    uint32_t hash = 2166136261u;
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        hash ^= (unsigned char)name[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// Blocks used by the superblock, group descriptors and groups. The
+// journal starts right after them.
+static inline uint64_t HELLOFS_TOTAL_BLOCKS_HSB(
+        struct hellofs_superblock *hellofs_sb) {
+    return HELLOFS_GROUP_START_BLOCK_NO_HSB(hellofs_sb,
+                                            hellofs_sb->group_count);
+}
+
+static inline uint64_t HELLOFS_JOURNAL_BLOCKS_HSB(
+        struct hellofs_superblock *hellofs_sb) {
+    return hellofs_sb->version >= HELLOFS_JOURNAL_VERSION
+           ? hellofs_sb->journal_block_count : 0;
+}
+
+// Total blocks used by a filesystem of this geometry, journal included
+static inline uint64_t HELLOFS_DEVICE_BLOCKS_HSB(
+        struct hellofs_superblock *hellofs_sb) {
+    return HELLOFS_TOTAL_BLOCKS_HSB(hellofs_sb)
+           + HELLOFS_JOURNAL_BLOCKS_HSB(hellofs_sb);
+}
+
+// Block nos a journal block lists after its header
+static inline uint64_t HELLOFS_JOURNAL_TAGS_PER_BLOCK_HSB(
         struct hellofs_superblock *hellofs_sb) {
-    return HELLOFS_INODE_TABLE_START_BLOCK_NO
-           + hellofs_sb->inode_table_size / HELLOFS_INODES_PER_BLOCK_HSB(hellofs_sb)
-           + 1;
+    return (hellofs_sb->blocksize
+            - offsetof(struct hellofs_journal_header, block_nos))
+           / sizeof(uint64_t);
 }
 
 #endif /*__HELLOFS_H__*/
\ No newline at end of file
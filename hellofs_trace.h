@@ -0,0 +1,198 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM hellofs
+
+#if !defined(_HELLOFS_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _HELLOFS_TRACE_H
+
+/* Tracepoints of hellofs, enable them with
+   echo 1 > /sys/kernel/debug/tracing/events/hellofs/enable */
+
+#include <linux/tracepoint.h>
+
+TRACE_EVENT(hellofs_lookup,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, int ret,
+             u64 latency_ns),
+    TP_ARGS(dir, dentry, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __string(name, dentry->d_name.name)
+        __field(unsigned long, ino)
+        __field(int, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __assign_str(name, dentry->d_name.name);
+        __entry->ino = dentry->d_inode ? dentry->d_inode->i_ino : 0;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("dev %d,%d dir %lu name %s ino %lu ret %d latency_ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+              __get_str(name), __entry->ino, __entry->ret,
+              __entry->latency_ns)
+);
+
+TRACE_EVENT(hellofs_create,
+    TP_PROTO(struct inode *dir, struct dentry *dentry, umode_t mode,
+             int ret, u64 latency_ns),
+    TP_ARGS(dir, dentry, mode, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __string(name, dentry->d_name.name)
+        __field(unsigned long, ino)
+        __field(umode_t, mode)
+        __field(int, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __assign_str(name, dentry->d_name.name);
+        __entry->ino = dentry->d_inode ? dentry->d_inode->i_ino : 0;
+        __entry->mode = mode;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("dev %d,%d dir %lu name %s ino %lu mode 0%o ret %d "
+              "latency_ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+              __get_str(name), __entry->ino, __entry->mode, __entry->ret,
+              __entry->latency_ns)
+);
+
+DECLARE_EVENT_CLASS(hellofs_rw,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret, u64 latency_ns),
+    TP_ARGS(inode, pos, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, ino)
+        __field(loff_t, pos)
+        __field(ssize_t, ret)
+        __field(u64, blocks)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = inode->i_sb->s_dev;
+        __entry->ino = inode->i_ino;
+        __entry->pos = pos;
+        __entry->ret = ret;
+        __entry->blocks = ret > 0
+            ? ((pos + ret - 1) >> inode->i_blkbits)
+              - (pos >> inode->i_blkbits) + 1
+            : 0;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("dev %d,%d ino %lu pos %lld ret %zd blocks %llu "
+              "latency_ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->ino,
+              __entry->pos, __entry->ret, __entry->blocks,
+              __entry->latency_ns)
+);
+
+DEFINE_EVENT(hellofs_rw, hellofs_read,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret, u64 latency_ns),
+    TP_ARGS(inode, pos, ret, latency_ns)
+);
+
+DEFINE_EVENT(hellofs_rw, hellofs_write,
+    TP_PROTO(struct inode *inode, loff_t pos, ssize_t ret, u64 latency_ns),
+    TP_ARGS(inode, pos, ret, latency_ns)
+);
+
+TRACE_EVENT(hellofs_alloc,
+    TP_PROTO(struct super_block *sb, int for_inode, u64 preferred,
+             u64 group_no, u64 offset, u64 count, u64 groups_tried,
+             u64 bits_scanned, int ret, u64 latency_ns),
+    TP_ARGS(sb, for_inode, preferred, group_no, offset, count, groups_tried,
+            bits_scanned, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(int, for_inode)
+        __field(u64, preferred)
+        __field(u64, group_no)
+        __field(u64, offset)
+        __field(u64, count)
+        __field(u64, groups_tried)
+        __field(u64, bits_scanned)
+        __field(int, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = sb->s_dev;
+        __entry->for_inode = for_inode;
+        __entry->preferred = preferred;
+        __entry->group_no = group_no;
+        __entry->offset = offset;
+        __entry->count = count;
+        __entry->groups_tried = groups_tried;
+        __entry->bits_scanned = bits_scanned;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("dev %d,%d %s preferred %llu group %llu offset %llu "
+              "count %llu groups_tried %llu bits_scanned %llu ret %d "
+              "latency_ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev),
+              __entry->for_inode ? "inode" : "block",
+              __entry->preferred, __entry->group_no, __entry->offset,
+              __entry->count, __entry->groups_tried, __entry->bits_scanned, __entry->ret,
+              __entry->latency_ns)
+);
+
+TRACE_EVENT(hellofs_readdir,
+    TP_PROTO(struct inode *dir, loff_t start_pos, loff_t end_pos,
+             u64 entries, u64 blocks, int ret, u64 latency_ns),
+    TP_ARGS(dir, start_pos, end_pos, entries, blocks, ret, latency_ns),
+
+    TP_STRUCT__entry(
+        __field(dev_t, dev)
+        __field(unsigned long, dir)
+        __field(loff_t, start_pos)
+        __field(loff_t, end_pos)
+        __field(u64, entries)
+        __field(u64, blocks)
+        __field(int, ret)
+        __field(u64, latency_ns)
+    ),
+
+    TP_fast_assign(
+        __entry->dev = dir->i_sb->s_dev;
+        __entry->dir = dir->i_ino;
+        __entry->start_pos = start_pos;
+        __entry->end_pos = end_pos;
+        __entry->entries = entries;
+        __entry->blocks = blocks;
+        __entry->ret = ret;
+        __entry->latency_ns = latency_ns;
+    ),
+
+    TP_printk("dev %d,%d dir %lu pos %lld..%lld entries %llu blocks %llu "
+              "ret %d latency_ns %llu",
+              MAJOR(__entry->dev), MINOR(__entry->dev), __entry->dir,
+              __entry->start_pos, __entry->end_pos, __entry->entries,
+              __entry->blocks, __entry->ret, __entry->latency_ns)
+);
+
+#endif /* _HELLOFS_TRACE_H */
+
+/* This part must be outside the include guard */
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#define TRACE_INCLUDE_FILE hellofs_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,147 @@
+#include "khellofs.h"
+
+/* Fill a pagecache page of an inline file from the inode, only page 0
+   holds data. Bytes past i_size are zeroed. */
+static void hellofs_inline_fill_page(struct inode *inode, struct page *page) {
+    struct hellofs_inode *hellofs_inode = HELLOFS_INODE(inode);
+    void *kaddr;
+    size_t size;
+
+    size = 0;
+    if (0 == page->index) {
+        size = min_t(loff_t, i_size_read(inode), HELLOFS_INLINE_DATA_SIZE);
+    }
+
+    kaddr = kmap_atomic(page);
+    memcpy(kaddr, hellofs_inode->inline_data, size);
+    memset(kaddr + size, 0, PAGE_CACHE_SIZE - size);
+    flush_dcache_page(page);
+    kunmap_atomic(kaddr);
+    SetPageUptodate(page);
+}
+
+int hellofs_inline_readpage(struct inode *inode, struct page *page) {
+    hellofs_inline_fill_page(inode, page);
+    unlock_page(page);
+    return 0;
+}
+
+/* Writeback of an inline file copies the page back into the inode, the
+   inode carries it to disk. The inline data past i_size is zeroed, as
+   block_write_full_page() does for the last page. */
+int hellofs_inline_writepage(struct inode *inode, struct page *page) {
+    struct hellofs_inode *hellofs_inode = HELLOFS_INODE(inode);
+    void *kaddr;
+    size_t size;
+
+    if (0 == page->index) {
+        size = min_t(loff_t, i_size_read(inode), HELLOFS_INLINE_DATA_SIZE);
+        kaddr = kmap_atomic(page);
+        memcpy(hellofs_inode->inline_data, kaddr, size);
+        kunmap_atomic(kaddr);
+        memset(hellofs_inode->inline_data + size, 0,
+               sizeof(hellofs_inode->inline_data) - size);
+        mark_inode_dirty(inode);
+    }
+    unlock_page(page);
+    return 0;
+}
+
+int hellofs_inline_write_begin(struct address_space *mapping,
+                               loff_t pos, unsigned len, unsigned flags,
+                               struct page **pagep) {
+    struct page *page;
+
+    page = grab_cache_page_write_begin(mapping, pos >> PAGE_CACHE_SHIFT,
+                                       flags);
+    if (!page) {
+        return -ENOMEM;
+    }
+    if (!PageUptodate(page)) {
+        hellofs_inline_fill_page(mapping->host, page);
+    }
+
+    *pagep = page;
+    return 0;
+}
+
+/* Copy what was written into the inline data. The page stays clean, the
+   data reaches the disk with the inode. A write past the end leaves a
+   gap, which reads as zeroes, even if a shared mapping wrote into the
+   page past the end meanwhile. */
+int hellofs_inline_write_end(struct address_space *mapping,
+                             loff_t pos, unsigned len, unsigned copied,
+                             struct page *page) {
+    struct inode *inode = mapping->host;
+    struct hellofs_inode *hellofs_inode = HELLOFS_INODE(inode);
+    loff_t size = i_size_read(inode);
+    void *kaddr;
+
+    if (copied > 0 && pos > size) {
+        zero_user(page, size, pos - size);
+        memset(hellofs_inode->inline_data + size, 0, pos - size);
+    }
+
+    kaddr = kmap_atomic(page);
+    memcpy(hellofs_inode->inline_data + pos, kaddr + pos, copied);
+    kunmap_atomic(kaddr);
+
+    if (pos + copied > inode->i_size) {
+        i_size_write(inode, pos + copied);
+    }
+    unlock_page(page);
+    page_cache_release(page);
+
+    mark_inode_dirty(inode);
+    return copied;
+}
+
+/* Move the data of an inline file to a data block, before a write which
+   the inode cannot hold. Page 0 is made uptodate from the inode and left
+   dirty on a delayed block 0, which gets its data block at writeback.
+   Caller holds i_mutex. */
+int hellofs_inline_convert(struct inode *inode, unsigned flags) {
+    struct hellofs_inode *hellofs_inode = HELLOFS_INODE(inode);
+    struct page *page;
+    loff_t size;
+    int ret;
+
+    page = grab_cache_page_write_begin(inode->i_mapping, 0, flags);
+    if (!page) {
+        return -ENOMEM;
+    }
+    if (!PageUptodate(page)) {
+        hellofs_inline_fill_page(inode, page);
+    }
+
+    hellofs_inode->flags &= ~HELLOFS_INODE_INLINE_DATA;
+    size = i_size_read(inode);
+    ret = 0;
+    if (size > 0) {
+        ret = __block_write_begin(page, 0, size, hellofs_get_block_delay);
+        if (0 == ret) {
+            block_commit_write(page, 0, size);
+        } else {
+            hellofs_inode->flags |= HELLOFS_INODE_INLINE_DATA;
+        }
+    }
+    if (0 == ret) {
+        memset(hellofs_inode->inline_data, 0,
+               sizeof(hellofs_inode->inline_data));
+        mark_inode_dirty(inode);
+    }
+
+    unlock_page(page);
+    page_cache_release(page);
+    return ret;
+}
+
+/* Zero the inline data past size, after the file was truncated to a size
+   the inode still holds. truncate_setsize() zeroes page 0 likewise. */
+void hellofs_inline_truncate(struct inode *inode, loff_t size) {
+    struct hellofs_inode *hellofs_inode = HELLOFS_INODE(inode);
+
+    memset(hellofs_inode->inline_data + size, 0,
+           sizeof(hellofs_inode->inline_data) - size);
+    mark_inode_dirty(inode);
+}
@@ -1,15 +1,67 @@
 #include "khellofs.h"
+#include "hellofs_trace.h"
 
+/* Creating an inode holds a journal handle in current->journal_info, so
+   reclaim must not be let into filesystems, which may take it for theirs */
+struct inode *hellofs_alloc_inode(struct super_block *sb) {
+    struct hellofs_inode_info *hi;
+
+    hi = kmem_cache_alloc(hellofs_inode_cache, GFP_NOFS);
+    if (!hi) {
+        return NULL;
+    }
+    hi->reserved_data_blocks = 0;
+    hi->reserved_extent_blocks = 0;
+    hi->delayed_runs = RB_ROOT;
+    hi->delayed_run_count = 0;
+    hi->sequence = 0;
+    hi->dir_leaf_gaps = NULL;
+    hi->dir_leaf_gap_count = 0;
+    hi->dir_leaf_gap_capacity = 0;
+    return &hi->vfs_inode;
+}
+
+static void hellofs_i_callback(struct rcu_head *head) {
+    struct inode *inode = container_of(head, struct inode, i_rcu);
+
+    kmem_cache_free(hellofs_inode_cache, HELLOFS_I(inode));
+}
+
+/* Path walk may still look at the inode under RCU, free it after a
+   grace period */
 void hellofs_destroy_inode(struct inode *inode) {
-    struct hellofs_inode *hellofs_inode = HELLOFS_INODE(inode);
+    call_rcu(&inode->i_rcu, hellofs_i_callback);
+}
 
-    printk(KERN_INFO "Freeing private data of inode %p (%lu)\n",
-           hellofs_inode, inode->i_ino);
-    kmem_cache_free(hellofs_inode_cache, hellofs_inode);
+/* The on-disk inode and its blocks are freed once the last link is gone
+   and the last reference is dropped */
+void hellofs_evict_inode(struct inode *inode) {
+    struct hellofs_handle handle;
+
+    /* Invalidating the pages releases their reservations */
+    truncate_inode_pages(&inode->i_data, 0);
+    WARN_ON(HELLOFS_I(inode)->reserved_data_blocks);
+    if (0 == inode->i_nlink && !is_bad_inode(inode)) {
+        hellofs_journal_start(inode->i_sb, &handle);
+        if (0 == hellofs_extent_free_all(inode)) {
+            hellofs_free_hellofs_inode(inode->i_sb, inode->i_ino);
+        } else {
+            /* Leak the inode and its blocks rather than free blocks
+               which may still be in use, fsck reclaims them */
+            printk(KERN_ERR "Unable to free the blocks of inode %lu\n",
+                   inode->i_ino);
+        }
+        hellofs_journal_stop(&handle);
+    }
+    kfree(HELLOFS_I(inode)->dir_leaf_gaps);
+    invalidate_inode_buffers(inode);
+    clear_inode(inode);
 }
 
-void hellofs_fill_inode(struct super_block *sb, struct inode *inode,
-                        struct hellofs_inode *hellofs_inode) {
+/* Set up a VFS inode from the hellofs_inode embedded in it */
+void hellofs_fill_inode(struct super_block *sb, struct inode *inode) {
+    struct hellofs_inode *hellofs_inode = HELLOFS_INODE(inode);
+
     inode->i_mode = hellofs_inode->mode;
     inode->i_sb = sb;
     inode->i_ino = hellofs_inode->inode_no;
@@ -18,232 +70,262 @@ void hellofs_fill_inode(struct super_block *sb, struct inode *inode,
     inode->i_atime = inode->i_mtime 
                    = inode->i_ctime
                    = CURRENT_TIME;
-    inode->i_private = hellofs_inode;    
     
     if (S_ISDIR(hellofs_inode->mode)) {
         inode->i_fop = &hellofs_dir_operations;
+        inode->i_size = hellofs_inode->file_size;
     } else if (S_ISREG(hellofs_inode->mode)) {
         inode->i_fop = &hellofs_file_operations;
+        inode->i_mapping->a_ops = &hellofs_aops;
+        inode->i_size = hellofs_inode->file_size;
     } else {
         printk(KERN_WARNING
                "Inode %lu is neither a directory nor a regular file",
                inode->i_ino);
         inode->i_fop = NULL;
     }
-
-    /* TODO hellofs_inode->file_size seems not reflected in inode */
 }
 
-/* TODO I didn't implement any function to dealloc hellofs_inode */
-int hellofs_alloc_hellofs_inode(struct super_block *sb, uint64_t *out_inode_no) {
-    struct hellofs_superblock *hellofs_sb;
-    struct buffer_head *bh;
-    uint64_t i;
-    int ret;
-    char *bitmap;
-    char *slot;
-    char needle;
-
-    hellofs_sb = HELLOFS_SB(sb);
-
-    mutex_lock(&hellofs_sb_lock);
-
-    bh = sb_bread(sb, HELLOFS_INODE_BITMAP_BLOCK_NO);
-    BUG_ON(!bh);
-
-    bitmap = bh->b_data;
-    ret = -ENOSPC;
-    for (i = 0; i < hellofs_sb->inode_table_size; i++) {
-        slot = bitmap + i / BITS_IN_BYTE;
-        needle = 1 << (i % BITS_IN_BYTE);
-        if (0 == (*slot & needle)) {
-            *out_inode_no = i;
-            *slot |= needle;
-            hellofs_sb->inode_count += 1;
-            ret = 0;
-            break;
-        }
-    }
-
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
-    hellofs_save_sb(sb);
-
-    mutex_unlock(&hellofs_sb_lock);
-    return ret;
-}
-
-struct hellofs_inode *hellofs_get_hellofs_inode(struct super_block *sb,
-                                                uint64_t inode_no) {
+/* Copy on-disk inode inode_no into hellofs_inode */
+int hellofs_read_hellofs_inode(struct super_block *sb, uint64_t inode_no,
+                               struct hellofs_inode *hellofs_inode) {
     struct buffer_head *bh;
     struct hellofs_inode *inode;
-    struct hellofs_inode *inode_buf;
 
-    bh = sb_bread(sb, HELLOFS_INODE_TABLE_START_BLOCK_NO + HELLOFS_INODE_BLOCK_OFFSET(sb, inode_no));
-    BUG_ON(!bh);
-    
+    bh = sb_bread(sb, HELLOFS_INODE_BLOCK_NO(sb, inode_no));
+    if (!bh) {
+        printk(KERN_ERR "Failed to read inode table block of inode %llu\n",
+               inode_no);
+        return -EIO;
+    }
+
     inode = (struct hellofs_inode *)(bh->b_data + HELLOFS_INODE_BYTE_OFFSET(sb, inode_no));
-    inode_buf = kmem_cache_alloc(hellofs_inode_cache, GFP_KERNEL);
-    memcpy(inode_buf, inode, sizeof(*inode_buf));
+    memcpy(hellofs_inode, inode, sizeof(*hellofs_inode));
 
     brelse(bh);
-    return inode_buf;
+    return 0;
 }
 
-void hellofs_save_hellofs_inode(struct super_block *sb,
-                                struct hellofs_inode *inode_buf) {
-    struct buffer_head *bh;
-    struct hellofs_inode *inode;
-    uint64_t inode_no;
+/* Get the VFS inode of inode_no. A cached inode is returned as is, only
+   an inode new to the icache is read from the inode table. */
+struct inode *hellofs_iget(struct super_block *sb, uint64_t inode_no) {
+    struct inode *inode;
+    int ret;
 
-    inode_no = inode_buf->inode_no;
-    bh = sb_bread(sb, HELLOFS_INODE_TABLE_START_BLOCK_NO + HELLOFS_INODE_BLOCK_OFFSET(sb, inode_no));
-    BUG_ON(!bh);
+    inode = iget_locked(sb, inode_no);
+    if (!inode) {
+        return ERR_PTR(-ENOMEM);
+    }
+    if (!(inode->i_state & I_NEW)) {
+        return inode;
+    }
 
-    inode = (struct hellofs_inode *)(bh->b_data + HELLOFS_INODE_BYTE_OFFSET(sb, inode_no));
-    memcpy(inode, inode_buf, sizeof(*inode));
+    ret = hellofs_read_hellofs_inode(sb, inode_no, HELLOFS_INODE(inode));
+    if (0 != ret) {
+        iget_failed(inode);
+        return ERR_PTR(ret);
+    }
+    hellofs_fill_inode(sb, inode);
+    inode_init_owner(inode, NULL, inode->i_mode);
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+    unlock_new_inode(inode);
+    return inode;
 }
 
-int hellofs_add_dir_record(struct super_block *sb, struct inode *dir,
-                           struct dentry *dentry, struct inode *inode) {
+/* Copy the in-core inode into its slot in the inode table buffer.
+   Returns the buffer, which the caller journals and releases. The
+   extents may be changing meanwhile, extent_sem keeps a torn extent list
+   out of the slot. Callers must not hold it. */
+static struct buffer_head *hellofs_update_inode_slot(struct inode *inode) {
+    struct super_block *sb;
+    struct hellofs_inode *hellofs_inode;
+    struct hellofs_inode *slot;
     struct buffer_head *bh;
-    struct hellofs_inode *parent_hellofs_inode;
-    struct hellofs_dir_record *dir_record;
 
-    parent_hellofs_inode = HELLOFS_INODE(dir);
-    if (unlikely(parent_hellofs_inode->dir_children_count
-            >= HELLOFS_DIR_MAX_RECORD(sb))) {
-        return -ENOSPC;
+    sb = inode->i_sb;
+    hellofs_inode = HELLOFS_INODE(inode);
+
+    bh = sb_bread(sb, HELLOFS_INODE_BLOCK_NO(sb, inode->i_ino));
+    if (!bh) {
+        printk(KERN_ERR "Failed to read inode table block of inode %lu\n",
+               inode->i_ino);
+        return NULL;
     }
 
-    bh = sb_bread(sb, parent_hellofs_inode->data_block_no);
-    BUG_ON(!bh);
+    hellofs_inode->mode = inode->i_mode;
+    if (S_ISREG(inode->i_mode)) {
+        hellofs_inode->file_size = i_size_read(inode);
+    }
 
-    dir_record = (struct hellofs_dir_record *)bh->b_data;
-    dir_record += parent_hellofs_inode->dir_children_count;
-    dir_record->inode_no = inode->i_ino;
-    strcpy(dir_record->filename, dentry->d_name.name);
+    slot = (struct hellofs_inode *)(bh->b_data
+                                    + HELLOFS_INODE_BYTE_OFFSET(sb, inode->i_ino));
+    down_read(&HELLOFS_I(inode)->extent_sem);
+    lock_buffer(bh);
+    memcpy(slot, hellofs_inode, sizeof(*slot));
+    unlock_buffer(bh);
+    up_read(&HELLOFS_I(inode)->extent_sem);
 
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
+    return bh;
+}
 
-    parent_hellofs_inode->dir_children_count += 1;
-    hellofs_save_hellofs_inode(sb, parent_hellofs_inode);
+/* Called whenever the inode is marked dirty. Only the inode table buffer
+   is dirtied, writeback flushes it together with its neighbours, or it
+   joins the operation's transaction. */
+void hellofs_dirty_inode(struct inode *inode, int flags) {
+    struct hellofs_handle handle;
+    struct buffer_head *bh;
 
-    return 0;
+    hellofs_journal_start(inode->i_sb, &handle);
+    bh = hellofs_update_inode_slot(inode);
+    if (bh) {
+        hellofs_journal_dirty(inode->i_sb, bh);
+        hellofs_journal_mark_inode(inode);
+        brelse(bh);
+    }
+    hellofs_journal_stop(&handle);
 }
 
-int hellofs_alloc_data_block(struct super_block *sb, uint64_t *out_data_block_no) {
-    struct hellofs_superblock *hellofs_sb;
+/* Only wait for the disk when writeback asks for data integrity,
+   e.g. fsync, sync or syncfs. With a journal the inode joined a
+   transaction when it was marked dirty, so there is nothing to write:
+   wait for that transaction unless it is committed already. fsync
+   commits in hellofs_fsync() instead, sync and syncfs commit once for
+   all inodes in hellofs_sync_fs(). */
+int hellofs_write_inode(struct inode *inode, struct writeback_control *wbc) {
     struct buffer_head *bh;
-    uint64_t i;
-    int ret;
-    char *bitmap;
-    char *slot;
-    char needle;
-
-    hellofs_sb = HELLOFS_SB(sb);
-
-    mutex_lock(&hellofs_sb_lock);
-
-    bh = sb_bread(sb, HELLOFS_DATA_BLOCK_BITMAP_BLOCK_NO);
-    BUG_ON(!bh);
-
-    bitmap = bh->b_data;
-    ret = -ENOSPC;
-    for (i = 0; i < hellofs_sb->data_block_table_size; i++) {
-        slot = bitmap + i / BITS_IN_BYTE;
-        needle = 1 << (i % BITS_IN_BYTE);
-        if (0 == (*slot & needle)) {
-            *out_data_block_no
-                = HELLOFS_DATA_BLOCK_TABLE_START_BLOCK_NO(sb) + i;
-            *slot |= needle;
-            hellofs_sb->data_block_count += 1;
-            ret = 0;
-            break;
+    int ret = 0;
+
+    if (HELLOFS_SB_INFO(inode->i_sb)->journal) {
+        if (WB_SYNC_ALL != wbc->sync_mode || wbc->for_sync) {
+            return 0;
         }
+        return hellofs_journal_commit_inode(inode);
     }
 
+    bh = hellofs_update_inode_slot(inode);
+    if (!bh) {
+        return -EIO;
+    }
     mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
+    if (WB_SYNC_ALL == wbc->sync_mode) {
+        sync_dirty_buffer(bh);
+        if (buffer_req(bh) && !buffer_uptodate(bh)) {
+            printk(KERN_ERR "Failed to write inode %lu\n", inode->i_ino);
+            ret = -EIO;
+        }
+    }
     brelse(bh);
-    hellofs_save_sb(sb);
 
-    mutex_unlock(&hellofs_sb_lock);
     return ret;
 }
 
-int hellofs_create_inode(struct inode *dir, struct dentry *dentry,
-                         umode_t mode) {
+static int hellofs_do_create_inode(struct inode *dir, struct dentry *dentry,
+                                   umode_t mode) {
     struct super_block *sb;
-    struct hellofs_superblock *hellofs_sb;
     uint64_t inode_no;
     struct hellofs_inode *hellofs_inode;
     struct inode *inode;
     int ret;
 
     sb = dir->i_sb;
-    hellofs_sb = HELLOFS_SB(sb);
 
     /* Create hellofs_inode */
-    ret = hellofs_alloc_hellofs_inode(sb, &inode_no);
+    ret = hellofs_alloc_hellofs_inode(sb, dir, mode, &inode_no);
     if (0 != ret) {
         printk(KERN_ERR "Unable to allocate on-disk inode. "
                         "Is inode table full? "
-                        "Inode count: %llu\n",
-                        hellofs_sb->inode_count);
+                        "Free inodes: %lld\n",
+                        percpu_counter_read_positive(
+                            &HELLOFS_SB_INFO(sb)->free_inodes));
         return -ENOSPC;
     }
-    hellofs_inode = kmem_cache_alloc(hellofs_inode_cache, GFP_KERNEL);
+
+    /* Create VFS inode, hashed so that later lookups find it */
+    inode = iget_locked(sb, inode_no);
+    if (!inode) {
+        hellofs_free_hellofs_inode(sb, inode_no);
+        return -ENOMEM;
+    }
+    if (unlikely(!(inode->i_state & I_NEW))) {
+        printk(KERN_ERR "Newly allocated inode %llu is still in use\n",
+               inode_no);
+        iput(inode);
+        return -EIO;
+    }
+
+    hellofs_inode = HELLOFS_INODE(inode);
     hellofs_inode->inode_no = inode_no;
     hellofs_inode->mode = mode;
-    if (S_ISDIR(mode)) {
-        hellofs_inode->dir_children_count = 0;
-    } else if (S_ISREG(mode)) {
-        hellofs_inode->file_size = 0;
-    } else {
+    hellofs_inode->extent_count = 0;
+    hellofs_inode->extent_block_no = 0;
+    hellofs_inode->file_size = 0;
+    hellofs_inode->dir_children_count = 0;
+    hellofs_inode->dir_index_block_count = 0;
+    hellofs_inode->dir_free_leaf_block_no = 0;
+    hellofs_inode->flags = 0;
+    memset(hellofs_inode->inline_data, 0, sizeof(hellofs_inode->inline_data));
+    if (!S_ISDIR(mode) && !S_ISREG(mode)) {
         printk(KERN_WARNING
                "Inode %llu is neither a directory nor a regular file",
                inode_no);
     }
+    hellofs_fill_inode(sb, inode);
+    inode_init_owner(inode, dir, mode);
 
-    /* Allocate data block for the new hellofs_inode */
-    ret = hellofs_alloc_data_block(sb, &hellofs_inode->data_block_no);
+    /* Directories start with one empty leaf block, regular files
+       start with inline data and get data blocks when they outgrow it */
+    if (S_ISDIR(mode)) {
+        ret = hellofs_dir_init(inode);
+    } else {
+        hellofs_inode->flags |= HELLOFS_INODE_INLINE_DATA;
+        ret = 0;
+    }
     if (0 != ret) {
         printk(KERN_ERR "Unable to allocate on-disk data block. "
                         "Is data block table full? "
-                        "Data block count: %llu\n",
-                        hellofs_sb->data_block_count);
-        return -ENOSPC;
-    }
-
-    /* Create VFS inode */
-    inode = new_inode(sb);
-    if (!inode) {
-        return -ENOMEM;
+                        "Free data blocks: %lld\n",
+                        percpu_counter_read_positive(
+                            &HELLOFS_SB_INFO(sb)->free_data_blocks));
+        ret = -ENOSPC;
+        goto fail;
     }
-    hellofs_fill_inode(sb, inode, hellofs_inode);
 
     /* Add new inode to parent dir */
     ret = hellofs_add_dir_record(sb, dir, dentry, inode);
     if (0 != ret) {
         printk(KERN_ERR "Failed to add inode %lu to parent dir %lu\n",
                inode->i_ino, dir->i_ino);
-        return -ENOSPC;
+        goto fail;
     }
 
-    inode_init_owner(inode, dir, mode);
-    d_add(dentry, inode);
-
-    /* TODO we should free newly allocated inodes when error occurs */
+    mark_inode_dirty(inode);
+    unlock_new_inode(inode);
+    /* The dentry was hashed by hellofs_lookup() as a negative one */
+    d_instantiate(dentry, inode);
 
     return 0;
+
+fail:
+    /* Dropping the unlinked inode frees it and its blocks */
+    clear_nlink(inode);
+    unlock_new_inode(inode);
+    iput(inode);
+    return ret;
+}
+
+int hellofs_create_inode(struct inode *dir, struct dentry *dentry,
+                         umode_t mode) {
+    struct hellofs_handle handle;
+    ktime_t start = ktime_get();
+    int ret;
+
+    hellofs_journal_start(dir->i_sb, &handle);
+    ret = hellofs_do_create_inode(dir, dentry, mode);
+    hellofs_journal_stop(&handle);
+    trace_hellofs_create(dir, dentry, mode, ret,
+                         hellofs_stat_end(dir->i_sb, HELLOFS_STAT_CREATE,
+                                          start, 0));
+    return ret;
 }
 
 int hellofs_create(struct inode *dir, struct dentry *dentry,
@@ -259,41 +341,130 @@ int hellofs_mkdir(struct inode *dir, struct dentry *dentry,
     return hellofs_create_inode(dir, dentry, mode);
 }
 
+int hellofs_unlink(struct inode *dir, struct dentry *dentry) {
+    struct inode *inode = dentry->d_inode;
+    struct hellofs_handle handle;
+    int ret;
+
+    hellofs_journal_start(dir->i_sb, &handle);
+    ret = hellofs_delete_dir_record(dir, &dentry->d_name);
+    if (0 == ret) {
+        inode->i_ctime = dir->i_ctime = dir->i_mtime = CURRENT_TIME;
+        drop_nlink(inode);
+        mark_inode_dirty(inode);
+    }
+    hellofs_journal_stop(&handle);
+    return ret;
+}
+
+int hellofs_rmdir(struct inode *dir, struct dentry *dentry) {
+    struct inode *inode = dentry->d_inode;
+    int ret;
+
+    if (0 != HELLOFS_INODE(inode)->dir_children_count) {
+        return -ENOTEMPTY;
+    }
+
+    ret = hellofs_unlink(dir, dentry);
+    if (0 != ret) {
+        return ret;
+    }
+    clear_nlink(inode);
+    return 0;
+}
+
+/* Change the size of a regular file. Pages past the new size are dropped
+   first, which gives back the reservations of their delayed blocks, then
+   the data blocks past it are freed. Caller holds i_mutex. */
+static int hellofs_setsize(struct inode *inode, loff_t size) {
+    loff_t old_size;
+    int ret;
+
+    if (!S_ISREG(inode->i_mode)) {
+        return -EINVAL;
+    }
+
+    if (hellofs_has_inline_data(inode)) {
+        if (size <= HELLOFS_INLINE_DATA_SIZE) {
+            /* After the new size is set, so that writeback does not copy
+               the old page back past it */
+            old_size = i_size_read(inode);
+            truncate_setsize(inode, size);
+            hellofs_inline_truncate(inode, min(size, old_size));
+            return 0;
+        }
+        ret = hellofs_inline_convert(inode, 0);
+        if (0 != ret) {
+            return ret;
+        }
+    }
+
+    inode_dio_wait(inode);
+    /* Zero the rest of the block size ends in, if it is on disk */
+    ret = block_truncate_page(inode->i_mapping, size, hellofs_get_block);
+    if (0 != ret) {
+        return ret;
+    }
+    truncate_setsize(inode, size);
+    /* Also dirties the inode, the new size commits with the freed blocks */
+    return hellofs_extent_truncate(
+        inode, (size + inode->i_sb->s_blocksize - 1)
+               >> inode->i_sb->s_blocksize_bits);
+}
+
+int hellofs_setattr(struct dentry *dentry, struct iattr *attr) {
+    struct inode *inode = dentry->d_inode;
+    int ret;
+
+    ret = inode_change_ok(inode, attr);
+    if (0 != ret) {
+        return ret;
+    }
+
+    if ((attr->ia_valid & ATTR_SIZE) && attr->ia_size != i_size_read(inode)) {
+        ret = hellofs_setsize(inode, attr->ia_size);
+        if (0 != ret) {
+            return ret;
+        }
+    }
+
+    setattr_copy(inode, attr);
+    mark_inode_dirty(inode);
+    return 0;
+}
+
 struct dentry *hellofs_lookup(struct inode *dir,
                               struct dentry *child_dentry,
                               unsigned int flags) {
-    struct hellofs_inode *parent_hellofs_inode = HELLOFS_INODE(dir);
     struct super_block *sb = dir->i_sb;
-    struct buffer_head *bh;
-    struct hellofs_dir_record *dir_record;
-    struct hellofs_inode *hellofs_child_inode;
     struct inode *child_inode;
-    uint64_t i;
-
-    bh = sb_bread(sb, parent_hellofs_inode->data_block_no);
-    BUG_ON(!bh);
-
-    dir_record = (struct hellofs_dir_record *)bh->b_data;
-
-    for (i = 0; i < parent_hellofs_inode->dir_children_count; i++) {
-        printk(KERN_INFO "hellofs_lookup: i=%llu, dir_record->filename=%s, child_dentry->d_name.name=%s", i, dir_record->filename, child_dentry->d_name.name);    // TODO
-        if (0 == strcmp(dir_record->filename, child_dentry->d_name.name)) {
-            hellofs_child_inode = hellofs_get_hellofs_inode(sb, dir_record->inode_no);
-            child_inode = new_inode(sb);
-            if (!child_inode) {
-                printk(KERN_ERR "Cannot create new inode. No memory.\n");
-                return NULL; 
-            }
-            hellofs_fill_inode(sb, child_inode, hellofs_child_inode);
-            inode_init_owner(child_inode, dir, hellofs_child_inode->mode);
-            d_add(child_dentry, child_inode);
-            return NULL;    
+    uint64_t inode_no;
+    ktime_t start;
+    int ret;
+
+    if (child_dentry->d_name.len > HELLOFS_FILENAME_MAXLEN) {
+        return ERR_PTR(-ENAMETOOLONG);
+    }
+
+    start = ktime_get();
+    child_inode = NULL;
+    ret = hellofs_find_dir_record(dir, &child_dentry->d_name, &inode_no);
+    if (0 == ret) {
+        child_inode = hellofs_iget(sb, inode_no);
+        if (IS_ERR(child_inode)) {
+            ret = PTR_ERR(child_inode);
         }
-        dir_record++;
+    }
+    if (0 != ret && -ENOENT != ret) {
+        trace_hellofs_lookup(dir, child_dentry, ret,
+                             hellofs_stat_end(sb, HELLOFS_STAT_LOOKUP,
+                                              start, 0));
+        return ERR_PTR(ret);
     }
 
-    printk(KERN_ERR
-           "No inode found for the filename: %s\n",
-           child_dentry->d_name.name);
+    /* A miss is cached as a negative dentry */
+    d_add(child_dentry, child_inode);
+    trace_hellofs_lookup(dir, child_dentry, ret,
+                         hellofs_stat_end(sb, HELLOFS_STAT_LOOKUP, start, 0));
     return NULL;
-}
\ No newline at end of file
+}
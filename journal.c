@@ -0,0 +1,1217 @@
+#include "khellofs.h"
+
+/* The metadata journal, see hellofs.h for its on-disk format.
+
+   Operations run inside handles. A handle holds trans_sem shared, and the
+   metadata buffers the operation changes join the running transaction
+   through hellofs_journal_dirty() instead of being marked dirty. The
+   commit thread takes trans_sem exclusively only for as long as it takes
+   to copy the buffers of the running transaction, so transactions hold
+   whole operations and the next one starts running right away. The
+   copies are then appended to the log in one sequential run, and the
+   commit block flushes them with itself. Everything done meanwhile,
+   including what fsync and sync wait for, shares one commit.
+
+   Journaled buffers are never dirty, writeback can not write them home
+   before they are in the log. The committed copies are kept and written
+   home by a checkpoint, which only happens once the log is full and at
+   unmount. Until then the buffers are pinned, so that readers keep
+   seeing their latest contents. */
+
+#define HELLOFS_JOURNAL_COMMIT_INTERVAL (5 * HZ)
+
+/* A block which joined a transaction since the last checkpoint */
+struct hellofs_jblock {
+    struct rb_node node;
+    uint64_t block_no;
+    // Holds a reference, which keeps the buffer cached
+    struct buffer_head *bh;
+    // Contents as last committed, written home by the next checkpoint
+    char *copy;
+    // Contents being committed
+    char *frozen;
+
+    // In the running transaction
+    struct list_head running_node;
+    int running;
+    // In the transaction being committed
+    struct list_head commit_node;
+    int committing;
+    // Freed since it last joined a transaction. On the running revoke
+    // list until the revoke record is committed.
+    struct list_head revoke_node;
+    int revoked;
+    // On the private list of blocks being written home
+    struct list_head home_node;
+};
+
+struct hellofs_journal {
+    struct super_block *sb;
+    uint64_t start_block_no;
+    uint64_t block_count;
+    // Pinned
+    struct buffer_head *jsb_bh;
+
+    // Held shared by handles, exclusively to close the running transaction
+    struct rw_semaphore trans_sem;
+    // Protects blocks, the running lists and the jblocks
+    struct mutex list_lock;
+    struct rb_root blocks;
+    struct list_head running;
+    uint64_t running_count;
+    struct list_head running_revokes;
+    // Sequence of the running transaction
+    uint64_t sequence;
+    // Transactions before this one are on disk
+    uint64_t commit_sequence;
+    // Transactions are committed early once they have this many blocks
+    uint64_t max_running;
+
+    // Next free log block, relative to start_block_no. Only used by the
+    // commit thread, and at mount and unmount.
+    uint64_t head;
+    // The log could not be written, transactions go home directly
+    int aborted;
+    // Metadata could not be written at all, reported to fsync and sync
+    int error;
+    // Set while blocks are on the private list of a write home, woken
+    // when it is emptied
+    int writing_home;
+    wait_queue_head_t wait_home;
+
+    struct task_struct *thread;
+    wait_queue_head_t wait_commit;
+    wait_queue_head_t wait_done;
+    spinlock_t request_lock;
+    unsigned long commit_request;
+    unsigned long commit_done;
+};
+
+/* A transaction on its way to the log */
+struct hellofs_commit {
+    uint64_t sequence;
+    // jblocks with frozen contents, linked by commit_node
+    struct list_head blocks;
+    uint64_t block_count;
+    // Revoke blocks ready to be logged, pages linked by lru
+    struct list_head revoke_pages;
+    uint64_t revoke_block_count;
+};
+
+/* A revoke record found while replaying */
+struct hellofs_revoke_record {
+    uint64_t block_no;
+    uint64_t sequence;
+};
+
+static struct hellofs_jblock *hellofs_jblock_find(
+        struct hellofs_journal *journal, uint64_t block_no) {
+    struct rb_node *node = journal->blocks.rb_node;
+    struct hellofs_jblock *jb;
+
+    while (node) {
+        jb = rb_entry(node, struct hellofs_jblock, node);
+        if (block_no < jb->block_no) {
+            node = node->rb_left;
+        } else if (block_no > jb->block_no) {
+            node = node->rb_right;
+        } else {
+            return jb;
+        }
+    }
+    return NULL;
+}
+
+/* The first jblock at or after block_no, NULL if there is none */
+static struct hellofs_jblock *hellofs_jblock_first(
+        struct hellofs_journal *journal, uint64_t block_no) {
+    struct rb_node *node = journal->blocks.rb_node;
+    struct hellofs_jblock *jb;
+    struct hellofs_jblock *first = NULL;
+
+    while (node) {
+        jb = rb_entry(node, struct hellofs_jblock, node);
+        if (block_no <= jb->block_no) {
+            first = jb;
+            node = node->rb_left;
+        } else {
+            node = node->rb_right;
+        }
+    }
+    return first;
+}
+
+static struct hellofs_jblock *hellofs_jblock_get(
+        struct hellofs_journal *journal, struct buffer_head *bh) {
+    struct rb_node **link = &journal->blocks.rb_node;
+    struct rb_node *parent = NULL;
+    struct hellofs_jblock *jb;
+
+    while (*link) {
+        parent = *link;
+        jb = rb_entry(parent, struct hellofs_jblock, node);
+        if (bh->b_blocknr < jb->block_no) {
+            link = &parent->rb_left;
+        } else if (bh->b_blocknr > jb->block_no) {
+            link = &parent->rb_right;
+        } else {
+            return jb;
+        }
+    }
+
+    jb = kzalloc(sizeof(*jb), GFP_NOFS | __GFP_NOFAIL);
+    jb->block_no = bh->b_blocknr;
+    get_bh(bh);
+    jb->bh = bh;
+    INIT_LIST_HEAD(&jb->running_node);
+    INIT_LIST_HEAD(&jb->commit_node);
+    INIT_LIST_HEAD(&jb->revoke_node);
+    INIT_LIST_HEAD(&jb->home_node);
+    rb_link_node(&jb->node, parent, link);
+    rb_insert_color(&jb->node, &journal->blocks);
+    return jb;
+}
+
+static void hellofs_jblock_free(struct hellofs_journal *journal,
+                                struct hellofs_jblock *jb) {
+    rb_erase(&jb->node, &journal->blocks);
+    if (jb->copy) {
+        free_page((unsigned long)jb->copy);
+    }
+    brelse(jb->bh);
+    kfree(jb);
+}
+
+/* Journal blocks are page sized at most, a page holds any of them */
+static char *hellofs_journal_alloc_block(void) {
+    return (char *)__get_free_page(GFP_NOFS | __GFP_NOFAIL);
+}
+
+static void hellofs_journal_init_header(struct hellofs_journal *journal,
+                                        char *block, uint32_t type,
+                                        uint64_t sequence) {
+    struct hellofs_journal_header *header;
+
+    memset(block, 0, journal->sb->s_blocksize);
+    header = (struct hellofs_journal_header *)block;
+    header->magic = HELLOFS_JOURNAL_MAGIC;
+    header->type = type;
+    header->sequence = sequence;
+}
+
+static inline int hellofs_journal_requested(struct hellofs_journal *journal) {
+    return ACCESS_ONCE(journal->commit_request) != journal->commit_done;
+}
+
+static inline int hellofs_journal_done(struct hellofs_journal *journal,
+                                       unsigned long request) {
+    return (long)(ACCESS_ONCE(journal->commit_done) - request) >= 0;
+}
+
+/* The hellofs handle the task is running, if any. journal_info may be
+   a handle of another filesystem, which is left alone. */
+static struct hellofs_handle *hellofs_current_handle(void) {
+    struct hellofs_handle *handle = current->journal_info;
+
+    if (handle && HELLOFS_HANDLE_MAGIC == handle->magic) {
+        return handle;
+    }
+    return NULL;
+}
+
+/* Ask the commit thread to commit what has been done so far. With wait,
+   return once it is on disk. Returns -EIO once metadata failed to reach
+   the disk. */
+int hellofs_journal_commit(struct super_block *sb, int wait) {
+    struct hellofs_journal *journal = HELLOFS_SB_INFO(sb)->journal;
+    struct hellofs_handle *handle = hellofs_current_handle();
+    unsigned long request;
+
+    spin_lock(&journal->request_lock);
+    request = ++journal->commit_request;
+    spin_unlock(&journal->request_lock);
+    wake_up(&journal->wait_commit);
+
+    /* The commit would wait for our own handle to stop */
+    if (!wait || (handle && handle->journal == journal)) {
+        return 0;
+    }
+    wait_event(journal->wait_done, hellofs_journal_done(journal, request));
+    return journal->error;
+}
+
+/* Handles nest: only the outermost handle of a task joins the running
+   transaction, inner ones ride along with it. Waiting for a commit is
+   only possible outside of a handle, which is when a transaction that
+   grew too large for the log is pushed out. A handle of another
+   filesystem the task holds is put back when the outermost one stops. */
+void hellofs_journal_start(struct super_block *sb,
+                           struct hellofs_handle *handle) {
+    struct hellofs_journal *journal = HELLOFS_SB_INFO(sb)->journal;
+    struct hellofs_handle *outer = hellofs_current_handle();
+
+    handle->magic = HELLOFS_HANDLE_MAGIC;
+    handle->journal = journal;
+    handle->outer = outer;
+    handle->saved = current->journal_info;
+    if (!journal || (outer && outer->journal == journal)) {
+        return;
+    }
+
+    if (ACCESS_ONCE(journal->running_count) >= journal->max_running) {
+        hellofs_journal_commit(sb, 1);
+    }
+    down_read(&journal->trans_sem);
+    current->journal_info = handle;
+}
+
+void hellofs_journal_stop(struct hellofs_handle *handle) {
+    if (!handle->journal || current->journal_info != handle) {
+        return;
+    }
+    current->journal_info = handle->saved;
+    up_read(&handle->journal->trans_sem);
+}
+
+/* Add a metadata buffer the current operation changed to the running
+   transaction. Without a journal it is only marked dirty. */
+void hellofs_journal_dirty(struct super_block *sb, struct buffer_head *bh) {
+    struct hellofs_journal *journal = HELLOFS_SB_INFO(sb)->journal;
+    struct hellofs_jblock *jb;
+    uint64_t count;
+
+    if (!journal) {
+        mark_buffer_dirty(bh);
+        return;
+    }
+    WARN_ON_ONCE(!hellofs_current_handle());
+
+    mutex_lock(&journal->list_lock);
+    jb = hellofs_jblock_get(journal, bh);
+    if (!jb->running) {
+        jb->running = 1;
+        list_add_tail(&jb->running_node, &journal->running);
+        journal->running_count += 1;
+    }
+    /* Reused after being freed, the new contents are logged again */
+    if (jb->revoked) {
+        jb->revoked = 0;
+        list_del_init(&jb->revoke_node);
+    }
+    count = journal->running_count;
+    mutex_unlock(&journal->list_lock);
+
+    /* Start committing in the background well before the limit */
+    if (count == journal->max_running / 2) {
+        hellofs_journal_commit(sb, 0);
+    }
+}
+
+/* Same as hellofs_journal_dirty(), without a journal the buffer is
+   associated with inode so that fsync of the inode writes it */
+void hellofs_journal_dirty_inode(struct buffer_head *bh,
+                                 struct inode *inode) {
+    if (!HELLOFS_SB_INFO(inode->i_sb)->journal) {
+        mark_buffer_dirty_inode(bh, inode);
+        return;
+    }
+    hellofs_journal_dirty(inode->i_sb, bh);
+    hellofs_journal_mark_inode(inode);
+}
+
+/* Remember that the running transaction changed inode, for
+   hellofs_journal_commit_inode(). Caller holds a handle, so the running
+   transaction can not be closed meanwhile. */
+void hellofs_journal_mark_inode(struct inode *inode) {
+    struct hellofs_journal *journal = HELLOFS_SB_INFO(inode->i_sb)->journal;
+
+    if (journal) {
+        HELLOFS_I(inode)->sequence = journal->sequence;
+    }
+}
+
+/* Commit the transaction which last changed inode and wait for it, unless
+   it is on disk already */
+int hellofs_journal_commit_inode(struct inode *inode) {
+    struct hellofs_journal *journal = HELLOFS_SB_INFO(inode->i_sb)->journal;
+
+    if ((int64_t)(HELLOFS_I(inode)->sequence
+                  - ACCESS_ONCE(journal->commit_sequence)) < 0) {
+        return journal->error;
+    }
+    return hellofs_journal_commit(inode->i_sb, 1);
+}
+
+/* For fsync, once the data of inode is written: commit the transaction
+   which last changed inode, whose commit block flushes the disk cache, or
+   only flush the cache when that transaction is on disk already */
+int hellofs_journal_fsync_inode(struct inode *inode) {
+    struct hellofs_journal *journal = HELLOFS_SB_INFO(inode->i_sb)->journal;
+
+    if ((int64_t)(HELLOFS_I(inode)->sequence
+                  - ACCESS_ONCE(journal->commit_sequence)) < 0) {
+        if (journal->error) {
+            return journal->error;
+        }
+        return blkdev_issue_flush(inode->i_sb->s_bdev, GFP_KERNEL, NULL);
+    }
+    return hellofs_journal_commit(inode->i_sb, 1);
+}
+
+/* Freed blocks may be reused for file data, which does not go through
+   the journal. Drop their committed copies, so that no checkpoint writes
+   them home, and revoke them, so that no replay does. */
+void hellofs_journal_forget(struct super_block *sb, uint64_t block_no,
+                            uint64_t count) {
+    struct hellofs_journal *journal = HELLOFS_SB_INFO(sb)->journal;
+    struct hellofs_jblock *jb;
+    struct rb_node *node;
+
+    if (!journal) {
+        return;
+    }
+
+again:
+    mutex_lock(&journal->list_lock);
+    jb = hellofs_jblock_first(journal, block_no);
+    while (jb && jb->block_no < block_no + count) {
+        /* Its old contents must be home before the block can be reused */
+        if (!list_empty(&jb->home_node)) {
+            mutex_unlock(&journal->list_lock);
+            wait_event(journal->wait_home,
+                       !ACCESS_ONCE(journal->writing_home));
+            goto again;
+        }
+        if (!jb->revoked) {
+            jb->revoked = 1;
+            if (jb->copy) {
+                free_page((unsigned long)jb->copy);
+                jb->copy = NULL;
+            }
+            list_add_tail(&jb->revoke_node, &journal->running_revokes);
+        }
+        node = rb_next(&jb->node);
+        jb = node ? rb_entry(node, struct hellofs_jblock, node) : NULL;
+    }
+    mutex_unlock(&journal->list_lock);
+}
+
+/* Close the running transaction. Its blocks are copied, so that the next
+   transaction can change them while they are written to the log, and its
+   revoke blocks are laid out. Returns 0 if there is nothing to commit. */
+static int hellofs_journal_freeze(struct hellofs_journal *journal,
+                                  struct hellofs_commit *commit) {
+    struct super_block *sb = journal->sb;
+    struct hellofs_journal_header *header;
+    struct hellofs_jblock *jb, *next;
+    uint64_t tags;
+    char *block;
+
+    tags = HELLOFS_JOURNAL_TAGS_PER_BLOCK_HSB(HELLOFS_SB(sb));
+    INIT_LIST_HEAD(&commit->blocks);
+    INIT_LIST_HEAD(&commit->revoke_pages);
+    commit->block_count = 0;
+    commit->revoke_block_count = 0;
+
+    down_write(&journal->trans_sem);
+    mutex_lock(&journal->list_lock);
+    if (list_empty(&journal->running)
+            && list_empty(&journal->running_revokes)) {
+        mutex_unlock(&journal->list_lock);
+        up_write(&journal->trans_sem);
+        return 0;
+    }
+    commit->sequence = journal->sequence++;
+
+    list_for_each_entry_safe(jb, next, &journal->running, running_node) {
+        list_del_init(&jb->running_node);
+        jb->running = 0;
+        /* Freed again, the revoke record covers it */
+        if (jb->revoked) {
+            continue;
+        }
+        jb->frozen = hellofs_journal_alloc_block();
+        memcpy(jb->frozen, jb->bh->b_data, sb->s_blocksize);
+        jb->committing = 1;
+        list_add_tail(&jb->commit_node, &commit->blocks);
+        commit->block_count += 1;
+    }
+    journal->running_count = 0;
+
+    header = NULL;
+    list_for_each_entry_safe(jb, next, &journal->running_revokes,
+                             revoke_node) {
+        list_del_init(&jb->revoke_node);
+        if (!header || header->count == tags) {
+            block = hellofs_journal_alloc_block();
+            hellofs_journal_init_header(journal, block,
+                                        HELLOFS_JOURNAL_REVOKE,
+                                        commit->sequence);
+            list_add_tail(&virt_to_page(block)->lru, &commit->revoke_pages);
+            commit->revoke_block_count += 1;
+            header = (struct hellofs_journal_header *)block;
+        }
+        header->block_nos[header->count++] = jb->block_no;
+    }
+
+    mutex_unlock(&journal->list_lock);
+    up_write(&journal->trans_sem);
+    return 1;
+}
+
+/* Log blocks a commit takes, with its descriptor and commit blocks */
+static uint64_t hellofs_journal_commit_blocks(struct hellofs_journal *journal,
+                                              struct hellofs_commit *commit) {
+    uint64_t tags = HELLOFS_JOURNAL_TAGS_PER_BLOCK_HSB(HELLOFS_SB(journal->sb));
+
+    return DIV_ROUND_UP(commit->block_count, tags) + commit->block_count
+           + commit->revoke_block_count + 1;
+}
+
+/* Start writing a locked buffer. Buffers are chained on *list through
+   b_private, for hellofs_journal_wait(). */
+static void hellofs_journal_submit(struct buffer_head *bh, int rw,
+                                   struct buffer_head **list) {
+    bh->b_private = *list;
+    *list = bh;
+    get_bh(bh);
+    bh->b_end_io = end_buffer_write_sync;
+    submit_bh(rw, bh);
+}
+
+/* Log blocks go through the buffer cache, so that it never holds stale
+   copies of them */
+static void hellofs_journal_write_log(struct hellofs_journal *journal,
+                                      uint64_t pos, const char *data,
+                                      int rw, struct buffer_head **list) {
+    struct buffer_head *bh;
+
+    bh = sb_getblk(journal->sb, journal->start_block_no + pos);
+    BUG_ON(!bh);
+    lock_buffer(bh);
+    memcpy(bh->b_data, data, bh->b_size);
+    set_buffer_uptodate(bh);
+    clear_buffer_dirty(bh);
+    hellofs_journal_submit(bh, rw, list);
+}
+
+/* Home blocks are written from a copy, the cached buffer may already hold
+   changes of a later transaction */
+static void hellofs_journal_write_home(struct hellofs_journal *journal,
+                                       uint64_t block_no, char *data,
+                                       struct buffer_head **list) {
+    struct buffer_head *bh;
+
+    bh = alloc_buffer_head(GFP_NOFS | __GFP_NOFAIL);
+    bh->b_bdev = journal->sb->s_bdev;
+    bh->b_blocknr = block_no;
+    bh->b_size = journal->sb->s_blocksize;
+    set_bh_page(bh, virt_to_page(data), offset_in_page(data));
+    set_buffer_mapped(bh);
+    set_buffer_uptodate(bh);
+    lock_buffer(bh);
+    hellofs_journal_submit(bh, WRITE, list);
+}
+
+/* Wait for the writes chained on list. Log buffers are released, the
+   ones hellofs_journal_write_home() made, whose pages belong to no
+   mapping, are freed. */
+static int hellofs_journal_wait(struct buffer_head *list) {
+    struct buffer_head *bh;
+    int ret = 0;
+
+    while (list) {
+        bh = list;
+        list = bh->b_private;
+        bh->b_private = NULL;
+        wait_on_buffer(bh);
+        if (!buffer_uptodate(bh)) {
+            ret = -EIO;
+        }
+        if (bh->b_page->mapping) {
+            brelse(bh);
+        } else {
+            free_buffer_head(bh);
+        }
+    }
+    return ret;
+}
+
+/* The flush makes everything written before durable, before the journal
+   superblock says it is */
+static int hellofs_journal_write_super(struct hellofs_journal *journal,
+                                       uint64_t sequence) {
+    struct buffer_head *bh = journal->jsb_bh;
+    struct hellofs_journal_superblock *jsb;
+
+    jsb = (struct hellofs_journal_superblock *)bh->b_data;
+    lock_buffer(bh);
+    jsb->sequence = sequence;
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    return __sync_dirty_buffer(bh, WRITE_FLUSH_FUA);
+}
+
+/* Write the blocks on the private list home, from their committed copies
+   or, with frozen set, from the contents being committed. list_lock is
+   not held meanwhile, so that operations keep changing metadata. Only the
+   commit thread replaces copies, and hellofs_journal_forget() waits for
+   a block on the list instead of dropping its copy, so the contents stay
+   put until hellofs_journal_home_done(). */
+static int hellofs_journal_write_list_home(struct hellofs_journal *journal,
+                                           struct list_head *blocks,
+                                           int frozen) {
+    struct buffer_head *list = NULL;
+    struct hellofs_jblock *jb;
+
+    list_for_each_entry(jb, blocks, home_node) {
+        hellofs_journal_write_home(journal, jb->block_no,
+                                   frozen ? jb->frozen : jb->copy, &list);
+    }
+    return hellofs_journal_wait(list);
+}
+
+/* Empty the private list, the blocks on it may be freed again */
+static void hellofs_journal_home_done(struct hellofs_journal *journal,
+                                      struct list_head *blocks) {
+    struct hellofs_jblock *jb, *next;
+
+    mutex_lock(&journal->list_lock);
+    list_for_each_entry_safe(jb, next, blocks, home_node) {
+        list_del_init(&jb->home_node);
+    }
+    journal->writing_home = 0;
+    mutex_unlock(&journal->list_lock);
+    wake_up_all(&journal->wait_home);
+}
+
+/* Write the committed copies home and empty the log, which then starts
+   over with transaction sequence. A freed block stays unused until the
+   log no longer holds it. */
+static int hellofs_journal_checkpoint(struct hellofs_journal *journal,
+                                      uint64_t sequence) {
+    struct hellofs_jblock *jb;
+    struct rb_node *node;
+    LIST_HEAD(blocks);
+    int ret;
+
+    mutex_lock(&journal->list_lock);
+    for (node = rb_first(&journal->blocks); node; node = rb_next(node)) {
+        jb = rb_entry(node, struct hellofs_jblock, node);
+        if (jb->copy) {
+            list_add_tail(&jb->home_node, &blocks);
+        }
+    }
+    journal->writing_home = 1;
+    mutex_unlock(&journal->list_lock);
+
+    ret = hellofs_journal_write_list_home(journal, &blocks, 0);
+    if (0 == ret) {
+        ret = hellofs_journal_write_super(journal, sequence);
+    }
+    hellofs_journal_home_done(journal, &blocks);
+    if (0 != ret) {
+        return ret;
+    }
+
+    journal->head = 1;
+    /* Blocks which are not part of a transaction any more are home */
+    mutex_lock(&journal->list_lock);
+    node = rb_first(&journal->blocks);
+    while (node) {
+        jb = rb_entry(node, struct hellofs_jblock, node);
+        node = rb_next(node);
+        if (jb->copy) {
+            free_page((unsigned long)jb->copy);
+            jb->copy = NULL;
+        }
+        if (!jb->running && !jb->committing
+                && list_empty(&jb->revoke_node)) {
+            hellofs_jblock_free(journal, jb);
+        }
+    }
+    mutex_unlock(&journal->list_lock);
+    return 0;
+}
+
+/* Append a transaction to the log: descriptor blocks each followed by the
+   blocks they list, the revoke blocks, then the commit block. The commit
+   block is only written once the rest is done, and flushes it all. */
+static int hellofs_journal_write_commit(struct hellofs_journal *journal,
+                                        struct hellofs_commit *commit) {
+    struct super_block *sb = journal->sb;
+    struct buffer_head *list = NULL;
+    struct hellofs_journal_header *header;
+    struct hellofs_jblock *jb, *cur;
+    struct page *page;
+    uint64_t tags;
+    uint64_t done;
+    uint64_t pos;
+    uint64_t i;
+    char *block;
+    u32 crc;
+    int ret;
+
+    tags = HELLOFS_JOURNAL_TAGS_PER_BLOCK_HSB(HELLOFS_SB(sb));
+    block = hellofs_journal_alloc_block();
+    header = (struct hellofs_journal_header *)block;
+    pos = journal->head;
+    crc = ~0;
+
+    jb = list_entry(commit->blocks.next, struct hellofs_jblock, commit_node);
+    for (done = 0; done < commit->block_count; done += header->count) {
+        hellofs_journal_init_header(journal, block,
+                                    HELLOFS_JOURNAL_DESCRIPTOR,
+                                    commit->sequence);
+        header->count = min(tags, commit->block_count - done);
+        cur = jb;
+        for (i = 0; i < header->count; i++) {
+            header->block_nos[i] = cur->block_no;
+            cur = list_entry(cur->commit_node.next, struct hellofs_jblock,
+                             commit_node);
+        }
+        crc = crc32_le(crc, block, sb->s_blocksize);
+        hellofs_journal_write_log(journal, pos++, block, WRITE, &list);
+
+        for (i = 0; i < header->count; i++) {
+            crc = crc32_le(crc, jb->frozen, sb->s_blocksize);
+            hellofs_journal_write_log(journal, pos++, jb->frozen, WRITE,
+                                      &list);
+            jb = list_entry(jb->commit_node.next, struct hellofs_jblock,
+                            commit_node);
+        }
+    }
+    list_for_each_entry(page, &commit->revoke_pages, lru) {
+        crc = crc32_le(crc, page_address(page), sb->s_blocksize);
+        hellofs_journal_write_log(journal, pos++, page_address(page), WRITE,
+                                  &list);
+    }
+    ret = hellofs_journal_wait(list);
+
+    if (0 == ret) {
+        hellofs_journal_init_header(journal, block, HELLOFS_JOURNAL_COMMIT,
+                                    commit->sequence);
+        header->count = commit->block_count;
+        header->checksum = crc;
+        list = NULL;
+        hellofs_journal_write_log(journal, pos++, block, WRITE_FLUSH_FUA,
+                                  &list);
+        ret = hellofs_journal_wait(list);
+    }
+    free_page((unsigned long)block);
+
+    if (0 == ret) {
+        journal->head = pos;
+    }
+    return ret;
+}
+
+/* Write a transaction straight to its home blocks, when it does not fit
+   in the log or the log can not be written */
+static int hellofs_journal_write_commit_home(struct hellofs_journal *journal,
+                                             struct hellofs_commit *commit) {
+    struct hellofs_jblock *jb;
+    LIST_HEAD(blocks);
+    int ret;
+
+    mutex_lock(&journal->list_lock);
+    list_for_each_entry(jb, &commit->blocks, commit_node) {
+        if (!jb->revoked) {
+            list_add_tail(&jb->home_node, &blocks);
+        }
+    }
+    journal->writing_home = 1;
+    mutex_unlock(&journal->list_lock);
+
+    ret = hellofs_journal_write_list_home(journal, &blocks, 1);
+    hellofs_journal_home_done(journal, &blocks);
+
+    if (0 == ret) {
+        ret = blkdev_issue_flush(journal->sb->s_bdev, GFP_NOFS, NULL);
+    }
+    return ret;
+}
+
+/* The frozen contents become the committed copies, to be checkpointed,
+   unless they went home already */
+static void hellofs_journal_finish(struct hellofs_journal *journal,
+                                   struct hellofs_commit *commit, int home) {
+    struct hellofs_jblock *jb, *next;
+    struct page *page, *tmp;
+
+    mutex_lock(&journal->list_lock);
+    list_for_each_entry_safe(jb, next, &commit->blocks, commit_node) {
+        list_del_init(&jb->commit_node);
+        jb->committing = 0;
+        if (jb->copy) {
+            free_page((unsigned long)jb->copy);
+            jb->copy = NULL;
+        }
+        if (home || jb->revoked) {
+            free_page((unsigned long)jb->frozen);
+        } else {
+            jb->copy = jb->frozen;
+        }
+        jb->frozen = NULL;
+    }
+    mutex_unlock(&journal->list_lock);
+
+    list_for_each_entry_safe(page, tmp, &commit->revoke_pages, lru) {
+        list_del(&page->lru);
+        __free_page(page);
+    }
+}
+
+/* Stop using the log after a write to it failed. The copies it holds are
+   written home and the log is emptied, with the journal superblock
+   pointing at transaction sequence which is never logged, so that no
+   replay applies them over metadata written in place afterwards. */
+static void hellofs_journal_abort(struct hellofs_journal *journal,
+                                  uint64_t sequence) {
+    int ret;
+
+    journal->aborted = 1;
+    ret = hellofs_journal_checkpoint(journal, sequence);
+    if (0 != ret) {
+        printk(KERN_ERR "hellofs: failed to empty the journal (%d), it may "
+                        "replay stale metadata at the next mount\n", ret);
+        journal->error = -EIO;
+    }
+}
+
+/* Returns 0 if there was nothing to commit */
+static int hellofs_journal_do_commit(struct hellofs_journal *journal) {
+    struct hellofs_commit commit;
+    uint64_t needed;
+    int home;
+    int ret;
+
+    if (!hellofs_journal_freeze(journal, &commit)) {
+        return 0;
+    }
+
+    needed = hellofs_journal_commit_blocks(journal, &commit);
+    home = journal->aborted;
+    ret = 0;
+    if (!home && journal->head + needed > journal->block_count) {
+        ret = hellofs_journal_checkpoint(journal, commit.sequence);
+        if (0 == ret && journal->head + needed > journal->block_count) {
+            printk(KERN_WARNING "hellofs: transaction %llu of %llu blocks "
+                                "does not fit in the journal, writing it "
+                                "in place\n",
+                   commit.sequence, needed);
+            home = 1;
+        }
+    }
+    if (0 == ret && !home) {
+        ret = hellofs_journal_write_commit(journal, &commit);
+    }
+    if (0 != ret) {
+        printk(KERN_ERR "hellofs: journal write failed (%d), metadata is "
+                        "written in place from now on\n", ret);
+        hellofs_journal_abort(journal, commit.sequence + 1);
+        home = 1;
+    }
+    if (home) {
+        ret = hellofs_journal_write_commit_home(journal, &commit);
+        if (0 == ret && !journal->aborted) {
+            /* The log was emptied for this transaction, it starts over
+               with the next one, which replay has to look for */
+            ret = hellofs_journal_write_super(journal, commit.sequence + 1);
+            if (0 != ret) {
+                journal->aborted = 1;
+            }
+        }
+        if (0 != ret) {
+            printk(KERN_ERR "hellofs: failed to write transaction %llu (%d)\n",
+                   commit.sequence, ret);
+            journal->error = -EIO;
+        }
+    }
+    hellofs_journal_finish(journal, &commit, home);
+    ACCESS_ONCE(journal->commit_sequence) = commit.sequence + 1;
+    return 1;
+}
+
+static int hellofs_journal_thread(void *arg) {
+    struct hellofs_journal *journal = arg;
+    unsigned long request;
+
+    while (!kthread_should_stop()) {
+        wait_event_interruptible_timeout(
+            journal->wait_commit,
+            kthread_should_stop() || hellofs_journal_requested(journal),
+            HELLOFS_JOURNAL_COMMIT_INTERVAL);
+
+        spin_lock(&journal->request_lock);
+        request = journal->commit_request;
+        spin_unlock(&journal->request_lock);
+
+        /* A commit block flushes the disk cache. Without one, fsync
+           of data written over allocated blocks still needs a flush. */
+        if (!hellofs_journal_do_commit(journal)
+                && request != journal->commit_done
+                && 0 != blkdev_issue_flush(journal->sb->s_bdev, GFP_KERNEL,
+                                           NULL)) {
+            journal->error = -EIO;
+        }
+
+        journal->commit_done = request;
+        wake_up_all(&journal->wait_done);
+    }
+    return 0;
+}
+
+static int hellofs_revoke_record_cmp(const void *a, const void *b) {
+    const struct hellofs_revoke_record *ra = a;
+    const struct hellofs_revoke_record *rb = b;
+
+    if (ra->block_no != rb->block_no) {
+        return ra->block_no < rb->block_no ? -1 : 1;
+    }
+    return 0;
+}
+
+/* Whether a revoke record of transaction sequence or a later one cancels
+   the copy of block_no logged by transaction sequence. The records are
+   sorted by block no. */
+static int hellofs_journal_revoked(struct hellofs_revoke_record *records,
+                                   uint64_t count, uint64_t block_no,
+                                   uint64_t sequence) {
+    uint64_t lo = 0, hi = count, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (records[mid].block_no < block_no) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    for (; lo < count && records[lo].block_no == block_no; lo++) {
+        if (records[lo].sequence >= sequence) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Read log block pos as a header of transaction sequence. Returns NULL if
+   it is not one, which is where the log ends. */
+static struct buffer_head *hellofs_journal_read_header(
+        struct hellofs_journal *journal, uint64_t pos, uint64_t sequence,
+        int *err) {
+    struct hellofs_journal_header *header;
+    struct buffer_head *bh;
+    uint64_t tags;
+
+    tags = HELLOFS_JOURNAL_TAGS_PER_BLOCK_HSB(HELLOFS_SB(journal->sb));
+    *err = 0;
+    if (pos >= journal->block_count) {
+        return NULL;
+    }
+    bh = sb_bread(journal->sb, journal->start_block_no + pos);
+    if (!bh) {
+        *err = -EIO;
+        return NULL;
+    }
+
+    header = (struct hellofs_journal_header *)bh->b_data;
+    if (HELLOFS_JOURNAL_MAGIC != header->magic
+            || sequence != header->sequence
+            || (HELLOFS_JOURNAL_COMMIT != header->type
+                && HELLOFS_JOURNAL_DESCRIPTOR != header->type
+                && HELLOFS_JOURNAL_REVOKE != header->type)
+            || (HELLOFS_JOURNAL_COMMIT != header->type
+                && header->count > tags)) {
+        brelse(bh);
+        return NULL;
+    }
+    return bh;
+}
+
+/* Add crc32 of count log blocks from pos to *crc */
+static int hellofs_journal_crc_blocks(struct hellofs_journal *journal,
+                                      uint64_t pos, uint64_t count, u32 *crc) {
+    struct buffer_head *bh;
+    uint64_t i;
+
+    for (i = 0; i < count; i++) {
+        bh = sb_bread(journal->sb, journal->start_block_no + pos + i);
+        if (!bh) {
+            return -EIO;
+        }
+        *crc = crc32_le(*crc, bh->b_data, bh->b_size);
+        brelse(bh);
+    }
+    return 0;
+}
+
+/* Copy log block pos to its home block_no, written back by the caller */
+static int hellofs_journal_restore(struct hellofs_journal *journal,
+                                   uint64_t pos, uint64_t block_no) {
+    struct buffer_head *log_bh;
+    struct buffer_head *bh;
+
+    if (block_no >= journal->start_block_no) {
+        printk(KERN_ERR "hellofs: journal logs block %llu outside of the "
+                        "filesystem, skipped\n", block_no);
+        return 0;
+    }
+    log_bh = sb_bread(journal->sb, journal->start_block_no + pos);
+    if (!log_bh) {
+        return -EIO;
+    }
+    bh = sb_getblk(journal->sb, block_no);
+    BUG_ON(!bh);
+    lock_buffer(bh);
+    memcpy(bh->b_data, log_bh->b_data, bh->b_size);
+    set_buffer_uptodate(bh);
+    unlock_buffer(bh);
+    mark_buffer_dirty(bh);
+    brelse(bh);
+    brelse(log_bh);
+    return 0;
+}
+
+/* Replay the complete transactions of the log into their home blocks. The
+   first pass finds where the last transaction with a valid commit block
+   ends, and collects the revoke records. The second writes the logged
+   blocks which no revoke record cancels. */
+static int hellofs_journal_replay(struct hellofs_journal *journal) {
+    struct super_block *sb = journal->sb;
+    struct hellofs_journal_superblock *jsb;
+    struct hellofs_journal_header *header;
+    struct hellofs_revoke_record *records = NULL;
+    struct hellofs_revoke_record *grown;
+    struct buffer_head *bh;
+    uint64_t record_count = 0;
+    uint64_t committed_records = 0;
+    uint64_t record_capacity = 0;
+    uint64_t sequence;
+    uint64_t replayed;
+    uint64_t count;
+    uint64_t pos;
+    uint64_t end;
+    uint64_t i;
+    uint32_t type;
+    int complete;
+    u32 crc;
+    int ret = 0;
+
+    jsb = (struct hellofs_journal_superblock *)journal->jsb_bh->b_data;
+
+    sequence = jsb->sequence;
+    pos = 1;
+    end = 1;
+    for (;;) {
+        crc = ~0;
+        complete = 0;
+        while ((bh = hellofs_journal_read_header(journal, pos, sequence,
+                                                 &ret))) {
+            header = (struct hellofs_journal_header *)bh->b_data;
+            type = header->type;
+            count = header->count;
+            pos += 1;
+            if (HELLOFS_JOURNAL_COMMIT == type) {
+                complete = crc == header->checksum;
+                brelse(bh);
+                break;
+            }
+            crc = crc32_le(crc, bh->b_data, sb->s_blocksize);
+
+            if (HELLOFS_JOURNAL_REVOKE == type) {
+                if (record_count + count > record_capacity) {
+                    record_capacity = max(2 * record_capacity,
+                                          record_count + count);
+                    grown = krealloc(records,
+                                     record_capacity * sizeof(*records),
+                                     GFP_KERNEL);
+                    if (!grown) {
+                        brelse(bh);
+                        ret = -ENOMEM;
+                        break;
+                    }
+                    records = grown;
+                }
+                for (i = 0; i < count; i++) {
+                    records[record_count].block_no = header->block_nos[i];
+                    records[record_count].sequence = sequence;
+                    record_count += 1;
+                }
+            }
+            brelse(bh);
+
+            if (HELLOFS_JOURNAL_DESCRIPTOR == type) {
+                if (pos + count > journal->block_count) {
+                    break;
+                }
+                ret = hellofs_journal_crc_blocks(journal, pos, count, &crc);
+                if (0 != ret) {
+                    break;
+                }
+                pos += count;
+            }
+        }
+        if (0 != ret || !complete) {
+            break;
+        }
+        sequence += 1;
+        end = pos;
+        committed_records = record_count;
+    }
+    if (0 != ret) {
+        goto out;
+    }
+
+    sort(records, committed_records, sizeof(*records),
+         hellofs_revoke_record_cmp, NULL);
+
+    replayed = 0;
+    sequence = jsb->sequence;
+    pos = 1;
+    while (pos < end) {
+        bh = sb_bread(sb, journal->start_block_no + pos);
+        if (!bh) {
+            ret = -EIO;
+            goto out;
+        }
+        header = (struct hellofs_journal_header *)bh->b_data;
+        pos += 1;
+        if (HELLOFS_JOURNAL_COMMIT == header->type) {
+            sequence += 1;
+            replayed += 1;
+        } else if (HELLOFS_JOURNAL_DESCRIPTOR == header->type) {
+            for (i = 0; i < header->count; i++, pos++) {
+                if (hellofs_journal_revoked(records, committed_records,
+                                            header->block_nos[i],
+                                            sequence)) {
+                    continue;
+                }
+                ret = hellofs_journal_restore(journal, pos,
+                                              header->block_nos[i]);
+                if (0 != ret) {
+                    brelse(bh);
+                    goto out;
+                }
+            }
+        }
+        brelse(bh);
+    }
+
+    if (replayed) {
+        ret = sync_blockdev(sb->s_bdev);
+        if (0 == ret) {
+            ret = blkdev_issue_flush(sb->s_bdev, GFP_KERNEL, NULL);
+        }
+        if (0 != ret) {
+            goto out;
+        }
+        printk(KERN_INFO "hellofs: replayed %llu transactions from the "
+                         "journal\n", replayed);
+    }
+
+    /* Skip the sequence of a torn transaction, so that what it left in
+       the log never looks like the start of it */
+    journal->sequence = sequence + 1;
+    journal->commit_sequence = journal->sequence;
+    journal->head = 1;
+    ret = hellofs_journal_write_super(journal, journal->sequence);
+
+out:
+    kfree(records);
+    return ret;
+}
+
+/* Called at mount before anything else reads metadata, which the replay
+   may rewrite */
+int hellofs_journal_load(struct super_block *sb) {
+    struct hellofs_sb_info *sbi = HELLOFS_SB_INFO(sb);
+    struct hellofs_superblock *hellofs_sb = HELLOFS_SB(sb);
+    struct hellofs_journal_superblock *jsb;
+    struct hellofs_journal *journal;
+    int ret;
+
+    if (0 == HELLOFS_JOURNAL_BLOCKS_HSB(hellofs_sb)) {
+        return 0;
+    }
+    if (unlikely(hellofs_sb->journal_start_block_no
+                 != HELLOFS_TOTAL_BLOCKS_HSB(hellofs_sb)
+            || hellofs_sb->journal_block_count < HELLOFS_MIN_JOURNAL_BLOCKS)) {
+        printk(KERN_ERR "hellofs has invalid journal geometry\n");
+        return -EINVAL;
+    }
+
+    journal = kzalloc(sizeof(*journal), GFP_KERNEL);
+    if (!journal) {
+        return -ENOMEM;
+    }
+    journal->sb = sb;
+    journal->start_block_no = hellofs_sb->journal_start_block_no;
+    journal->block_count = hellofs_sb->journal_block_count;
+    init_rwsem(&journal->trans_sem);
+    mutex_init(&journal->list_lock);
+    journal->blocks = RB_ROOT;
+    INIT_LIST_HEAD(&journal->running);
+    INIT_LIST_HEAD(&journal->running_revokes);
+    journal->max_running = max((journal->block_count - 1) / 4, 1ULL);
+    init_waitqueue_head(&journal->wait_commit);
+    init_waitqueue_head(&journal->wait_done);
+    init_waitqueue_head(&journal->wait_home);
+    spin_lock_init(&journal->request_lock);
+    /* Released by hellofs_journal_release() if anything below fails */
+    sbi->journal = journal;
+
+    journal->jsb_bh = sb_bread(sb, journal->start_block_no);
+    if (!journal->jsb_bh) {
+        printk(KERN_ERR "Failed to read the journal superblock\n");
+        return -EIO;
+    }
+    jsb = (struct hellofs_journal_superblock *)journal->jsb_bh->b_data;
+    if (unlikely(HELLOFS_JOURNAL_MAGIC != jsb->magic)) {
+        printk(KERN_ERR "hellofs journal has a bad magic number\n");
+        return -EINVAL;
+    }
+
+    ret = hellofs_journal_replay(journal);
+    if (0 != ret) {
+        printk(KERN_ERR "Failed to replay the hellofs journal (%d)\n", ret);
+        return ret;
+    }
+
+    journal->thread = kthread_run(hellofs_journal_thread, journal,
+                                  "hellofs-%s", sb->s_id);
+    if (IS_ERR(journal->thread)) {
+        ret = PTR_ERR(journal->thread);
+        journal->thread = NULL;
+        return ret;
+    }
+    return 0;
+}
+
+/* Commit and checkpoint everything, an unmounted hellofs has an empty
+   log. If the checkpoint fails, the log is replayed at the next mount.
+   An aborted journal is emptied once more, in case aborting failed to. */
+void hellofs_journal_release(struct super_block *sb) {
+    struct hellofs_sb_info *sbi = HELLOFS_SB_INFO(sb);
+    struct hellofs_journal *journal = sbi->journal;
+    struct rb_node *node;
+
+    if (!journal) {
+        return;
+    }
+
+    if (journal->thread) {
+        kthread_stop(journal->thread);
+        hellofs_journal_do_commit(journal);
+        hellofs_journal_checkpoint(journal, journal->sequence);
+    }
+
+    while ((node = rb_first(&journal->blocks))) {
+        hellofs_jblock_free(journal,
+                            rb_entry(node, struct hellofs_jblock, node));
+    }
+    brelse(journal->jsb_bh);
+    kfree(journal);
+    sbi->journal = NULL;
+}
@@ -1,7 +1,5 @@
 #include "khellofs.h"
 
-DEFINE_MUTEX(hellofs_sb_lock);
-
 struct file_system_type hellofs_fs_type = {
     .owner = THIS_MODULE,
     .name = "hellofs",
@@ -11,46 +9,93 @@ struct file_system_type hellofs_fs_type = {
 };
 
 const struct super_operations hellofs_sb_ops = {
+    .alloc_inode = hellofs_alloc_inode,
     .destroy_inode = hellofs_destroy_inode,
+    .evict_inode = hellofs_evict_inode,
+    .dirty_inode = hellofs_dirty_inode,
+    .write_inode = hellofs_write_inode,
     .put_super = hellofs_put_super,
+    .sync_fs = hellofs_sync_fs,
+    .statfs = hellofs_statfs,
 };
 
 const struct inode_operations hellofs_inode_ops = {
     .create = hellofs_create,
     .mkdir = hellofs_mkdir,
     .lookup = hellofs_lookup,
+    .unlink = hellofs_unlink,
+    .rmdir = hellofs_rmdir,
+    .setattr = hellofs_setattr,
 };
 
 const struct file_operations hellofs_dir_operations = {
     .owner = THIS_MODULE,
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 11, 0)
     .readdir = hellofs_readdir,
+#else
+    .iterate = hellofs_iterate,
+#endif
+    .fsync = hellofs_fsync,
 };
 
 const struct file_operations hellofs_file_operations = {
-    .read = hellofs_read,
-    .write = hellofs_write,
+    .llseek = generic_file_llseek,
+    .read = do_sync_read,
+    .aio_read = hellofs_file_aio_read,
+    .write = do_sync_write,
+    .aio_write = hellofs_file_aio_write,
+    .mmap = hellofs_file_mmap,
+    .splice_read = generic_file_splice_read,
+    .splice_write = generic_file_splice_write,
+    .fsync = hellofs_fsync,
+};
+
+const struct address_space_operations hellofs_aops = {
+    .readpage = hellofs_readpage,
+    .readpages = hellofs_readpages,
+    .writepage = hellofs_writepage,
+    .writepages = hellofs_writepages,
+    .invalidatepage = hellofs_invalidatepage,
+    .write_begin = hellofs_write_begin,
+    .write_end = hellofs_write_end,
+    .bmap = hellofs_bmap,
+    .direct_IO = hellofs_direct_IO,
 };
 
 struct kmem_cache *hellofs_inode_cache = NULL;
 
+/* Slab constructor, runs once per object rather than per allocation */
+static void hellofs_inode_init_once(void *obj)
+{
+    struct hellofs_inode_info *hi = obj;
+
+    init_rwsem(&hi->extent_sem);
+    spin_lock_init(&hi->reserve_lock);
+    inode_init_once(&hi->vfs_inode);
+}
+
 static int __init hellofs_init(void)
 {
     int ret;
 
     hellofs_inode_cache = kmem_cache_create("hellofs_inode_cache",
-                                         sizeof(struct hellofs_inode),
+                                         sizeof(struct hellofs_inode_info),
                                          0,
                                          (SLAB_RECLAIM_ACCOUNT| SLAB_MEM_SPREAD),
-                                         NULL);
+                                         hellofs_inode_init_once);
     if (!hellofs_inode_cache) {
         return -ENOMEM;
     }
 
+    hellofs_stats_init();
+
     ret = register_filesystem(&hellofs_fs_type);
     if (likely(0 == ret)) {
         printk(KERN_INFO "Sucessfully registered hellofs\n");
     } else {
         printk(KERN_ERR "Failed to register hellofs. Error code: %d\n", ret);
+        hellofs_stats_exit();
+        kmem_cache_destroy(hellofs_inode_cache);
     }
 
     return ret;
@@ -61,7 +106,10 @@ static void __exit hellofs_exit(void)
     int ret;
 
     ret = unregister_filesystem(&hellofs_fs_type);
+    /* Wait for inodes still being freed by RCU */
+    rcu_barrier();
     kmem_cache_destroy(hellofs_inode_cache);
+    hellofs_stats_exit();
 
     if (likely(ret == 0)) {
         printk(KERN_INFO "Sucessfully unregistered hellofs\n");
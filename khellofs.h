@@ -5,15 +5,27 @@
 
 #include <linux/blkdev.h>
 #include <linux/buffer_head.h>
+#include <linux/crc32.h>
+#include <linux/debugfs.h>
 #include <linux/fs.h>
 #include <linux/init.h>
+#include <linux/kthread.h>
+#include <linux/ktime.h>
 #include <linux/namei.h>
 #include <linux/module.h>
+#include <linux/mpage.h>
+#include <linux/pagevec.h>
 #include <linux/parser.h>
+#include <linux/percpu_counter.h>
 #include <linux/random.h>
+#include <linux/rbtree.h>
+#include <linux/seq_file.h>
 #include <linux/slab.h>
+#include <linux/sort.h>
+#include <linux/statfs.h>
 #include <linux/time.h>
 #include <linux/version.h>
+#include <linux/vmalloc.h>
 
 #include "hellofs.h"
 
@@ -24,14 +36,19 @@ extern const struct super_operations hellofs_sb_ops;
 extern const struct inode_operations hellofs_inode_ops;
 extern const struct file_operations hellofs_dir_operations;
 extern const struct file_operations hellofs_file_operations;
+extern const struct address_space_operations hellofs_aops;
 
 struct dentry *hellofs_mount(struct file_system_type *fs_type,
                               int flags, const char *dev_name,
                               void *data);
 void hellofs_kill_superblock(struct super_block *sb);
 
+struct inode *hellofs_alloc_inode(struct super_block *sb);
 void hellofs_destroy_inode(struct inode *inode);
+void hellofs_evict_inode(struct inode *inode);
 void hellofs_put_super(struct super_block *sb);
+int hellofs_sync_fs(struct super_block *sb, int wait);
+int hellofs_statfs(struct dentry *dentry, struct kstatfs *buf);
 
 int hellofs_create(struct inode *dir, struct dentry *dentry,
                     umode_t mode, bool excl);
@@ -40,24 +57,215 @@ struct dentry *hellofs_lookup(struct inode *parent_inode,
                                unsigned int flags);
 int hellofs_mkdir(struct inode *dir, struct dentry *dentry,
                    umode_t mode);
+int hellofs_unlink(struct inode *dir, struct dentry *dentry);
+int hellofs_rmdir(struct inode *dir, struct dentry *dentry);
+int hellofs_setattr(struct dentry *dentry, struct iattr *attr);
+
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 11, 0)
+/* Kernels before 3.11 only have readdir/filldir. Provide the subset of
+   the iterate/dir_emit interface hellofs uses on top of them. */
+struct dir_context {
+    filldir_t actor;
+    void *dirent;
+    loff_t pos;
+};
+
+static inline bool dir_emit(struct dir_context *ctx,
+                            const char *name, int namelen,
+                            u64 ino, unsigned type) {
+    return 0 == ctx->actor(ctx->dirent, name, namelen, ctx->pos, ino, type);
+}
 
 int hellofs_readdir(struct file *filp, void *dirent, filldir_t filldir);
+#endif
+int hellofs_iterate(struct file *filp, struct dir_context *ctx);
 
-ssize_t hellofs_read(struct file * filp, char __user * buf, size_t len,
-                      loff_t * ppos);
-ssize_t hellofs_write(struct file * filp, const char __user * buf, size_t len,
-                       loff_t * ppos);
+int hellofs_get_block(struct inode *inode, sector_t iblock,
+                      struct buffer_head *bh_result, int create);
+int hellofs_get_block_delay(struct inode *inode, sector_t iblock,
+                            struct buffer_head *bh_result, int create);
+int hellofs_readpage(struct file *filp, struct page *page);
+int hellofs_readpages(struct file *filp, struct address_space *mapping,
+                      struct list_head *pages, unsigned nr_pages);
+int hellofs_writepage(struct page *page, struct writeback_control *wbc);
+int hellofs_writepages(struct address_space *mapping,
+                       struct writeback_control *wbc);
+#if LINUX_VERSION_CODE < KERNEL_VERSION(3, 11, 0)
+void hellofs_invalidatepage(struct page *page, unsigned long offset);
+#else
+void hellofs_invalidatepage(struct page *page, unsigned int offset,
+                            unsigned int length);
+#endif
+int hellofs_write_begin(struct file *filp, struct address_space *mapping,
+                        loff_t pos, unsigned len, unsigned flags,
+                        struct page **pagep, void **fsdata);
+int hellofs_write_end(struct file *filp, struct address_space *mapping,
+                      loff_t pos, unsigned len, unsigned copied,
+                      struct page *page, void *fsdata);
+ssize_t hellofs_direct_IO(int rw, struct kiocb *iocb,
+                          const struct iovec *iov, loff_t offset,
+                          unsigned long nr_segs);
+sector_t hellofs_bmap(struct address_space *mapping, sector_t block);
+int hellofs_file_mmap(struct file *file, struct vm_area_struct *vma);
+ssize_t hellofs_file_aio_read(struct kiocb *iocb, const struct iovec *iov,
+                              unsigned long nr_segs, loff_t pos);
+int hellofs_fsync(struct file *file, loff_t start, loff_t end, int datasync);
+ssize_t hellofs_file_aio_write(struct kiocb *iocb, const struct iovec *iov,
+                               unsigned long nr_segs, loff_t pos);
 
 extern struct kmem_cache *hellofs_inode_cache;
 
 /* Helper functions */
 
+#define HELLOFS_NO_GOAL ((uint64_t)-1)
+
+/* In-memory state of a block group */
+struct hellofs_group_info {
+    // Protects the group's bitmaps, cursors and descriptor
+    struct mutex lock;
+
+    // Read on first allocation, then pinned for the life of the mount
+    struct buffer_head *inode_bitmap_bh;
+    struct buffer_head *data_block_bitmap_bh;
+
+    // Where the next inode allocation in this group starts to search
+    uint64_t next_free_inode_offset;
+
+    // Free runs of the data block table slice, built from the data block
+    // bitmap when it is read. Indexed by offset, to allocate at a goal
+    // and merge freed runs, and by length, to find the best fit.
+    struct rb_root free_extents_by_offset;
+    struct rb_root free_extents_by_length;
+};
+
+enum hellofs_stat_op {
+    HELLOFS_STAT_LOOKUP,
+    HELLOFS_STAT_CREATE,
+    HELLOFS_STAT_READ,
+    HELLOFS_STAT_WRITE,
+    HELLOFS_STAT_ALLOC,
+    HELLOFS_STAT_READDIR,
+    HELLOFS_STAT_OPS,
+};
+
+#define HELLOFS_STAT_BUCKETS 32
+
+/* Per-cpu operation statistics of a mount, summed up by the debugfs stats
+   file. extra counts what an operation touched: bytes for read and write,
+   bitmap bits scanned for alloc, leaf blocks read for readdir. */
+struct hellofs_stats {
+    u64 count[HELLOFS_STAT_OPS];
+    u64 total_ns[HELLOFS_STAT_OPS];
+    u64 extra[HELLOFS_STAT_OPS];
+    // Bucket i counts latencies in [2^(i-1), 2^i) ns, the last one
+    // everything longer
+    u64 latency_hist[HELLOFS_STAT_OPS][HELLOFS_STAT_BUCKETS];
+};
+
+/* In-memory state of a mounted hellofs, hooked to sb->s_fs_info */
+struct hellofs_sb_info {
+    // Points into sb_bh, which is pinned for the life of the mount
+    struct hellofs_superblock *hellofs_sb;
+    struct buffer_head *sb_bh;
+
+    // Sums of the free counts of the groups, folded into the used counts
+    // of hellofs_sb at sync and unmount
+    struct percpu_counter free_inodes;
+    struct percpu_counter free_data_blocks;
+    // Data blocks promised to delayed writes, still counted as free
+    struct percpu_counter reserved_data_blocks;
+    // Serializes checking for free blocks nobody has reserved with taking
+    // them
+    spinlock_t reserve_lock;
+
+    // Group descriptor table, pinned
+    struct buffer_head **group_desc_bhs;
+    struct hellofs_group_info *groups;
+
+    struct hellofs_stats __percpu *stats;
+    // Per-mount directory under /sys/kernel/debug/hellofs, may be NULL
+    struct dentry *debugfs_dir;
+
+    // NULL if the filesystem was made without a journal
+    struct hellofs_journal *journal;
+};
+
+static inline struct hellofs_sb_info *HELLOFS_SB_INFO(struct super_block *sb) {
+    return sb->s_fs_info;
+}
+
 // To translate VFS superblock to hellofs superblock
 static inline struct hellofs_superblock *HELLOFS_SB(struct super_block *sb) {
-    return sb->s_fs_info;
+    return HELLOFS_SB_INFO(sb)->hellofs_sb;
+}
+
+/* Account one operation which started at start, returns its latency */
+static inline u64 hellofs_stat_end(struct super_block *sb,
+                                   enum hellofs_stat_op op,
+                                   ktime_t start, u64 extra) {
+    struct hellofs_stats __percpu *stats = HELLOFS_SB_INFO(sb)->stats;
+    u64 latency_ns;
+
+    latency_ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+    this_cpu_inc(stats->count[op]);
+    this_cpu_add(stats->total_ns[op], latency_ns);
+    this_cpu_add(stats->extra[op], extra);
+    this_cpu_inc(stats->latency_hist[op][
+        min(fls64(latency_ns), HELLOFS_STAT_BUCKETS - 1)]);
+    return latency_ns;
+}
+
+static inline struct hellofs_group_info *HELLOFS_GROUP_INFO(
+        struct super_block *sb, uint64_t group_no) {
+    return &HELLOFS_SB_INFO(sb)->groups[group_no];
+}
+static inline struct buffer_head *HELLOFS_GROUP_DESC_BH(
+        struct super_block *sb, uint64_t group_no) {
+    return HELLOFS_SB_INFO(sb)->group_desc_bhs[
+        group_no / HELLOFS_GROUP_DESCS_PER_BLOCK_HSB(HELLOFS_SB(sb))];
 }
+static inline struct hellofs_group_desc *HELLOFS_GROUP_DESC(
+        struct super_block *sb, uint64_t group_no) {
+    return (struct hellofs_group_desc *)HELLOFS_GROUP_DESC_BH(sb, group_no)->b_data
+           + group_no % HELLOFS_GROUP_DESCS_PER_BLOCK_HSB(HELLOFS_SB(sb));
+}
+
+/* In-memory inode, allocated from hellofs_inode_cache by alloc_inode */
+struct hellofs_inode_info {
+    // Copy of the on-disk inode, written back by hellofs_write_inode
+    struct hellofs_inode hellofs_inode;
+    // Protects the extents of hellofs_inode
+    struct rw_semaphore extent_sem;
+    // Protects the reservation counts
+    spinlock_t reserve_lock;
+    // Delayed blocks of the pagecache, which get data blocks at writeback
+    uint64_t reserved_data_blocks;
+    // 1 if an extent block is reserved along with them
+    uint64_t reserved_extent_blocks;
+    // Runs of contiguous delayed blocks, each of which may take an extent
+    // of its own at writeback
+    struct rb_root delayed_runs;
+    uint64_t delayed_run_count;
+    // Journal transaction which last changed the inode or its metadata
+    uint64_t sequence;
+    // Largest gap of each leaf block of a directory, read on the first
+    // insert which misses the hinted leaves. Protected by i_mutex.
+    uint16_t *dir_leaf_gaps;
+    uint64_t dir_leaf_gap_count;
+    uint64_t dir_leaf_gap_capacity;
+    struct inode vfs_inode;
+};
+
+static inline struct hellofs_inode_info *HELLOFS_I(struct inode *inode) {
+    return container_of(inode, struct hellofs_inode_info, vfs_inode);
+}
+
 static inline struct hellofs_inode *HELLOFS_INODE(struct inode *inode) {
-    return inode->i_private;
+    return &HELLOFS_I(inode)->hellofs_inode;
+}
+
+static inline int hellofs_has_inline_data(struct inode *inode) {
+    return HELLOFS_INODE(inode)->flags & HELLOFS_INODE_INLINE_DATA;
 }
 
 static inline uint64_t HELLOFS_INODES_PER_BLOCK(struct super_block *sb) {
@@ -66,45 +274,119 @@ static inline uint64_t HELLOFS_INODES_PER_BLOCK(struct super_block *sb) {
     return HELLOFS_INODES_PER_BLOCK_HSB(hellofs_sb);
 }
 
-// Given the inode_no, calcuate which block in inode table contains the corresponding inode
-static inline uint64_t HELLOFS_INODE_BLOCK_OFFSET(struct super_block *sb, uint64_t inode_no) {
+// Given the inode_no, calcuate which block in its group's inode table
+// slice contains the corresponding inode
+static inline uint64_t HELLOFS_INODE_BLOCK_NO(struct super_block *sb, uint64_t inode_no) {
     struct hellofs_superblock *hellofs_sb;
+    struct hellofs_group_desc *gd;
     hellofs_sb = HELLOFS_SB(sb);
-    return inode_no / HELLOFS_INODES_PER_BLOCK_HSB(hellofs_sb);
+    gd = HELLOFS_GROUP_DESC(sb, HELLOFS_INODE_GROUP_NO_HSB(hellofs_sb, inode_no));
+    return gd->inode_table_block_no
+           + (inode_no % hellofs_sb->inodes_per_group)
+             / HELLOFS_INODES_PER_BLOCK_HSB(hellofs_sb);
 }
 static inline uint64_t HELLOFS_INODE_BYTE_OFFSET(struct super_block *sb, uint64_t inode_no) {
     struct hellofs_superblock *hellofs_sb;
     hellofs_sb = HELLOFS_SB(sb);
-    return (inode_no % HELLOFS_INODES_PER_BLOCK_HSB(hellofs_sb)) * sizeof(struct hellofs_inode);
+    return ((inode_no % hellofs_sb->inodes_per_group)
+            % HELLOFS_INODES_PER_BLOCK_HSB(hellofs_sb))
+           * sizeof(struct hellofs_inode);
 }
 
-static inline uint64_t HELLOFS_DIR_MAX_RECORD(struct super_block *sb) {
-    struct hellofs_superblock *hellofs_sb;
-    hellofs_sb = HELLOFS_SB(sb);
-    return hellofs_sb->blocksize / sizeof(struct hellofs_dir_record);
-}
+// functions to collect statistics
+void hellofs_stats_init(void);
+void hellofs_stats_exit(void);
+int hellofs_stats_mount(struct super_block *sb);
+void hellofs_stats_unmount(struct super_block *sb);
 
-// From which block does data blocks start
-static inline uint64_t HELLOFS_DATA_BLOCK_TABLE_START_BLOCK_NO(struct super_block *sb) {
-    struct hellofs_superblock *hellofs_sb;
-    hellofs_sb = HELLOFS_SB(sb);
-    return HELLOFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(hellofs_sb);
-}
+// functions to journal metadata
+
+#define HELLOFS_HANDLE_MAGIC 0x48444c45
 
-void hellofs_save_sb(struct super_block *sb);
+/* A metadata operation in progress, which has to be committed as a whole.
+   Lives on the stack of the task running the operation. Other
+   filesystems keep their handles in current->journal_info too, the magic
+   tells ours apart. */
+struct hellofs_handle {
+    unsigned long magic;
+    struct hellofs_journal *journal;
+    // hellofs handle this one is nested in, if any
+    struct hellofs_handle *outer;
+    // current->journal_info before the handle started, restored at stop
+    void *saved;
+};
+
+int hellofs_journal_load(struct super_block *sb);
+void hellofs_journal_release(struct super_block *sb);
+void hellofs_journal_start(struct super_block *sb,
+                           struct hellofs_handle *handle);
+void hellofs_journal_stop(struct hellofs_handle *handle);
+void hellofs_journal_dirty(struct super_block *sb, struct buffer_head *bh);
+void hellofs_journal_dirty_inode(struct buffer_head *bh, struct inode *inode);
+void hellofs_journal_forget(struct super_block *sb, uint64_t block_no,
+                            uint64_t count);
+int hellofs_journal_commit(struct super_block *sb, int wait);
+void hellofs_journal_mark_inode(struct inode *inode);
+int hellofs_journal_commit_inode(struct inode *inode);
+int hellofs_journal_fsync_inode(struct inode *inode);
+
+// functions to operate block groups and allocate from them
+int hellofs_load_groups(struct super_block *sb);
+void hellofs_release_groups(struct super_block *sb);
+void hellofs_fold_counters(struct super_block *sb);
+int hellofs_alloc_hellofs_inode(struct super_block *sb, struct inode *dir,
+                                umode_t mode, uint64_t *out_inode_no);
+int hellofs_alloc_data_blocks(struct super_block *sb, uint64_t goal,
+                              uint64_t count, int reserved,
+                              uint64_t *out_data_block_no,
+                              uint64_t *out_count);
+void hellofs_free_hellofs_inode(struct super_block *sb, uint64_t inode_no);
+void hellofs_free_data_blocks(struct super_block *sb, uint64_t block_no,
+                              uint64_t count);
+int hellofs_reserve_data_block(struct inode *inode, uint64_t iblock);
+void hellofs_release_data_blocks(struct inode *inode, uint64_t iblock,
+                                 uint64_t count);
 
 // functions to operate inode
-void hellofs_fill_inode(struct super_block *sb, struct inode *inode,
-                        struct hellofs_inode *hellofs_inode);
-int hellofs_alloc_hellofs_inode(struct super_block *sb, uint64_t *out_inode_no);
-struct hellofs_inode *hellofs_get_hellofs_inode(struct super_block *sb,
-                                                uint64_t inode_no);
-void hellofs_save_hellofs_inode(struct super_block *sb,
-                                struct hellofs_inode *inode);
-int hellofs_add_dir_record(struct super_block *sb, struct inode *dir,
-                           struct dentry *dentry, struct inode *inode);
-int hellofs_alloc_data_block(struct super_block *sb, uint64_t *out_data_block_no);
+void hellofs_fill_inode(struct super_block *sb, struct inode *inode);
+int hellofs_read_hellofs_inode(struct super_block *sb, uint64_t inode_no,
+                               struct hellofs_inode *hellofs_inode);
+struct inode *hellofs_iget(struct super_block *sb, uint64_t inode_no);
+void hellofs_dirty_inode(struct inode *inode, int flags);
+int hellofs_write_inode(struct inode *inode, struct writeback_control *wbc);
 int hellofs_create_inode(struct inode *dir, struct dentry *dentry,
                          umode_t mode);
 
+// functions to operate directories
+struct buffer_head *hellofs_dir_bread(struct inode *dir, uint64_t logical,
+                                      int create, int *err);
+int hellofs_dir_init(struct inode *dir);
+int hellofs_find_dir_record(struct inode *dir, const struct qstr *name,
+                            uint64_t *out_inode_no);
+int hellofs_add_dir_record(struct super_block *sb, struct inode *dir,
+                           struct dentry *dentry, struct inode *inode);
+int hellofs_delete_dir_record(struct inode *dir, const struct qstr *name);
+
+// functions to operate extents
+int hellofs_extent_map(struct inode *inode, uint64_t iblock,
+                       uint64_t *out_block_no, uint64_t *out_count);
+int hellofs_extent_alloc(struct inode *inode, uint64_t iblock,
+                         uint64_t max_blocks, int delayed,
+                         uint64_t *out_block_no, uint64_t *out_count,
+                         int *out_new);
+int hellofs_extent_free_all(struct inode *inode);
+int hellofs_extent_truncate(struct inode *inode, uint64_t iblock);
+
+// functions to operate inline data
+int hellofs_inline_readpage(struct inode *inode, struct page *page);
+int hellofs_inline_writepage(struct inode *inode, struct page *page);
+int hellofs_inline_write_begin(struct address_space *mapping,
+                               loff_t pos, unsigned len, unsigned flags,
+                               struct page **pagep);
+int hellofs_inline_write_end(struct address_space *mapping,
+                             loff_t pos, unsigned len, unsigned copied,
+                             struct page *page);
+int hellofs_inline_convert(struct inode *inode, unsigned flags);
+void hellofs_inline_truncate(struct inode *inode, loff_t size);
+
 #endif /*__KHELLOFS_H__*/
\ No newline at end of file
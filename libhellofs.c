@@ -0,0 +1,1522 @@
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "libhellofs.h"
+
+#define LIBHELLOFS_NO_GOAL ((uint64_t)-1)
+
+/* A run of free blocks in a group's data block table slice, offsets are
+   relative to the slice */
+struct libhellofs_free_extent {
+    uint64_t offset;
+    uint64_t length;
+};
+
+/* The free extents of a group, sorted by offset. The kernel indexes them
+   by offset and by length in two rbtrees, a single threaded library gets
+   the same choices from one array. */
+struct libhellofs_free_extents {
+    uint64_t count;
+    uint64_t capacity;
+    struct libhellofs_free_extent *extents;
+};
+
+int libhellofs_read_block(struct libhellofs *fs, uint64_t block_no,
+                          void *buf) {
+    ssize_t len = fs->sb.blocksize;
+
+    if (len != pread(fs->fd, buf, len, block_no * fs->sb.blocksize)) {
+        return -EIO;
+    }
+    fs->blocks_read += 1;
+    return 0;
+}
+
+int libhellofs_write_block(struct libhellofs *fs, uint64_t block_no,
+                           const void *buf) {
+    ssize_t len = fs->sb.blocksize;
+
+    if (len != pwrite(fs->fd, buf, len, block_no * fs->sb.blocksize)) {
+        return -EIO;
+    }
+    fs->blocks_written += 1;
+    return 0;
+}
+
+static uint8_t *libhellofs_bitmap(struct libhellofs *fs, int for_inode,
+                                  uint64_t group_no) {
+    return (for_inode ? fs->inode_bitmaps : fs->data_block_bitmaps)
+           + group_no * fs->sb.blocksize;
+}
+
+/* Index of the last free extent starting at or before offset, count if
+   none */
+static uint64_t libhellofs_free_extent_before(
+        struct libhellofs_free_extents *fes, uint64_t offset) {
+    uint64_t lo, hi, mid;
+
+    lo = 0;
+    hi = fes->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (fes->extents[mid].offset <= offset) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? lo - 1 : fes->count;
+}
+
+/* Index of the shortest free extent of at least count blocks, the lowest
+   one of equal fits. If there is none, the longest one, which is shorter.
+   count if there are no free extents at all. */
+static uint64_t libhellofs_free_extent_best_fit(
+        struct libhellofs_free_extents *fes, uint64_t count) {
+    struct libhellofs_free_extent *fe;
+    uint64_t fit, longest;
+    uint64_t i;
+
+    fit = fes->count;
+    longest = fes->count;
+    for (i = 0; i < fes->count; i++) {
+        fe = &fes->extents[i];
+        if (fe->length >= count
+                && (fit == fes->count || fe->length < fes->extents[fit].length)) {
+            fit = i;
+        }
+        if (longest == fes->count
+                || fe->length >= fes->extents[longest].length) {
+            longest = i;
+        }
+    }
+    return fit < fes->count ? fit : longest;
+}
+
+/* Give length blocks at offset back, merged with the free extents right
+   before and after them */
+static int libhellofs_free_extent_add(struct libhellofs_free_extents *fes,
+                                      uint64_t offset, uint64_t length) {
+    struct libhellofs_free_extent *extents, *prev, *next;
+    uint64_t i, pos;
+
+    i = libhellofs_free_extent_before(fes, offset);
+    prev = i < fes->count ? &fes->extents[i] : NULL;
+    pos = prev ? i + 1 : 0;
+    next = pos < fes->count ? &fes->extents[pos] : NULL;
+    if (prev && prev->offset + prev->length != offset) {
+        prev = NULL;
+    }
+    if (next && offset + length != next->offset) {
+        next = NULL;
+    }
+
+    if (prev) {
+        prev->length += length;
+        if (next) {
+            prev->length += next->length;
+            memmove(next, next + 1, (fes->count - pos - 1) * sizeof(*next));
+            fes->count -= 1;
+        }
+        return 0;
+    }
+    if (next) {
+        next->offset = offset;
+        next->length += length;
+        return 0;
+    }
+
+    if (fes->count == fes->capacity) {
+        extents = realloc(fes->extents,
+                          (fes->capacity * 2 + 16) * sizeof(*extents));
+        if (!extents) {
+            return -ENOMEM;
+        }
+        fes->extents = extents;
+        fes->capacity = fes->capacity * 2 + 16;
+    }
+    memmove(&fes->extents[pos + 1], &fes->extents[pos],
+            (fes->count - pos) * sizeof(*fes->extents));
+    fes->extents[pos].offset = offset;
+    fes->extents[pos].length = length;
+    fes->count += 1;
+    return 0;
+}
+
+/* Take length blocks at offset out of free extent i, which holds them.
+   Taking from the middle splits it. */
+static int libhellofs_free_extent_take(struct libhellofs_free_extents *fes,
+                                       uint64_t i, uint64_t offset,
+                                       uint64_t length) {
+    struct libhellofs_free_extent *fe = &fes->extents[i];
+    uint64_t end = fe->offset + fe->length;
+
+    if (offset > fe->offset && offset + length < end) {
+        fe->length = offset - fe->offset;
+        return libhellofs_free_extent_add(fes, offset + length,
+                                          end - (offset + length));
+    }
+    if (offset == fe->offset && offset + length == end) {
+        memmove(fe, fe + 1, (fes->count - i - 1) * sizeof(*fe));
+        fes->count -= 1;
+    } else if (offset == fe->offset) {
+        fe->offset += length;
+        fe->length -= length;
+    } else {
+        fe->length = offset - fe->offset;
+    }
+    return 0;
+}
+
+/* Build the free extents of a group from its data block bitmap */
+static int libhellofs_free_extents_load(struct libhellofs *fs,
+                                        uint64_t group_no) {
+    struct libhellofs_free_extents *fes = &fs->free_extents[group_no];
+    uint8_t *bitmap = libhellofs_bitmap(fs, 0, group_no);
+    uint64_t size = fs->sb.data_blocks_per_group;
+    uint64_t start, bit;
+    int ret;
+
+    start = size;
+    for (bit = 0; bit <= size; bit++) {
+        if (bit < size
+                && !(bitmap[bit / BITS_IN_BYTE] & (1 << bit % BITS_IN_BYTE))) {
+            if (start == size) {
+                start = bit;
+            }
+            continue;
+        }
+        if (start < size) {
+            ret = libhellofs_free_extent_add(fes, start, bit - start);
+            if (0 != ret) {
+                return ret;
+            }
+            start = size;
+        }
+    }
+    return 0;
+}
+
+static void libhellofs_free(struct libhellofs *fs) {
+    uint64_t i;
+
+    if (fs->free_extents) {
+        for (i = 0; i < fs->sb.group_count; i++) {
+            free(fs->free_extents[i].extents);
+        }
+    }
+    free(fs->group_descs);
+    free(fs->inode_bitmaps);
+    free(fs->data_block_bitmaps);
+    free(fs->next_free_inode_offsets);
+    free(fs->free_extents);
+    free(fs);
+}
+
+/* Blocks are written in place, bypassing the journal, which is only
+   right while the log holds nothing to replay */
+static int libhellofs_check_journal(struct libhellofs *fs) {
+    struct hellofs_superblock *hellofs_sb = &fs->sb;
+    struct hellofs_journal_superblock *jsb;
+    struct hellofs_journal_header *header;
+    char *buf;
+    int ret;
+
+    if (0 == HELLOFS_JOURNAL_BLOCKS_HSB(hellofs_sb)) {
+        return 0;
+    }
+    if (hellofs_sb->journal_start_block_no
+            != HELLOFS_TOTAL_BLOCKS_HSB(hellofs_sb)
+            || hellofs_sb->journal_block_count < HELLOFS_MIN_JOURNAL_BLOCKS) {
+        return -EINVAL;
+    }
+    buf = malloc(2 * hellofs_sb->blocksize);
+    if (!buf) {
+        return -ENOMEM;
+    }
+    jsb = (struct hellofs_journal_superblock *)buf;
+    header = (struct hellofs_journal_header *)(buf + hellofs_sb->blocksize);
+    ret = libhellofs_read_block(fs, hellofs_sb->journal_start_block_no, jsb);
+    if (0 == ret) {
+        ret = libhellofs_read_block(fs, hellofs_sb->journal_start_block_no + 1,
+                                    header);
+    }
+    if (0 == ret && HELLOFS_JOURNAL_MAGIC != jsb->magic) {
+        ret = -EINVAL;
+    }
+    if (0 == ret && HELLOFS_JOURNAL_MAGIC == header->magic
+            && HELLOFS_JOURNAL_DESCRIPTOR == header->type
+            && jsb->sequence == header->sequence) {
+        ret = -EUCLEAN;
+    }
+    free(buf);
+    return ret;
+}
+
+int libhellofs_open(const char *path, struct libhellofs **out_fs) {
+    struct libhellofs *fs;
+    struct hellofs_superblock *hellofs_sb;
+    uint64_t i;
+    int ret;
+
+    fs = calloc(1, sizeof(*fs));
+    if (!fs) {
+        return -ENOMEM;
+    }
+    hellofs_sb = &fs->sb;
+
+    fs->fd = open(path, O_RDWR);
+    if (-1 == fs->fd) {
+        ret = -errno;
+        free(fs);
+        return ret;
+    }
+
+    ret = -EINVAL;
+    if (sizeof(*hellofs_sb) != pread(fs->fd, hellofs_sb, sizeof(*hellofs_sb),
+                                     HELLOFS_SUPERBLOCK_BLOCK_NO)
+            || HELLOFS_MAGIC != hellofs_sb->magic
+            || hellofs_sb->blocksize < sizeof(struct hellofs_inode)
+            || 0 == hellofs_sb->group_count
+            || 0 == hellofs_sb->inodes_per_group
+            || 0 == hellofs_sb->data_blocks_per_group
+            || hellofs_sb->inodes_per_group
+                > HELLOFS_MAX_BLOCKS_PER_GROUP(hellofs_sb->blocksize)
+            || hellofs_sb->data_blocks_per_group
+                > HELLOFS_MAX_BLOCKS_PER_GROUP(hellofs_sb->blocksize)) {
+        goto fail;
+    }
+
+    ret = -ENOMEM;
+    fs->group_desc_table_len
+        = HELLOFS_GROUP_DESC_TABLE_BLOCKS_HSB(hellofs_sb) * hellofs_sb->blocksize;
+    fs->group_descs = malloc(fs->group_desc_table_len);
+    fs->inode_bitmaps = malloc(hellofs_sb->group_count * hellofs_sb->blocksize);
+    fs->data_block_bitmaps
+        = malloc(hellofs_sb->group_count * hellofs_sb->blocksize);
+    fs->next_free_inode_offsets
+        = calloc(hellofs_sb->group_count, sizeof(uint64_t));
+    fs->free_extents = calloc(hellofs_sb->group_count,
+                              sizeof(struct libhellofs_free_extents));
+    if (!fs->group_descs || !fs->inode_bitmaps || !fs->data_block_bitmaps
+            || !fs->next_free_inode_offsets || !fs->free_extents) {
+        goto fail;
+    }
+
+    ret = -EIO;
+    if ((ssize_t)fs->group_desc_table_len
+            != pread(fs->fd, fs->group_descs, fs->group_desc_table_len,
+                     HELLOFS_GROUP_DESC_TABLE_START_BLOCK_NO
+                     * hellofs_sb->blocksize)) {
+        goto fail;
+    }
+    for (i = 0; i < hellofs_sb->group_count; i++) {
+        ret = libhellofs_read_block(fs, fs->group_descs[i].inode_bitmap_block_no,
+                                    libhellofs_bitmap(fs, 1, i));
+        if (0 != ret) {
+            goto fail;
+        }
+        ret = libhellofs_read_block(
+            fs, fs->group_descs[i].data_block_bitmap_block_no,
+            libhellofs_bitmap(fs, 0, i));
+        if (0 != ret) {
+            goto fail;
+        }
+        ret = libhellofs_free_extents_load(fs, i);
+        if (0 != ret) {
+            goto fail;
+        }
+    }
+
+    ret = libhellofs_check_journal(fs);
+    if (0 != ret) {
+        goto fail;
+    }
+
+    *out_fs = fs;
+    return 0;
+
+fail:
+    close(fs->fd);
+    libhellofs_free(fs);
+    return ret;
+}
+
+/* Write back the group descriptors, the bitmaps and the superblock, whose
+   used counts are derived from the free counts of the groups */
+int libhellofs_sync(struct libhellofs *fs) {
+    struct hellofs_superblock *hellofs_sb;
+    uint64_t free_inodes;
+    uint64_t free_data_blocks;
+    uint64_t i;
+    int ret;
+
+    hellofs_sb = &fs->sb;
+
+    free_inodes = 0;
+    free_data_blocks = 0;
+    for (i = 0; i < hellofs_sb->group_count; i++) {
+        free_inodes += fs->group_descs[i].free_inodes_count;
+        free_data_blocks += fs->group_descs[i].free_data_blocks_count;
+
+        ret = libhellofs_write_block(fs,
+                                     fs->group_descs[i].inode_bitmap_block_no,
+                                     libhellofs_bitmap(fs, 1, i));
+        if (0 != ret) {
+            return ret;
+        }
+        ret = libhellofs_write_block(
+            fs, fs->group_descs[i].data_block_bitmap_block_no,
+            libhellofs_bitmap(fs, 0, i));
+        if (0 != ret) {
+            return ret;
+        }
+    }
+    hellofs_sb->inode_count = hellofs_sb->inode_table_size - free_inodes;
+    hellofs_sb->data_block_count
+        = hellofs_sb->data_block_table_size - free_data_blocks;
+
+    if ((ssize_t)fs->group_desc_table_len
+            != pwrite(fs->fd, fs->group_descs, fs->group_desc_table_len,
+                      HELLOFS_GROUP_DESC_TABLE_START_BLOCK_NO
+                      * hellofs_sb->blocksize)) {
+        return -EIO;
+    }
+    if (sizeof(*hellofs_sb) != pwrite(fs->fd, hellofs_sb, sizeof(*hellofs_sb),
+                                      HELLOFS_SUPERBLOCK_BLOCK_NO)) {
+        return -EIO;
+    }
+    return fsync(fs->fd) ? -errno : 0;
+}
+
+int libhellofs_close(struct libhellofs *fs) {
+    int ret;
+
+    ret = libhellofs_sync(fs);
+    close(fs->fd);
+    libhellofs_free(fs);
+    return ret;
+}
+
+/* Inode slots never straddle a block, so they are accessed directly */
+static off_t libhellofs_inode_pos(struct libhellofs *fs, uint64_t inode_no) {
+    struct hellofs_superblock *hellofs_sb;
+    struct hellofs_group_desc *gd;
+    uint64_t offset;
+
+    hellofs_sb = &fs->sb;
+    gd = &fs->group_descs[HELLOFS_INODE_GROUP_NO_HSB(hellofs_sb, inode_no)];
+    offset = inode_no % hellofs_sb->inodes_per_group;
+    return (gd->inode_table_block_no
+            + offset / HELLOFS_INODES_PER_BLOCK_HSB(hellofs_sb))
+           * hellofs_sb->blocksize
+           + offset % HELLOFS_INODES_PER_BLOCK_HSB(hellofs_sb)
+             * sizeof(struct hellofs_inode);
+}
+
+int libhellofs_get_inode(struct libhellofs *fs, uint64_t inode_no,
+                         struct hellofs_inode *out_inode) {
+    if (inode_no >= fs->sb.inode_table_size) {
+        return -EINVAL;
+    }
+    if (sizeof(*out_inode) != pread(fs->fd, out_inode, sizeof(*out_inode),
+                                    libhellofs_inode_pos(fs, inode_no))) {
+        return -EIO;
+    }
+    fs->blocks_read += 1;
+    return 0;
+}
+
+int libhellofs_save_inode(struct libhellofs *fs,
+                          const struct hellofs_inode *inode) {
+    if (inode->inode_no >= fs->sb.inode_table_size) {
+        return -EINVAL;
+    }
+    if (sizeof(*inode) != pwrite(fs->fd, inode, sizeof(*inode),
+                                 libhellofs_inode_pos(fs, inode->inode_no))) {
+        return -EIO;
+    }
+    fs->blocks_written += 1;
+    return 0;
+}
+
+/* Find and set a zero bit, from start and wrapping around. Full bytes are
+   skipped whole. */
+static int libhellofs_alloc_bit(uint8_t *bitmap, uint64_t size,
+                                uint64_t start, uint64_t *out_bit) {
+    uint64_t n, bit;
+
+    if (start >= size) {
+        start = 0;
+    }
+    for (n = 0; n < size; n++) {
+        bit = (start + n) % size;
+        if (0 == bit % BITS_IN_BYTE && 0xff == bitmap[bit / BITS_IN_BYTE]
+                && bit + BITS_IN_BYTE <= size) {
+            n += BITS_IN_BYTE - 1;
+            continue;
+        }
+        if (!(bitmap[bit / BITS_IN_BYTE] & (1 << bit % BITS_IN_BYTE))) {
+            bitmap[bit / BITS_IN_BYTE] |= 1 << bit % BITS_IN_BYTE;
+            *out_bit = bit;
+            return 0;
+        }
+    }
+    return -ENOSPC;
+}
+
+static int libhellofs_group_alloc_inode(struct libhellofs *fs,
+                                        uint64_t group_no,
+                                        uint64_t *out_offset) {
+    struct hellofs_group_desc *gd;
+    uint64_t *cursor;
+    int ret;
+
+    gd = &fs->group_descs[group_no];
+    cursor = &fs->next_free_inode_offsets[group_no];
+    if (0 == gd->free_inodes_count) {
+        return -ENOSPC;
+    }
+
+    ret = libhellofs_alloc_bit(libhellofs_bitmap(fs, 1, group_no),
+                               fs->sb.inodes_per_group, *cursor, out_offset);
+    if (0 != ret) {
+        return ret;
+    }
+
+    *cursor = *out_offset + 1;
+    gd->free_inodes_count -= 1;
+    return 0;
+}
+
+/* Allocate up to count data blocks at goal (an offset inside the group)
+   if it is free, so that a file keeps growing in place, or else where
+   they fit best. Like the kernel's hellofs_group_alloc_data(). */
+static int libhellofs_group_alloc_data(struct libhellofs *fs,
+                                       uint64_t group_no, uint64_t goal,
+                                       uint64_t count, uint64_t *out_offset,
+                                       uint64_t *out_count) {
+    struct libhellofs_free_extents *fes;
+    struct libhellofs_free_extent *fe;
+    struct hellofs_group_desc *gd;
+    uint8_t *bitmap;
+    uint64_t offset;
+    uint64_t i;
+    int ret;
+
+    fes = &fs->free_extents[group_no];
+    gd = &fs->group_descs[group_no];
+    if (0 == gd->free_data_blocks_count) {
+        return -ENOSPC;
+    }
+
+    i = libhellofs_free_extent_before(fes, goal);
+    if (i < fes->count && goal < fes->extents[i].offset
+                                 + fes->extents[i].length) {
+        offset = goal;
+    } else {
+        i = libhellofs_free_extent_best_fit(fes, count);
+        if (i == fes->count) {
+            return -ENOSPC;
+        }
+        offset = fes->extents[i].offset;
+    }
+    fe = &fes->extents[i];
+    if (count > fe->offset + fe->length - offset) {
+        count = fe->offset + fe->length - offset;
+    }
+
+    ret = libhellofs_free_extent_take(fes, i, offset, count);
+    if (0 != ret) {
+        return ret;
+    }
+    bitmap = libhellofs_bitmap(fs, 0, group_no);
+    for (i = offset; i < offset + count; i++) {
+        bitmap[i / BITS_IN_BYTE] |= 1 << i % BITS_IN_BYTE;
+    }
+    gd->free_data_blocks_count -= count;
+
+    *out_offset = offset;
+    *out_count = count;
+    return 0;
+}
+
+/* Allocate an inode, or up to count data blocks, trying the preferred
+   group with goal, then the others in order */
+static int libhellofs_alloc(struct libhellofs *fs, uint64_t preferred,
+                            int for_inode, uint64_t goal, uint64_t count,
+                            uint64_t *out_group_no, uint64_t *out_offset,
+                            uint64_t *out_count) {
+    uint64_t group_no;
+    uint64_t i;
+    int ret;
+
+    for (i = 0; i < fs->sb.group_count; i++) {
+        group_no = (preferred + i) % fs->sb.group_count;
+        if (for_inode) {
+            ret = libhellofs_group_alloc_inode(fs, group_no, out_offset);
+            *out_count = 1;
+        } else {
+            ret = libhellofs_group_alloc_data(
+                fs, group_no, 0 == i ? goal : LIBHELLOFS_NO_GOAL, count,
+                out_offset, out_count);
+        }
+        if (-ENOSPC != ret) {
+            *out_group_no = group_no;
+            return ret;
+        }
+    }
+    return -ENOSPC;
+}
+
+int libhellofs_alloc_inode(struct libhellofs *fs, uint64_t parent_inode_no,
+                           mode_t mode, uint64_t *out_inode_no) {
+    uint64_t preferred;
+    uint64_t group_no;
+    uint64_t offset;
+    uint64_t count;
+    int ret;
+
+    // Files stay in the parent's group, directories are spread
+    preferred = HELLOFS_INODE_GROUP_NO_HSB(&fs->sb, parent_inode_no);
+    if (S_ISDIR(mode) && fs->sb.group_count > 1) {
+        preferred = (preferred + 1
+                     + fs->next_dir_group++ % (fs->sb.group_count - 1))
+                    % fs->sb.group_count;
+    }
+
+    ret = libhellofs_alloc(fs, preferred, 1, LIBHELLOFS_NO_GOAL, 1,
+                           &group_no, &offset, &count);
+    if (0 != ret) {
+        return ret;
+    }
+    *out_inode_no = group_no * fs->sb.inodes_per_group + offset;
+    return 0;
+}
+
+int libhellofs_alloc_data_blocks(struct libhellofs *fs, uint64_t goal,
+                                 uint64_t count, uint64_t *out_data_block_no,
+                                 uint64_t *out_count) {
+    struct hellofs_superblock *hellofs_sb;
+    struct hellofs_group_desc *gd;
+    uint64_t preferred;
+    uint64_t goal_offset;
+    uint64_t group_no;
+    uint64_t offset;
+    int ret;
+
+    hellofs_sb = &fs->sb;
+
+    preferred = 0;
+    goal_offset = LIBHELLOFS_NO_GOAL;
+    if (goal >= HELLOFS_GROUP_START_BLOCK_NO_HSB(hellofs_sb, 0)
+            && goal < HELLOFS_TOTAL_BLOCKS_HSB(hellofs_sb)) {
+        preferred = HELLOFS_BLOCK_GROUP_NO_HSB(hellofs_sb, goal);
+        gd = &fs->group_descs[preferred];
+        if (goal >= gd->data_block_table_block_no) {
+            goal_offset = goal - gd->data_block_table_block_no;
+        }
+    }
+
+    ret = libhellofs_alloc(fs, preferred, 0, goal_offset, count, &group_no,
+                           &offset, out_count);
+    if (0 != ret) {
+        return ret;
+    }
+    *out_data_block_no = fs->group_descs[group_no].data_block_table_block_no
+                         + offset;
+    return 0;
+}
+
+/* The extents of an inode, the ones of the inode followed by the ones of
+   the extent block, copied out so that they can be searched as one array */
+struct libhellofs_extents {
+    uint64_t count;
+    struct hellofs_extent *extents;
+};
+
+static int libhellofs_load_extents(struct libhellofs *fs,
+                                   struct hellofs_inode *inode,
+                                   struct libhellofs_extents *out) {
+    uint64_t max;
+    int ret;
+
+    max = HELLOFS_INODE_EXTENTS + HELLOFS_EXTENTS_PER_BLOCK_HSB(&fs->sb);
+    out->count = inode->extent_count;
+    out->extents = calloc(max + 1, sizeof(struct hellofs_extent));
+    if (!out->extents) {
+        return -ENOMEM;
+    }
+    memcpy(out->extents, inode->extents, sizeof(inode->extents));
+    if (inode->extent_block_no) {
+        ret = libhellofs_read_block(fs, inode->extent_block_no,
+                                    out->extents + HELLOFS_INODE_EXTENTS);
+        if (0 != ret) {
+            free(out->extents);
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static int libhellofs_store_extents(struct libhellofs *fs,
+                                    struct hellofs_inode *inode,
+                                    struct libhellofs_extents *extents,
+                                    uint64_t goal) {
+    uint64_t count;
+    int ret;
+
+    memcpy(inode->extents, extents->extents, sizeof(inode->extents));
+    inode->extent_count = extents->count;
+    if (extents->count <= HELLOFS_INODE_EXTENTS && !inode->extent_block_no) {
+        return 0;
+    }
+
+    if (!inode->extent_block_no) {
+        ret = libhellofs_alloc_data_blocks(fs, goal, 1,
+                                           &inode->extent_block_no, &count);
+        if (0 != ret) {
+            return ret;
+        }
+    }
+    return libhellofs_write_block(fs, inode->extent_block_no,
+                                  extents->extents + HELLOFS_INODE_EXTENTS);
+}
+
+/* The last extent whose logical_block_no <= iblock, count if none */
+static uint64_t libhellofs_extent_search(struct libhellofs_extents *extents,
+                                         uint64_t iblock) {
+    uint64_t lo, hi, mid;
+
+    lo = 0;
+    hi = extents->count;
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+        if (extents->extents[mid].logical_block_no <= iblock) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo > 0 ? lo - 1 : extents->count;
+}
+
+/* Record that length blocks of the hole at iblock are backed by data
+   blocks from block_no, merging into the neighbouring extents when
+   contiguous, like the kernel does */
+static int libhellofs_extent_insert(struct libhellofs_extents *extents,
+                                    uint64_t max, uint64_t iblock,
+                                    uint64_t block_no, uint64_t length) {
+    struct hellofs_extent *prev, *next;
+    uint64_t i, pos;
+
+    i = libhellofs_extent_search(extents, iblock);
+    prev = i < extents->count ? &extents->extents[i] : NULL;
+    pos = prev ? i + 1 : 0;
+    next = pos < extents->count ? &extents->extents[pos] : NULL;
+
+    if (prev && prev->logical_block_no + prev->length == iblock
+            && prev->physical_block_no + prev->length == block_no) {
+        prev->length += length;
+        if (next && next->logical_block_no == iblock + length
+                && next->physical_block_no == block_no + length) {
+            prev->length += next->length;
+            memmove(next, next + 1,
+                    (extents->count - pos - 1) * sizeof(*next));
+            extents->count -= 1;
+        }
+        return 0;
+    }
+
+    if (next && next->logical_block_no == iblock + length
+            && next->physical_block_no == block_no + length) {
+        next->logical_block_no -= length;
+        next->physical_block_no -= length;
+        next->length += length;
+        return 0;
+    }
+
+    if (extents->count >= max) {
+        return -EFBIG;
+    }
+    memmove(&extents->extents[pos + 1], &extents->extents[pos],
+            (extents->count - pos) * sizeof(struct hellofs_extent));
+    extents->extents[pos].logical_block_no = iblock;
+    extents->extents[pos].physical_block_no = block_no;
+    extents->extents[pos].length = length;
+    extents->count += 1;
+    return 0;
+}
+
+/* Give back count data blocks from block_no, which one allocation took
+   from a single group */
+static void libhellofs_free_data_blocks(struct libhellofs *fs,
+                                        uint64_t block_no, uint64_t count) {
+    struct hellofs_group_desc *gd;
+    uint8_t *bitmap;
+    uint64_t group_no;
+    uint64_t offset;
+    uint64_t i;
+
+    group_no = HELLOFS_BLOCK_GROUP_NO_HSB(&fs->sb, block_no);
+    gd = &fs->group_descs[group_no];
+    offset = block_no - gd->data_block_table_block_no;
+    bitmap = libhellofs_bitmap(fs, 0, group_no);
+    for (i = offset; i < offset + count; i++) {
+        bitmap[i / BITS_IN_BYTE] &= ~(1 << i % BITS_IN_BYTE);
+    }
+    gd->free_data_blocks_count += count;
+    // Without memory for the free extent they are only reused after reopen
+    libhellofs_free_extent_add(&fs->free_extents[group_no], offset, count);
+}
+
+/* Map up to max_blocks file blocks from iblock, returning in out_count
+   how many are contiguous on disk. With create set, a hole is filled
+   with one run of as many of them as the hole and the allocator allow,
+   like the kernel's writeback. Returns 0 if iblock is mapped, 1 if the
+   run was allocated and -ENOENT for a hole. The caller saves the inode
+   after blocks were allocated. */
+static int libhellofs_bmap_blocks(struct libhellofs *fs,
+                                  struct hellofs_inode *inode,
+                                  uint64_t iblock, uint64_t max_blocks,
+                                  int create, uint64_t *out_block_no,
+                                  uint64_t *out_count) {
+    struct libhellofs_extents extents;
+    struct hellofs_extent *extent;
+    uint64_t i, goal;
+    int ret;
+
+    // The inode's own extents are searched first, without any I/O
+    if (0 == inode->extent_block_no) {
+        extents.count = inode->extent_count;
+        extents.extents = inode->extents;
+        i = libhellofs_extent_search(&extents, iblock);
+        if (i < extents.count) {
+            extent = &extents.extents[i];
+            if (iblock < extent->logical_block_no + extent->length) {
+                *out_block_no = extent->physical_block_no
+                                + (iblock - extent->logical_block_no);
+                *out_count = extent->length
+                             - (iblock - extent->logical_block_no);
+                return 0;
+            }
+        }
+        if (!create) {
+            return -ENOENT;
+        }
+    }
+
+    ret = libhellofs_load_extents(fs, inode, &extents);
+    if (0 != ret) {
+        return ret;
+    }
+
+    i = libhellofs_extent_search(&extents, iblock);
+    if (i < extents.count) {
+        extent = &extents.extents[i];
+        if (iblock < extent->logical_block_no + extent->length) {
+            *out_block_no = extent->physical_block_no
+                            + (iblock - extent->logical_block_no);
+            *out_count = extent->length - (iblock - extent->logical_block_no);
+            ret = 0;
+            goto out;
+        }
+    }
+    // The first index block of a directory lies far past its leaves
+    if (i < extents.count
+            && (iblock < HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO
+                || extent->logical_block_no
+                   >= HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO)) {
+        goal = extent->physical_block_no + (iblock - extent->logical_block_no);
+    } else {
+        goal = fs->group_descs[HELLOFS_INODE_GROUP_NO_HSB(&fs->sb,
+                                                          inode->inode_no)]
+               .data_block_table_block_no;
+    }
+    if (!create) {
+        ret = -ENOENT;
+        goto out;
+    }
+
+    // The run ends where the hole does
+    i = i < extents.count ? i + 1 : 0;
+    if (i < extents.count
+            && extents.extents[i].logical_block_no - iblock < max_blocks) {
+        max_blocks = extents.extents[i].logical_block_no - iblock;
+    }
+    ret = libhellofs_alloc_data_blocks(fs, goal, max_blocks ? max_blocks : 1,
+                                       out_block_no, out_count);
+    if (0 != ret) {
+        goto out;
+    }
+    ret = libhellofs_extent_insert(&extents,
+                                   HELLOFS_MAX_EXTENTS_HSB(&fs->sb), iblock,
+                                   *out_block_no, *out_count);
+    if (0 != ret) {
+        libhellofs_free_data_blocks(fs, *out_block_no, *out_count);
+        goto out;
+    }
+    // An extent block goes before the run, not where it grows
+    ret = libhellofs_store_extents(fs, inode, &extents, *out_block_no - 1);
+    if (0 == ret) {
+        ret = 1;
+    }
+
+out:
+    free(extents.extents);
+    return ret;
+}
+
+int libhellofs_bmap(struct libhellofs *fs, struct hellofs_inode *inode,
+                    uint64_t iblock, int create, uint64_t *out_block_no) {
+    uint64_t count;
+
+    return libhellofs_bmap_blocks(fs, inode, iblock, 1, create, out_block_no,
+                                  &count);
+}
+
+/* Read a block of a directory, with create set a hole is allocated and
+   zeroed. Returns the data block no in out_block_no. */
+static int libhellofs_dir_bread(struct libhellofs *fs,
+                                struct hellofs_inode *dir, uint64_t logical,
+                                int create, void *buf,
+                                uint64_t *out_block_no) {
+    int ret;
+
+    ret = libhellofs_bmap(fs, dir, logical, create, out_block_no);
+    if (1 == ret) {
+        memset(buf, 0, fs->sb.blocksize);
+        return 0;
+    }
+    if (0 != ret) {
+        return ret;
+    }
+    return libhellofs_read_block(fs, *out_block_no, buf);
+}
+
+static inline uint64_t libhellofs_dir_leaf_count(struct libhellofs *fs,
+                                                 struct hellofs_inode *dir) {
+    return dir->file_size / fs->sb.blocksize;
+}
+
+static inline uint64_t libhellofs_dir_index_size(struct libhellofs *fs,
+                                                 struct hellofs_inode *dir) {
+    return dir->dir_index_block_count
+           * HELLOFS_DIR_INDEX_ENTRIES_PER_BLOCK_HSB(&fs->sb);
+}
+
+static inline int libhellofs_dir_record_ok(struct libhellofs *fs,
+                                           struct hellofs_dir_record *dir_record,
+                                           uint64_t offset) {
+    return dir_record->rec_len >= HELLOFS_DIR_REC_LEN(0)
+           && 0 == dir_record->rec_len % 8
+           && offset + dir_record->rec_len <= fs->sb.blocksize
+           && HELLOFS_DIR_REC_LEN(dir_record->name_len) <= dir_record->rec_len;
+}
+
+static void libhellofs_leaf_init(struct libhellofs *fs, char *leaf) {
+    struct hellofs_dir_record *dir_record;
+
+    dir_record = (struct hellofs_dir_record *)leaf;
+    dir_record->inode_no = 0;
+    dir_record->rec_len = fs->sb.blocksize;
+    dir_record->name_len = 0;
+    dir_record->file_type = HELLOFS_FT_UNKNOWN;
+}
+
+static int libhellofs_leaf_find(struct libhellofs *fs, char *leaf,
+                                const char *name, size_t name_len,
+                                uint64_t *out_inode_no) {
+    struct hellofs_dir_record *dir_record;
+    uint64_t offset;
+
+    for (offset = 0; offset < fs->sb.blocksize; offset += dir_record->rec_len) {
+        dir_record = (struct hellofs_dir_record *)(leaf + offset);
+        if (!libhellofs_dir_record_ok(fs, dir_record, offset)) {
+            return -EIO;
+        }
+        if (dir_record->name_len == name_len
+                && 0 == memcmp(dir_record->filename, name, name_len)) {
+            *out_inode_no = dir_record->inode_no;
+            return 0;
+        }
+    }
+    return -ENOENT;
+}
+
+static int libhellofs_leaf_add(struct libhellofs *fs, char *leaf,
+                               const char *name, size_t name_len,
+                               uint64_t inode_no, uint8_t file_type) {
+    struct hellofs_dir_record *dir_record;
+    struct hellofs_dir_record *new_record;
+    uint64_t offset;
+    uint64_t used;
+    uint64_t needed;
+
+    needed = HELLOFS_DIR_REC_LEN(name_len);
+    for (offset = 0; offset < fs->sb.blocksize; offset += dir_record->rec_len) {
+        dir_record = (struct hellofs_dir_record *)(leaf + offset);
+        if (!libhellofs_dir_record_ok(fs, dir_record, offset)) {
+            return -EIO;
+        }
+
+        used = dir_record->name_len ? HELLOFS_DIR_REC_LEN(dir_record->name_len)
+                                    : 0;
+        if (dir_record->rec_len - used < needed) {
+            continue;
+        }
+
+        if (used) {
+            new_record = (struct hellofs_dir_record *)((char *)dir_record + used);
+            new_record->rec_len = dir_record->rec_len - used;
+            dir_record->rec_len = used;
+            dir_record = new_record;
+        }
+        dir_record->inode_no = inode_no;
+        dir_record->name_len = name_len;
+        dir_record->file_type = file_type;
+        memcpy(dir_record->filename, name, name_len);
+        return 0;
+    }
+    return -ENOSPC;
+}
+
+/* Walks the probe sequence of an index slot, keeping the index block of
+   the current slot in buf and writing it back when it was changed */
+struct libhellofs_index_cursor {
+    struct libhellofs *fs;
+    struct hellofs_inode *dir;
+    uint64_t slot;
+    uint64_t block;
+    uint64_t block_no;
+    int loaded;
+    int dirty;
+    char *buf;
+};
+
+static int libhellofs_index_flush(struct libhellofs_index_cursor *cursor) {
+    int ret = 0;
+
+    if (cursor->dirty) {
+        ret = libhellofs_write_block(cursor->fs, cursor->block_no, cursor->buf);
+        cursor->dirty = 0;
+    }
+    return ret;
+}
+
+static struct hellofs_dir_index_entry *libhellofs_index_entry(
+        struct libhellofs_index_cursor *cursor, int *err) {
+    uint64_t per_block;
+    uint64_t block;
+
+    per_block = HELLOFS_DIR_INDEX_ENTRIES_PER_BLOCK_HSB(&cursor->fs->sb);
+    block = cursor->slot / per_block;
+
+    if (!cursor->loaded || cursor->block != block) {
+        *err = libhellofs_index_flush(cursor);
+        if (0 != *err) {
+            return NULL;
+        }
+        cursor->loaded = 0;
+        *err = libhellofs_dir_bread(cursor->fs, cursor->dir,
+                                    HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO + block,
+                                    0, cursor->buf, &cursor->block_no);
+        if (0 != *err) {
+            return NULL;
+        }
+        cursor->block = block;
+        cursor->loaded = 1;
+    }
+
+    return (struct hellofs_dir_index_entry *)cursor->buf
+           + cursor->slot % per_block;
+}
+
+static int libhellofs_index_insert(struct libhellofs *fs,
+                                   struct hellofs_inode *dir, uint32_t hash,
+                                   uint64_t leaf_block_no) {
+    char buf[fs->sb.blocksize];
+    struct libhellofs_index_cursor cursor = {
+        .fs = fs, .dir = dir, .buf = buf,
+    };
+    struct hellofs_dir_index_entry *entry;
+    uint64_t size;
+    uint64_t n;
+    int err = -ENOSPC;
+
+    size = libhellofs_dir_index_size(fs, dir);
+    cursor.slot = hash % size;
+    for (n = 0; n < size; n++) {
+        entry = libhellofs_index_entry(&cursor, &err);
+        if (!entry) {
+            break;
+        }
+        if (HELLOFS_DIR_INDEX_EMPTY == entry->leaf_block_no) {
+            entry->hash = hash;
+            entry->leaf_block_no = leaf_block_no;
+            cursor.dirty = 1;
+            err = 0;
+            break;
+        }
+        cursor.slot = (cursor.slot + 1) % size;
+        err = -ENOSPC;
+    }
+
+    if (0 == err) {
+        err = libhellofs_index_flush(&cursor);
+    }
+    return err;
+}
+
+static int libhellofs_index_build(struct libhellofs *fs,
+                                  struct hellofs_inode *dir,
+                                  uint64_t block_count) {
+    char buf[fs->sb.blocksize];
+    struct hellofs_dir_record *dir_record;
+    uint64_t leaf, i, offset, block_no;
+    int err;
+
+    // Allocate every block before the old index is wiped
+    for (i = 0; i < block_count; i++) {
+        err = libhellofs_dir_bread(fs, dir,
+                                   HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO + i,
+                                   1, buf, &block_no);
+        if (0 != err) {
+            return err;
+        }
+    }
+    for (i = 0; i < block_count; i++) {
+        err = libhellofs_dir_bread(fs, dir,
+                                   HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO + i,
+                                   0, buf, &block_no);
+        if (0 != err) {
+            return err;
+        }
+        memset(buf, 0xff, fs->sb.blocksize);
+        err = libhellofs_write_block(fs, block_no, buf);
+        if (0 != err) {
+            return err;
+        }
+    }
+    dir->dir_index_block_count = block_count;
+
+    for (leaf = 0; leaf < libhellofs_dir_leaf_count(fs, dir); leaf++) {
+        err = libhellofs_dir_bread(fs, dir, leaf, 0, buf, &block_no);
+        if (0 != err) {
+            return err;
+        }
+        for (offset = 0; offset < fs->sb.blocksize;
+                offset += dir_record->rec_len) {
+            dir_record = (struct hellofs_dir_record *)(buf + offset);
+            if (!libhellofs_dir_record_ok(fs, dir_record, offset)) {
+                return -EIO;
+            }
+            if (0 == dir_record->name_len) {
+                continue;
+            }
+            err = libhellofs_index_insert(
+                fs, dir,
+                hellofs_name_hash(dir_record->filename, dir_record->name_len),
+                leaf);
+            if (0 != err) {
+                return err;
+            }
+        }
+    }
+
+    return 0;
+}
+
+int libhellofs_lookup(struct libhellofs *fs, struct hellofs_inode *dir,
+                      const char *name, size_t name_len,
+                      uint64_t *out_inode_no) {
+    char buf[fs->sb.blocksize];
+    char index_buf[fs->sb.blocksize];
+    struct libhellofs_index_cursor cursor = {
+        .fs = fs, .dir = dir, .buf = index_buf,
+    };
+    struct hellofs_dir_index_entry *entry;
+    uint64_t size, n, leaf, block_no;
+    uint32_t hash;
+    int err;
+
+    if (!S_ISDIR(dir->mode)) {
+        return -ENOTDIR;
+    }
+
+    if (0 == dir->dir_index_block_count) {
+        for (leaf = 0; leaf < libhellofs_dir_leaf_count(fs, dir); leaf++) {
+            err = libhellofs_dir_bread(fs, dir, leaf, 0, buf, &block_no);
+            if (0 != err) {
+                return err;
+            }
+            err = libhellofs_leaf_find(fs, buf, name, name_len, out_inode_no);
+            if (-ENOENT != err) {
+                return err;
+            }
+        }
+        return -ENOENT;
+    }
+
+    hash = hellofs_name_hash(name, name_len);
+    size = libhellofs_dir_index_size(fs, dir);
+    cursor.slot = hash % size;
+    err = -ENOENT;
+    for (n = 0; n < size; n++) {
+        entry = libhellofs_index_entry(&cursor, &err);
+        if (!entry) {
+            break;
+        }
+        if (HELLOFS_DIR_INDEX_EMPTY == entry->leaf_block_no) {
+            err = -ENOENT;
+            break;
+        }
+        if (entry->hash == hash) {
+            leaf = entry->leaf_block_no;
+            err = libhellofs_dir_bread(fs, dir, leaf, 0, buf, &block_no);
+            if (0 != err) {
+                break;
+            }
+            err = libhellofs_leaf_find(fs, buf, name, name_len, out_inode_no);
+            if (-ENOENT != err) {
+                break;
+            }
+        }
+        cursor.slot = (cursor.slot + 1) % size;
+        err = -ENOENT;
+    }
+    return err;
+}
+
+/* Same placement as the kernel: the hinted leaf, the last leaf, else a new
+   leaf. Saves the directory inode. */
+int libhellofs_add_dir_record(struct libhellofs *fs,
+                              struct hellofs_inode *dir,
+                              const char *name, size_t name_len,
+                              uint64_t inode_no, uint8_t file_type) {
+    char buf[fs->sb.blocksize];
+    uint64_t candidates[2];
+    uint64_t leaf, leaf_count, index_size, block_no;
+    int i;
+    int err;
+
+    if (!S_ISDIR(dir->mode)) {
+        return -ENOTDIR;
+    }
+    if (0 == name_len) {
+        return -EINVAL;
+    }
+    if (name_len > HELLOFS_FILENAME_MAXLEN) {
+        return -ENAMETOOLONG;
+    }
+
+    leaf_count = libhellofs_dir_leaf_count(fs, dir);
+    candidates[0] = dir->dir_free_leaf_block_no;
+    candidates[1] = leaf_count - 1;
+
+    err = -ENOSPC;
+    for (i = 0; i < 2 && -ENOSPC == err; i++) {
+        leaf = candidates[i];
+        if (leaf >= leaf_count || (1 == i && leaf == candidates[0])) {
+            continue;
+        }
+        err = libhellofs_dir_bread(fs, dir, leaf, 0, buf, &block_no);
+        if (0 != err) {
+            return err;
+        }
+        err = libhellofs_leaf_add(fs, buf, name, name_len, inode_no,
+                                  file_type);
+        if (0 == err) {
+            err = libhellofs_write_block(fs, block_no, buf);
+        }
+    }
+    if (-ENOSPC == err) {
+        leaf = leaf_count;
+        err = libhellofs_dir_bread(fs, dir, leaf, 1, buf, &block_no);
+        if (0 != err) {
+            return err;
+        }
+        libhellofs_leaf_init(fs, buf);
+        err = libhellofs_leaf_add(fs, buf, name, name_len, inode_no,
+                                  file_type);
+        if (0 == err) {
+            err = libhellofs_write_block(fs, block_no, buf);
+        }
+        dir->file_size = (leaf + 1) * fs->sb.blocksize;
+    }
+    if (0 != err) {
+        return err;
+    }
+    dir->dir_free_leaf_block_no = leaf;
+    dir->dir_children_count += 1;
+
+    index_size = libhellofs_dir_index_size(fs, dir);
+    if (0 == index_size) {
+        if (libhellofs_dir_leaf_count(fs, dir) > 1) {
+            err = libhellofs_index_build(fs, dir, 1);
+        }
+    } else if (dir->dir_children_count * 4 > index_size * 3) {
+        err = libhellofs_index_build(fs, dir, dir->dir_index_block_count * 2);
+    } else {
+        err = libhellofs_index_insert(fs, dir,
+                                      hellofs_name_hash(name, name_len), leaf);
+    }
+    if (0 != err) {
+        return err;
+    }
+
+    return libhellofs_save_inode(fs, dir);
+}
+
+int libhellofs_readdir(struct libhellofs *fs, struct hellofs_inode *dir,
+                       libhellofs_filldir_t filldir, void *arg) {
+    char buf[fs->sb.blocksize];
+    struct hellofs_dir_record *dir_record;
+    uint64_t leaf, offset, block_no;
+    int err;
+
+    if (!S_ISDIR(dir->mode)) {
+        return -ENOTDIR;
+    }
+
+    for (leaf = 0; leaf < libhellofs_dir_leaf_count(fs, dir); leaf++) {
+        err = libhellofs_dir_bread(fs, dir, leaf, 0, buf, &block_no);
+        if (0 != err) {
+            return err;
+        }
+        for (offset = 0; offset < fs->sb.blocksize;
+                offset += dir_record->rec_len) {
+            dir_record = (struct hellofs_dir_record *)(buf + offset);
+            if (!libhellofs_dir_record_ok(fs, dir_record, offset)) {
+                return -EIO;
+            }
+            if (0 == dir_record->name_len) {
+                continue;
+            }
+            err = filldir(arg, dir_record->filename, dir_record->name_len,
+                          dir_record->inode_no, dir_record->file_type);
+            if (0 != err) {
+                return err;
+            }
+        }
+    }
+    return 0;
+}
+
+/* Regular files start with inline data, directories with an empty leaf */
+int libhellofs_create(struct libhellofs *fs, struct hellofs_inode *dir,
+                      const char *name, mode_t mode,
+                      struct hellofs_inode *out_inode) {
+    char buf[fs->sb.blocksize];
+    uint64_t inode_no;
+    uint64_t block_no;
+    int ret;
+
+    if (!S_ISDIR(mode) && !S_ISREG(mode)) {
+        return -EINVAL;
+    }
+    if (0 == strlen(name)) {
+        return -EINVAL;
+    }
+    if (strlen(name) > HELLOFS_FILENAME_MAXLEN) {
+        return -ENAMETOOLONG;
+    }
+    ret = libhellofs_lookup(fs, dir, name, strlen(name), &inode_no);
+    if (-ENOENT != ret) {
+        return 0 == ret ? -EEXIST : ret;
+    }
+
+    ret = libhellofs_alloc_inode(fs, dir->inode_no, mode, &inode_no);
+    if (0 != ret) {
+        return ret;
+    }
+
+    memset(out_inode, 0, sizeof(*out_inode));
+    out_inode->mode = mode;
+    out_inode->inode_no = inode_no;
+    if (S_ISDIR(mode)) {
+        ret = libhellofs_dir_bread(fs, out_inode, 0, 1, buf, &block_no);
+        if (0 != ret) {
+            return ret;
+        }
+        libhellofs_leaf_init(fs, buf);
+        ret = libhellofs_write_block(fs, block_no, buf);
+        if (0 != ret) {
+            return ret;
+        }
+        out_inode->file_size = fs->sb.blocksize;
+    } else {
+        out_inode->flags |= HELLOFS_INODE_INLINE_DATA;
+    }
+
+    ret = libhellofs_save_inode(fs, out_inode);
+    if (0 != ret) {
+        return ret;
+    }
+    return libhellofs_add_dir_record(fs, dir, name, strlen(name), inode_no,
+                                     HELLOFS_FILE_TYPE(mode));
+}
+
+ssize_t libhellofs_pread(struct libhellofs *fs, struct hellofs_inode *inode,
+                         void *buf, size_t len, uint64_t pos) {
+    char block[fs->sb.blocksize];
+    uint64_t block_no, offset;
+    size_t done, n;
+    int ret;
+
+    if (S_ISDIR(inode->mode)) {
+        return -EISDIR;
+    }
+    if (pos >= inode->file_size) {
+        return 0;
+    }
+    if (len > inode->file_size - pos) {
+        len = inode->file_size - pos;
+    }
+
+    if (inode->flags & HELLOFS_INODE_INLINE_DATA) {
+        memcpy(buf, inode->inline_data + pos, len);
+        return len;
+    }
+
+    for (done = 0; done < len; done += n) {
+        offset = (pos + done) % fs->sb.blocksize;
+        n = fs->sb.blocksize - offset;
+        if (n > len - done) {
+            n = len - done;
+        }
+
+        ret = libhellofs_bmap(fs, inode, (pos + done) / fs->sb.blocksize, 0,
+                              &block_no);
+        if (-ENOENT == ret) {
+            memset((char *)buf + done, 0, n);
+            continue;
+        }
+        if (0 != ret) {
+            return done ? (ssize_t)done : ret;
+        }
+        ret = libhellofs_read_block(fs, block_no, block);
+        if (0 != ret) {
+            return done ? (ssize_t)done : ret;
+        }
+        memcpy((char *)buf + done, block + offset, n);
+    }
+    return done;
+}
+
+/* A hole is filled with one run for the rest of the write, the way the
+   kernel allocates a range of delayed blocks at writeback */
+static ssize_t libhellofs_write_blocks(struct libhellofs *fs,
+                                       struct hellofs_inode *inode,
+                                       const void *buf, size_t len,
+                                       uint64_t pos) {
+    char block[fs->sb.blocksize];
+    uint64_t block_no, offset, iblock, last, count;
+    // The run allocated last, whose blocks start zeroed
+    uint64_t run_iblock, run_block_no, run_count;
+    size_t done, n;
+    int ret;
+
+    last = (pos + len - 1) / fs->sb.blocksize;
+    run_iblock = 0;
+    run_block_no = 0;
+    run_count = 0;
+    for (done = 0; done < len; done += n) {
+        offset = (pos + done) % fs->sb.blocksize;
+        n = fs->sb.blocksize - offset;
+        if (n > len - done) {
+            n = len - done;
+        }
+
+        iblock = (pos + done) / fs->sb.blocksize;
+        if (iblock >= run_iblock && iblock < run_iblock + run_count) {
+            block_no = run_block_no + (iblock - run_iblock);
+            ret = 1;
+        } else {
+            ret = libhellofs_bmap_blocks(fs, inode, iblock, last - iblock + 1,
+                                         1, &block_no, &count);
+            if (ret < 0) {
+                break;
+            }
+            if (1 == ret) {
+                run_iblock = iblock;
+                run_block_no = block_no;
+                run_count = count;
+            }
+        }
+        // Whole blocks are simply overwritten, new ones start zeroed
+        if (1 == ret) {
+            memset(block, 0, fs->sb.blocksize);
+        } else if (n < fs->sb.blocksize) {
+            ret = libhellofs_read_block(fs, block_no, block);
+            if (0 != ret) {
+                break;
+            }
+        }
+        memcpy(block + offset, (const char *)buf + done, n);
+        ret = libhellofs_write_block(fs, block_no, block);
+        if (0 != ret) {
+            break;
+        }
+    }
+
+    if (pos + done > inode->file_size) {
+        inode->file_size = pos + done;
+    }
+    return done ? (ssize_t)done : ret;
+}
+
+/* Writes which fit stay inline, a larger one moves the inline data into
+   the first block first. Saves the inode. */
+ssize_t libhellofs_pwrite(struct libhellofs *fs, struct hellofs_inode *inode,
+                          const void *buf, size_t len, uint64_t pos) {
+    char inline_data[HELLOFS_INLINE_DATA_SIZE];
+    uint64_t inline_size;
+    ssize_t ret;
+    int err;
+
+    if (S_ISDIR(inode->mode)) {
+        return -EISDIR;
+    }
+    if (0 == len) {
+        return 0;
+    }
+
+    if (inode->flags & HELLOFS_INODE_INLINE_DATA) {
+        if (pos + len <= HELLOFS_INLINE_DATA_SIZE) {
+            memcpy(inode->inline_data + pos, buf, len);
+            if (pos + len > inode->file_size) {
+                inode->file_size = pos + len;
+            }
+            err = libhellofs_save_inode(fs, inode);
+            return 0 == err ? (ssize_t)len : err;
+        }
+
+        inline_size = inode->file_size;
+        memcpy(inline_data, inode->inline_data, inline_size);
+        memset(inode->inline_data, 0, sizeof(inode->inline_data));
+        inode->flags &= ~HELLOFS_INODE_INLINE_DATA;
+        inode->file_size = 0;
+        if (inline_size) {
+            ret = libhellofs_write_blocks(fs, inode, inline_data,
+                                          inline_size, 0);
+            if (ret != (ssize_t)inline_size) {
+                return ret < 0 ? ret : -EIO;
+            }
+        }
+    }
+
+    ret = libhellofs_write_blocks(fs, inode, buf, len, pos);
+    err = libhellofs_save_inode(fs, inode);
+    if (0 != err) {
+        return err;
+    }
+    return ret;
+}
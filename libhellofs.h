@@ -0,0 +1,95 @@
+#ifndef __LIBHELLOFS_H__
+#define __LIBHELLOFS_H__
+
+/* libhellofs implements the hellofs on-disk format in user space, on top
+   of an image file made by mkfs-hellofs. It follows the same algorithms
+   as the kernel module (group allocation from free extents, extents,
+   inline data, directory records and the directory hash index), so that
+   they can be exercised and measured without insmod. It is single
+   threaded. Group descriptors and bitmaps are kept in memory and written
+   back by libhellofs_sync() and libhellofs_close(). Functions return 0
+   or a negative errno.
+   Blocks are written in place, not through the journal, so images whose
+   journal holds transactions to replay are refused with -EUCLEAN. */
+
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "hellofs.h"
+
+struct libhellofs_free_extents;
+
+struct libhellofs {
+    int fd;
+    struct hellofs_superblock sb;
+
+    struct hellofs_group_desc *group_descs;
+    size_t group_desc_table_len;
+    // One block per group
+    uint8_t *inode_bitmaps;
+    uint8_t *data_block_bitmaps;
+    // Where the next inode allocation in a group starts to search
+    uint64_t *next_free_inode_offsets;
+    // Free data block extents of each group, built from the bitmaps
+    struct libhellofs_free_extents *free_extents;
+    // Group of the next directory, directories are spread round robin
+    uint64_t next_dir_group;
+
+    // Block I/O done so far, for benchmarks
+    uint64_t blocks_read;
+    uint64_t blocks_written;
+};
+
+typedef int (*libhellofs_filldir_t)(void *arg, const char *name,
+                                    int name_len, uint64_t inode_no,
+                                    uint8_t file_type);
+
+int libhellofs_open(const char *path, struct libhellofs **out_fs);
+int libhellofs_sync(struct libhellofs *fs);
+int libhellofs_close(struct libhellofs *fs);
+
+int libhellofs_read_block(struct libhellofs *fs, uint64_t block_no,
+                          void *buf);
+int libhellofs_write_block(struct libhellofs *fs, uint64_t block_no,
+                           const void *buf);
+
+int libhellofs_get_inode(struct libhellofs *fs, uint64_t inode_no,
+                         struct hellofs_inode *out_inode);
+int libhellofs_save_inode(struct libhellofs *fs,
+                          const struct hellofs_inode *inode);
+
+int libhellofs_alloc_inode(struct libhellofs *fs, uint64_t parent_inode_no,
+                           mode_t mode, uint64_t *out_inode_no);
+// Allocate a run of 1 to count contiguous data blocks, at goal if free
+int libhellofs_alloc_data_blocks(struct libhellofs *fs, uint64_t goal,
+                                 uint64_t count, uint64_t *out_data_block_no,
+                                 uint64_t *out_count);
+
+// Map file block iblock. Returns 0 if it is mapped, 1 if it was a hole
+// and a new block was allocated (create set), -ENOENT for a hole.
+int libhellofs_bmap(struct libhellofs *fs, struct hellofs_inode *inode,
+                    uint64_t iblock, int create, uint64_t *out_block_no);
+
+int libhellofs_lookup(struct libhellofs *fs, struct hellofs_inode *dir,
+                      const char *name, size_t name_len,
+                      uint64_t *out_inode_no);
+int libhellofs_add_dir_record(struct libhellofs *fs,
+                              struct hellofs_inode *dir,
+                              const char *name, size_t name_len,
+                              uint64_t inode_no, uint8_t file_type);
+int libhellofs_readdir(struct libhellofs *fs, struct hellofs_inode *dir,
+                       libhellofs_filldir_t filldir, void *arg);
+
+// Create a regular file or, with S_IFDIR in mode, a directory in dir
+int libhellofs_create(struct libhellofs *fs, struct hellofs_inode *dir,
+                      const char *name, mode_t mode,
+                      struct hellofs_inode *out_inode);
+
+ssize_t libhellofs_pread(struct libhellofs *fs, struct hellofs_inode *inode,
+                         void *buf, size_t len, uint64_t pos);
+ssize_t libhellofs_pwrite(struct libhellofs *fs, struct hellofs_inode *inode,
+                          const void *buf, size_t len, uint64_t pos);
+
+#endif /*__LIBHELLOFS_H__*/
@@ -2,156 +2,1061 @@
 #include <stdio.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <fcntl.h>
+#include <dirent.h>
+#include <errno.h>
+#include <getopt.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
 #include "hellofs.h"
 
-int main(int argc, char *argv[]) {
+/* Data table writes are gathered into pwritev calls of up to this many
+   buffers or bytes */
+#define MKFS_IOV_MAX 1024
+#define MKFS_FLUSH_BYTES (16 * 1024 * 1024)
+
+/* The kernel only mounts block sizes up to its page size */
+#define MKFS_MAX_BLOCKSIZE 4096
+// File data is read in chunks of this size
+#define MKFS_READ_CHUNK (4 * 1024 * 1024)
+
+// A file or directory to put into the image
+struct mkfs_node {
+    // Where to read the file data from, or data if it is generated
+    char *path;
+    const char *data;
+    char *name;
+    size_t name_len;
+
+    struct hellofs_inode inode;
+
+    struct mkfs_node **children;
+    uint64_t child_count;
+    uint64_t child_capacity;
+
+    // Leaf blocks followed by index blocks, for directories
+    char *dir_blocks;
+    uint64_t leaf_count;
+    // All extents, the ones past HELLOFS_INODE_EXTENTS are copied into
+    // the extent block
+    struct hellofs_extent *extents;
+    uint64_t extent_count;
+    char *extent_block;
+};
+
+// Buffers waiting to be written to consecutive blocks
+struct mkfs_writer {
+    struct iovec iov[MKFS_IOV_MAX];
+    // Whether iov[i] is to be freed once written
+    char owned[MKFS_IOV_MAX];
+    int count;
+    uint64_t start_block_no;
+    uint64_t bytes;
+};
+
+struct mkfs {
+    int fd;
+    struct hellofs_superblock hellofs_sb;
+    struct hellofs_group_desc *group_descs;
+    size_t group_desc_table_len;
+
+    // Inodes and data blocks are handed out in order, the data block
+    // counter runs across the data block tables of all groups
+    uint64_t next_inode_no;
+    uint64_t next_data_block;
+    struct mkfs_node **nodes;
+
+    struct mkfs_writer writer;
+};
+
+static int write_block(int fd, struct hellofs_superblock *hellofs_sb,
+                       uint64_t block_no, const void *buf, size_t len) {
+    return (ssize_t)len == pwrite(fd, buf, len, block_no * hellofs_sb->blocksize)
+           ? 0 : -1;
+}
+
+static struct mkfs_node *mkfs_new_node(const char *name, mode_t mode) {
+    struct mkfs_node *node;
+
+    node = calloc(1, sizeof(*node));
+    if (!node) {
+        return NULL;
+    }
+    node->name = strdup(name);
+    if (!node->name) {
+        free(node);
+        return NULL;
+    }
+    node->name_len = strlen(name);
+    node->inode.mode = mode;
+    return node;
+}
+
+static void mkfs_free_node(struct mkfs_node *node) {
+    uint64_t i;
+
+    for (i = 0; i < node->child_count; i++) {
+        mkfs_free_node(node->children[i]);
+    }
+    free(node->children);
+    free(node->path);
+    free(node->name);
+    free(node->dir_blocks);
+    free(node->extents);
+    free(node->extent_block);
+    free(node);
+}
+
+static int mkfs_add_child(struct mkfs_node *dir, struct mkfs_node *child) {
+    struct mkfs_node **children;
+
+    if (dir->child_count == dir->child_capacity) {
+        children = realloc(dir->children, (dir->child_capacity * 2 + 16)
+                                          * sizeof(*children));
+        if (!children) {
+            return -1;
+        }
+        dir->children = children;
+        dir->child_capacity = dir->child_capacity * 2 + 16;
+    }
+    dir->children[dir->child_count++] = child;
+    return 0;
+}
+
+static int mkfs_compare_nodes(const void *a, const void *b) {
+    return strcmp((*(struct mkfs_node * const *)a)->name,
+                  (*(struct mkfs_node * const *)b)->name);
+}
+
+/* Read the source tree under dir->path. Counts what the image will need,
+   so that the geometry can be sized to fit. */
+static int mkfs_scan(struct mkfs_node *dir, uint64_t blocksize,
+                     uint64_t *inodes, uint64_t *blocks) {
+    struct mkfs_node *child;
+    struct dirent *dirent;
+    struct stat st;
+    uint64_t bytes;
+    char *path;
+    DIR *d;
+    uint64_t i;
+    int ret;
+
+    d = opendir(dir->path);
+    if (!d) {
+        perror(dir->path);
+        return -1;
+    }
+
+    ret = 0;
+    bytes = 0;
+    while ((dirent = readdir(d))) {
+        if (0 == strcmp(dirent->d_name, ".") || 0 == strcmp(dirent->d_name, "..")) {
+            continue;
+        }
+        if (strlen(dirent->d_name) > HELLOFS_FILENAME_MAXLEN) {
+            fprintf(stderr, "%s/%s: name too long\n", dir->path, dirent->d_name);
+            ret = -1;
+            break;
+        }
+        path = malloc(strlen(dir->path) + strlen(dirent->d_name) + 2);
+        if (!path) {
+            ret = -1;
+            break;
+        }
+        sprintf(path, "%s/%s", dir->path, dirent->d_name);
+        if (0 != lstat(path, &st)) {
+            perror(path);
+            free(path);
+            ret = -1;
+            break;
+        }
+        if (!S_ISDIR(st.st_mode) && !S_ISREG(st.st_mode)) {
+            fprintf(stderr, "Skipping %s, only files and directories "
+                            "are supported\n", path);
+            free(path);
+            continue;
+        }
+
+        child = mkfs_new_node(dirent->d_name, st.st_mode);
+        if (!child || 0 != mkfs_add_child(dir, child)) {
+            free(child);
+            free(path);
+            ret = -1;
+            break;
+        }
+        child->path = path;
+        *inodes += 1;
+        bytes += HELLOFS_DIR_REC_LEN(child->name_len);
+
+        if (S_ISREG(st.st_mode)) {
+            child->inode.file_size = st.st_size;
+            if ((uint64_t)st.st_size > HELLOFS_INLINE_DATA_SIZE) {
+                *blocks += (st.st_size + blocksize - 1) / blocksize;
+            }
+        }
+    }
+    closedir(d);
+    if (0 != ret) {
+        return ret;
+    }
+
+    // Leaves, plus up to as many index blocks
+    *blocks += 2 * (bytes / blocksize + 1);
+
+    // Sorted, so that images of the same tree are the same
+    qsort(dir->children, dir->child_count, sizeof(*dir->children),
+          mkfs_compare_nodes);
+
+    for (i = 0; i < dir->child_count; i++) {
+        child = dir->children[i];
+        if (S_ISDIR(child->inode.mode)
+                && 0 != mkfs_scan(child, blocksize, inodes, blocks)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int mkfs_geometry(struct mkfs *mkfs, uint64_t blocksize,
+                         uint64_t inode_count, uint64_t data_block_count,
+                         uint64_t journal_block_count) {
+    struct hellofs_superblock *hellofs_sb = &mkfs->hellofs_sb;
+    uint64_t max_per_group;
+    uint64_t groups_for_inodes;
+    uint64_t group_start;
+    uint64_t i;
+
+    // split the tables evenly into block groups
+    hellofs_sb->version = HELLOFS_JOURNAL_VERSION;
+    hellofs_sb->magic = HELLOFS_MAGIC;
+    hellofs_sb->blocksize = blocksize;
+    max_per_group = HELLOFS_MAX_BLOCKS_PER_GROUP(blocksize);
+    hellofs_sb->group_count
+        = (data_block_count + max_per_group - 1) / max_per_group;
+    groups_for_inodes = (inode_count + max_per_group - 1) / max_per_group;
+    if (hellofs_sb->group_count < groups_for_inodes) {
+        hellofs_sb->group_count = groups_for_inodes;
+    }
+    hellofs_sb->data_blocks_per_group
+        = (data_block_count + hellofs_sb->group_count - 1)
+          / hellofs_sb->group_count;
+    hellofs_sb->inodes_per_group
+        = (inode_count + hellofs_sb->group_count - 1) / hellofs_sb->group_count;
+    hellofs_sb->inode_table_size
+        = hellofs_sb->group_count * hellofs_sb->inodes_per_group;
+    hellofs_sb->data_block_table_size
+        = hellofs_sb->group_count * hellofs_sb->data_blocks_per_group;
+    hellofs_sb->journal_start_block_no = HELLOFS_TOTAL_BLOCKS_HSB(hellofs_sb);
+    hellofs_sb->journal_block_count = journal_block_count;
+
+    // construct group descriptor table
+    mkfs->group_desc_table_len
+        = HELLOFS_GROUP_DESC_TABLE_BLOCKS_HSB(hellofs_sb) * blocksize;
+    mkfs->group_descs = calloc(1, mkfs->group_desc_table_len);
+    mkfs->nodes = calloc(hellofs_sb->inode_table_size, sizeof(*mkfs->nodes));
+    if (!mkfs->group_descs || !mkfs->nodes) {
+        perror("Error allocating group descriptors");
+        return -1;
+    }
+    for (i = 0; i < hellofs_sb->group_count; i++) {
+        group_start = HELLOFS_GROUP_START_BLOCK_NO_HSB(hellofs_sb, i);
+        mkfs->group_descs[i].inode_bitmap_block_no = group_start;
+        mkfs->group_descs[i].data_block_bitmap_block_no = group_start + 1;
+        mkfs->group_descs[i].inode_table_block_no = group_start + 2;
+        mkfs->group_descs[i].data_block_table_block_no
+            = group_start + 2
+              + HELLOFS_INODE_TABLE_BLOCKS_PER_GROUP_HSB(hellofs_sb);
+    }
+    return 0;
+}
+
+/* Append an extent to a node, merging it into the last one if they are
+   contiguous */
+static int mkfs_add_extent(struct mkfs_node *node, uint64_t logical_block_no,
+                           uint64_t physical_block_no, uint64_t length) {
+    struct hellofs_extent *extents;
+    struct hellofs_extent *last;
+
+    if (node->extent_count) {
+        last = &node->extents[node->extent_count - 1];
+        if (last->logical_block_no + last->length == logical_block_no
+                && last->physical_block_no + last->length == physical_block_no) {
+            last->length += length;
+            return 0;
+        }
+    }
+
+    extents = realloc(node->extents,
+                      (node->extent_count + 1) * sizeof(*extents));
+    if (!extents) {
+        return -1;
+    }
+    node->extents = extents;
+    extents[node->extent_count].logical_block_no = logical_block_no;
+    extents[node->extent_count].physical_block_no = physical_block_no;
+    extents[node->extent_count].length = length;
+    node->extent_count += 1;
+    return 0;
+}
+
+/* Take the next count data blocks for file blocks from logical_block_no
+   on. They are contiguous except where they cross into the next group. */
+static int mkfs_alloc_blocks(struct mkfs *mkfs, struct mkfs_node *node,
+                             uint64_t logical_block_no, uint64_t count) {
+    struct hellofs_superblock *hellofs_sb = &mkfs->hellofs_sb;
+    uint64_t group_no, offset, length;
+
+    if (count > hellofs_sb->data_block_table_size - mkfs->next_data_block) {
+        fprintf(stderr, "Out of data blocks, use a larger -d\n");
+        return -1;
+    }
+
+    while (count) {
+        group_no = mkfs->next_data_block / hellofs_sb->data_blocks_per_group;
+        offset = mkfs->next_data_block % hellofs_sb->data_blocks_per_group;
+        length = hellofs_sb->data_blocks_per_group - offset;
+        if (length > count) {
+            length = count;
+        }
+        if (0 != mkfs_add_extent(
+                     node, logical_block_no,
+                     mkfs->group_descs[group_no].data_block_table_block_no
+                     + offset, length)) {
+            return -1;
+        }
+        mkfs->next_data_block += length;
+        logical_block_no += length;
+        count -= length;
+    }
+    return 0;
+}
+
+/* Put the extents into the inode, and into an extent block if they do not
+   fit, like the kernel's extent tree */
+static int mkfs_store_extents(struct mkfs *mkfs, struct mkfs_node *node) {
+    struct hellofs_superblock *hellofs_sb = &mkfs->hellofs_sb;
+    uint64_t in_inode;
+    uint64_t group_no;
+
+    if (node->extent_count > HELLOFS_MAX_EXTENTS_HSB(hellofs_sb)) {
+        errno = EFBIG;
+        fprintf(stderr, "%s: %s, it needs %llu extents, an inode holds %llu\n",
+                node->path, strerror(errno),
+                (unsigned long long)node->extent_count,
+                (unsigned long long)HELLOFS_MAX_EXTENTS_HSB(hellofs_sb));
+        return -1;
+    }
+
+    in_inode = node->extent_count < HELLOFS_INODE_EXTENTS
+               ? node->extent_count : HELLOFS_INODE_EXTENTS;
+    memcpy(node->inode.extents, node->extents,
+           in_inode * sizeof(struct hellofs_extent));
+    node->inode.extent_count = node->extent_count;
+    if (node->extent_count <= HELLOFS_INODE_EXTENTS) {
+        return 0;
+    }
+
+    if (mkfs->next_data_block >= hellofs_sb->data_block_table_size) {
+        fprintf(stderr, "Out of data blocks, use a larger -d\n");
+        return -1;
+    }
+    group_no = mkfs->next_data_block / hellofs_sb->data_blocks_per_group;
+    node->inode.extent_block_no
+        = mkfs->group_descs[group_no].data_block_table_block_no
+          + mkfs->next_data_block % hellofs_sb->data_blocks_per_group;
+    mkfs->next_data_block += 1;
+
+    node->extent_block = calloc(1, hellofs_sb->blocksize);
+    if (!node->extent_block) {
+        return -1;
+    }
+    memcpy(node->extent_block, node->extents + HELLOFS_INODE_EXTENTS,
+           (node->extent_count - HELLOFS_INODE_EXTENTS)
+           * sizeof(struct hellofs_extent));
+    return 0;
+}
+
+static int mkfs_take_inode(struct mkfs *mkfs, struct mkfs_node *node) {
+    if (mkfs->next_inode_no >= mkfs->hellofs_sb.inode_table_size) {
+        fprintf(stderr, "Out of inodes, use a larger -i\n");
+        return -1;
+    }
+    node->inode.inode_no = mkfs->next_inode_no++;
+    mkfs->nodes[node->inode.inode_no] = node;
+    return 0;
+}
+
+/* Pack the records of a directory into leaf blocks, each record up
+   against the previous one and the last of a leaf stretched to its end.
+   A directory of more than one leaf gets its index, sized as the kernel
+   would have grown it. */
+static int mkfs_build_dir(struct mkfs *mkfs, struct mkfs_node *dir) {
+    struct hellofs_superblock *hellofs_sb = &mkfs->hellofs_sb;
+    struct hellofs_dir_record *dir_record;
+    struct hellofs_dir_index_entry *index;
+    struct mkfs_node *child;
+    uint64_t blocksize = hellofs_sb->blocksize;
+    uint64_t index_block_count, index_size;
+    uint64_t leaf, offset, rec_len, slot;
+    uint64_t *child_leaves;
+    uint64_t i;
+
+    leaf = 0;
+    offset = 0;
+    for (i = 0; i < dir->child_count; i++) {
+        rec_len = HELLOFS_DIR_REC_LEN(dir->children[i]->name_len);
+        if (offset + rec_len > blocksize) {
+            leaf += 1;
+            offset = 0;
+        }
+        offset += rec_len;
+    }
+    dir->leaf_count = leaf + 1;
+
+    index_block_count = 0;
+    if (dir->leaf_count > 1) {
+        index_block_count = 1;
+        while (dir->child_count * 4
+               > index_block_count
+                 * HELLOFS_DIR_INDEX_ENTRIES_PER_BLOCK_HSB(hellofs_sb) * 3) {
+            index_block_count *= 2;
+        }
+    }
+
+    dir->dir_blocks = calloc(dir->leaf_count + index_block_count, blocksize);
+    child_leaves = calloc(dir->child_count + 1, sizeof(uint64_t));
+    if (!dir->dir_blocks || !child_leaves) {
+        free(child_leaves);
+        return -1;
+    }
+
+    leaf = 0;
+    offset = 0;
+    dir_record = NULL;
+    for (i = 0; i < dir->child_count; i++) {
+        child = dir->children[i];
+        rec_len = HELLOFS_DIR_REC_LEN(child->name_len);
+        if (offset + rec_len > blocksize) {
+            dir_record->rec_len += blocksize - offset;
+            leaf += 1;
+            offset = 0;
+        }
+        dir_record = (struct hellofs_dir_record *)(dir->dir_blocks
+                                                   + leaf * blocksize + offset);
+        dir_record->inode_no = child->inode.inode_no;
+        dir_record->rec_len = rec_len;
+        dir_record->name_len = child->name_len;
+        dir_record->file_type = HELLOFS_FILE_TYPE(child->inode.mode);
+        memcpy(dir_record->filename, child->name, child->name_len);
+        child_leaves[i] = leaf;
+        offset += rec_len;
+    }
+    if (dir_record) {
+        dir_record->rec_len += blocksize - offset;
+    } else {
+        // An empty leaf is a single unused record
+        dir_record = (struct hellofs_dir_record *)dir->dir_blocks;
+        dir_record->rec_len = blocksize;
+    }
+
+    if (index_block_count) {
+        index = (struct hellofs_dir_index_entry *)(dir->dir_blocks
+                                                   + dir->leaf_count * blocksize);
+        index_size = index_block_count
+                     * HELLOFS_DIR_INDEX_ENTRIES_PER_BLOCK_HSB(hellofs_sb);
+        memset(index, 0xff, index_block_count * blocksize);
+        for (i = 0; i < dir->child_count; i++) {
+            child = dir->children[i];
+            slot = hellofs_name_hash(child->name, child->name_len) % index_size;
+            while (HELLOFS_DIR_INDEX_EMPTY != index[slot].leaf_block_no) {
+                slot = (slot + 1) % index_size;
+            }
+            index[slot].hash = hellofs_name_hash(child->name, child->name_len);
+            index[slot].leaf_block_no = child_leaves[i];
+        }
+    }
+    free(child_leaves);
+
+    dir->inode.file_size = dir->leaf_count * blocksize;
+    dir->inode.dir_children_count = dir->child_count;
+    dir->inode.dir_index_block_count = index_block_count;
+    dir->inode.dir_free_leaf_block_no = dir->leaf_count - 1;
+
+    if (0 != mkfs_alloc_blocks(mkfs, dir, 0, dir->leaf_count)) {
+        return -1;
+    }
+    if (index_block_count
+            && 0 != mkfs_alloc_blocks(mkfs, dir,
+                                      HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO,
+                                      index_block_count)) {
+        return -1;
+    }
+    return mkfs_store_extents(mkfs, dir);
+}
+
+/* Small files are read into the inode, larger ones get their blocks */
+static int mkfs_layout_file(struct mkfs *mkfs, struct mkfs_node *file) {
+    uint64_t blocksize = mkfs->hellofs_sb.blocksize;
+    ssize_t n;
     int fd;
+
+    if (file->inode.file_size > HELLOFS_INLINE_DATA_SIZE) {
+        if (0 != mkfs_alloc_blocks(mkfs, file, 0,
+                                   (file->inode.file_size + blocksize - 1)
+                                   / blocksize)) {
+            return -1;
+        }
+        return mkfs_store_extents(mkfs, file);
+    }
+
+    file->inode.flags |= HELLOFS_INODE_INLINE_DATA;
+    if (file->data) {
+        memcpy(file->inode.inline_data, file->data, file->inode.file_size);
+        return 0;
+    }
+    fd = open(file->path, O_RDONLY);
+    if (-1 == fd) {
+        perror(file->path);
+        return -1;
+    }
+    n = read(fd, file->inode.inline_data, file->inode.file_size);
+    close(fd);
+    if (n < 0) {
+        perror(file->path);
+        return -1;
+    }
+    // The file shrank since it was scanned
+    file->inode.file_size = n;
+    return 0;
+}
+
+/* Number the children of a directory together, so that their inodes
+   share inode table blocks, and place the directory's blocks right before
+   the data of its files. Subdirectories follow, depth first. */
+static int mkfs_layout_dir(struct mkfs *mkfs, struct mkfs_node *dir) {
+    struct mkfs_node *child;
+    uint64_t i;
+
+    for (i = 0; i < dir->child_count; i++) {
+        if (0 != mkfs_take_inode(mkfs, dir->children[i])) {
+            return -1;
+        }
+    }
+    if (0 != mkfs_build_dir(mkfs, dir)) {
+        return -1;
+    }
+    for (i = 0; i < dir->child_count; i++) {
+        child = dir->children[i];
+        if (S_ISREG(child->inode.mode) && 0 != mkfs_layout_file(mkfs, child)) {
+            return -1;
+        }
+    }
+    for (i = 0; i < dir->child_count; i++) {
+        child = dir->children[i];
+        if (S_ISDIR(child->inode.mode) && 0 != mkfs_layout_dir(mkfs, child)) {
+            return -1;
+        }
+    }
+    return 0;
+}
+
+static int mkfs_flush(struct mkfs *mkfs) {
+    struct mkfs_writer *writer = &mkfs->writer;
     ssize_t ret;
-    uint64_t welcome_inode_no;
-    uint64_t welcome_data_block_no_offset;
+    int i;
 
-    fd = open(argv[1], O_RDWR);
-    if (fd == -1) {
-        perror("Error opening the device");
+    if (0 == writer->count) {
+        return 0;
+    }
+    ret = pwritev(mkfs->fd, writer->iov, writer->count,
+                  writer->start_block_no * mkfs->hellofs_sb.blocksize);
+    for (i = 0; i < writer->count; i++) {
+        if (writer->owned[i]) {
+            free(writer->iov[i].iov_base);
+        }
+    }
+    writer->count = 0;
+    if (ret != (ssize_t)writer->bytes) {
+        perror("Error writing data blocks");
         return -1;
     }
+    writer->bytes = 0;
+    return 0;
+}
 
-    // construct superblock
-    struct hellofs_superblock hellofs_sb = {
-        .version = 1,
-        .magic = HELLOFS_MAGIC,
-        .blocksize = HELLOFS_DEFAULT_BLOCKSIZE,
-        .inode_table_size = HELLOFS_DEFAULT_INODE_TABLE_SIZE,
-        .inode_count = 2,
-        .data_block_table_size = HELLOFS_DEFAULT_DATA_BLOCK_TABLE_SIZE,
-        .data_block_count = 2,
-    };
+/* Queue len bytes, a whole number of blocks, to be written at block_no.
+   Consecutive queued buffers go out with one pwritev. */
+static int mkfs_write(struct mkfs *mkfs, uint64_t block_no, void *buf,
+                      size_t len, int owned) {
+    struct mkfs_writer *writer = &mkfs->writer;
 
-    // construct inode bitmap
-    char inode_bitmap[hellofs_sb.blocksize];
-    memset(inode_bitmap, 0, sizeof(inode_bitmap));
-    inode_bitmap[0] = 1;
-
-    // construct data block bitmap
-    char data_block_bitmap[hellofs_sb.blocksize];
-    memset(data_block_bitmap, 0, sizeof(data_block_bitmap));
-    data_block_bitmap[0] = 1;
-
-    // construct root inode
-    struct hellofs_inode root_hellofs_inode = {
-        .mode = S_IFDIR | S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH,
-        .inode_no = HELLOFS_ROOTDIR_INODE_NO,
-        .data_block_no 
-            = HELLOFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&hellofs_sb)
-                + HELLOFS_ROOTDIR_DATA_BLOCK_NO_OFFSET,
-        .dir_children_count = 1,
-    };
+    if (writer->count
+            && (block_no != writer->start_block_no
+                            + writer->bytes / mkfs->hellofs_sb.blocksize
+                || MKFS_IOV_MAX == writer->count
+                || writer->bytes >= MKFS_FLUSH_BYTES)
+            && 0 != mkfs_flush(mkfs)) {
+        if (owned) {
+            free(buf);
+        }
+        return -1;
+    }
+    if (0 == writer->count) {
+        writer->start_block_no = block_no;
+    }
+    writer->iov[writer->count].iov_base = buf;
+    writer->iov[writer->count].iov_len = len;
+    writer->owned[writer->count] = owned;
+    writer->count += 1;
+    writer->bytes += len;
+    return 0;
+}
 
-    // construct welcome file inode
-    char welcome_body[] = "Welcome Hellofs!!\n";
-    welcome_inode_no = HELLOFS_ROOTDIR_INODE_NO + 1;
-    welcome_data_block_no_offset = HELLOFS_ROOTDIR_DATA_BLOCK_NO_OFFSET + 1;
-    struct hellofs_inode welcome_hellofs_inode = {
-        .mode = S_IFREG | S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH,
-        .inode_no = welcome_inode_no,
-        .data_block_no 
-            = HELLOFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&hellofs_sb)
-                + welcome_data_block_no_offset,
-        .file_size = sizeof(welcome_body),
-    };
+/* Stream a file's data into its extents, a chunk at a time */
+static int mkfs_write_file(struct mkfs *mkfs, struct mkfs_node *file) {
+    uint64_t blocksize = mkfs->hellofs_sb.blocksize;
+    struct hellofs_extent *extent;
+    uint64_t i, done, len, block_len;
+    ssize_t n;
+    char *buf;
+    int fd;
+
+    fd = open(file->path, O_RDONLY);
+    if (-1 == fd) {
+        perror(file->path);
+        return -1;
+    }
+
+    for (i = 0; i < file->extent_count; i++) {
+        extent = &file->extents[i];
+        for (done = 0; done < extent->length * blocksize; done += block_len) {
+            block_len = extent->length * blocksize - done;
+            if (block_len > MKFS_READ_CHUNK) {
+                block_len = MKFS_READ_CHUNK;
+            }
+            buf = calloc(1, block_len);
+            if (!buf) {
+                close(fd);
+                return -1;
+            }
+            // The tail of the last block stays zeroed
+            len = 0;
+            while (len < block_len) {
+                n = read(fd, buf + len, block_len - len);
+                if (n < 0) {
+                    perror(file->path);
+                    free(buf);
+                    close(fd);
+                    return -1;
+                }
+                if (0 == n) {
+                    break;
+                }
+                len += n;
+            }
+            if (0 != mkfs_write(mkfs,
+                                extent->physical_block_no + done / blocksize,
+                                buf, block_len, 1)) {
+                close(fd);
+                return -1;
+            }
+        }
+    }
+
+    close(fd);
+    return 0;
+}
+
+/* Write the data block tables in the order mkfs_layout_dir filled them */
+static int mkfs_write_dir(struct mkfs *mkfs, struct mkfs_node *dir) {
+    uint64_t blocksize = mkfs->hellofs_sb.blocksize;
+    struct hellofs_extent *extent;
+    struct mkfs_node *child;
+    uint64_t i, first;
+
+    for (i = 0; i < dir->extent_count; i++) {
+        extent = &dir->extents[i];
+        first = extent->logical_block_no >= HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO
+                ? dir->leaf_count + extent->logical_block_no
+                  - HELLOFS_DIR_INDEX_LOGICAL_BLOCK_NO
+                : extent->logical_block_no;
+        if (0 != mkfs_write(mkfs, extent->physical_block_no,
+                            dir->dir_blocks + first * blocksize,
+                            extent->length * blocksize, 0)) {
+            return -1;
+        }
+    }
+    if (dir->extent_block && 0 != mkfs_write(mkfs, dir->inode.extent_block_no,
+                                             dir->extent_block, blocksize, 0)) {
+        return -1;
+    }
+
+    for (i = 0; i < dir->child_count; i++) {
+        child = dir->children[i];
+        if (!S_ISREG(child->inode.mode)
+                || (child->inode.flags & HELLOFS_INODE_INLINE_DATA)) {
+            continue;
+        }
+        if (0 != mkfs_write_file(mkfs, child)) {
+            return -1;
+        }
+        if (child->extent_block
+                && 0 != mkfs_write(mkfs, child->inode.extent_block_no,
+                                   child->extent_block, blocksize, 0)) {
+            return -1;
+        }
+    }
+    for (i = 0; i < dir->child_count; i++) {
+        child = dir->children[i];
+        if (S_ISDIR(child->inode.mode) && 0 != mkfs_write_dir(mkfs, child)) {
+            return -1;
+        }
+    }
+    return mkfs_flush(mkfs);
+}
+
+static uint64_t mkfs_used_in_group(uint64_t used, uint64_t per_group,
+                                   uint64_t group_no) {
+    if (used <= group_no * per_group) {
+        return 0;
+    }
+    used -= group_no * per_group;
+    return used < per_group ? used : per_group;
+}
+
+static void mkfs_fill_bitmap(char *bitmap, uint64_t bits) {
+    memset(bitmap, 0xff, bits / BITS_IN_BYTE);
+    if (bits % BITS_IN_BYTE) {
+        bitmap[bits / BITS_IN_BYTE] = (1 << (bits % BITS_IN_BYTE)) - 1;
+    }
+}
+
+/* Each group's bitmaps and inode table slice are consecutive, one pwritev
+   writes them. Inodes and data blocks were taken in order, so the first
+   ones of each bitmap are set. */
+static int mkfs_write_groups(struct mkfs *mkfs) {
+    struct hellofs_superblock *hellofs_sb = &mkfs->hellofs_sb;
+    struct hellofs_group_desc *gd;
+    struct iovec iov[3];
+    uint64_t blocksize = hellofs_sb->blocksize;
+    uint64_t used_inodes, used_data_blocks;
+    uint64_t inode_table_len;
+    uint64_t i, j, inode_no;
+    char *inode_bitmap, *data_block_bitmap, *inode_table;
+    int ret;
+
+    inode_table_len = HELLOFS_INODE_TABLE_BLOCKS_PER_GROUP_HSB(hellofs_sb)
+                      * blocksize;
+    inode_bitmap = malloc(blocksize);
+    data_block_bitmap = malloc(blocksize);
+    inode_table = malloc(inode_table_len);
+    ret = -1;
+    if (!inode_bitmap || !data_block_bitmap || !inode_table) {
+        goto out;
+    }
+
+    for (i = 0; i < hellofs_sb->group_count; i++) {
+        gd = &mkfs->group_descs[i];
+        used_inodes = mkfs_used_in_group(mkfs->next_inode_no,
+                                         hellofs_sb->inodes_per_group, i);
+        used_data_blocks = mkfs_used_in_group(mkfs->next_data_block,
+                                              hellofs_sb->data_blocks_per_group,
+                                              i);
+        gd->free_inodes_count = hellofs_sb->inodes_per_group - used_inodes;
+        gd->free_data_blocks_count
+            = hellofs_sb->data_blocks_per_group - used_data_blocks;
+
+        memset(inode_bitmap, 0, blocksize);
+        mkfs_fill_bitmap(inode_bitmap, used_inodes);
+        memset(data_block_bitmap, 0, blocksize);
+        mkfs_fill_bitmap(data_block_bitmap, used_data_blocks);
 
-    // construct root inode data block
-    struct hellofs_dir_record root_dir_records[] = {
-        {
-            .filename = "wel_helo.txt",
-            .inode_no = welcome_inode_no,
-        },
+        memset(inode_table, 0, inode_table_len);
+        for (j = 0; j < used_inodes; j++) {
+            inode_no = i * hellofs_sb->inodes_per_group + j;
+            memcpy(inode_table + j * sizeof(struct hellofs_inode),
+                   &mkfs->nodes[inode_no]->inode,
+                   sizeof(struct hellofs_inode));
+        }
+
+        iov[0].iov_base = inode_bitmap;
+        iov[0].iov_len = blocksize;
+        iov[1].iov_base = data_block_bitmap;
+        iov[1].iov_len = blocksize;
+        iov[2].iov_base = inode_table;
+        iov[2].iov_len = inode_table_len;
+        if ((ssize_t)(2 * blocksize + inode_table_len)
+                != pwritev(mkfs->fd, iov, 3,
+                           gd->inode_bitmap_block_no * blocksize)) {
+            perror("Error writing block group");
+            goto out;
+        }
+    }
+    ret = 0;
+
+out:
+    free(inode_bitmap);
+    free(data_block_bitmap);
+    free(inode_table);
+    return ret;
+}
+
+/* An empty log: the journal superblock expects transaction 1 at the first
+   log block, which is zeroed so that nothing there looks like it */
+static int mkfs_write_journal(struct mkfs *mkfs) {
+    struct hellofs_superblock *hellofs_sb = &mkfs->hellofs_sb;
+    struct hellofs_journal_superblock *jsb;
+    char *blocks;
+    int ret;
+
+    if (0 == hellofs_sb->journal_block_count) {
+        return 0;
+    }
+    blocks = calloc(2, hellofs_sb->blocksize);
+    if (!blocks) {
+        return -1;
+    }
+    jsb = (struct hellofs_journal_superblock *)blocks;
+    jsb->magic = HELLOFS_JOURNAL_MAGIC;
+    jsb->sequence = 1;
+    ret = write_block(mkfs->fd, hellofs_sb, hellofs_sb->journal_start_block_no,
+                      blocks, 2 * hellofs_sb->blocksize);
+    free(blocks);
+    return ret;
+}
+
+static void usage(const char *prog) {
+    fprintf(stderr,
+            "Usage: %s [-b blocksize] [-i inodes] [-d data_blocks] "
+            "[-j journal_blocks] [-p dir] device\n"
+            "  -b, --blocksize    block size, a power of two from 512 to %d\n"
+            "  -i, --inodes       number of inodes\n"
+            "  -d, --data-blocks  number of data blocks\n"
+            "  -j, --journal      blocks of the metadata journal, 0 for none\n"
+            "                     (default %d)\n"
+            "  -p, --populate     copy the files and directories under dir\n"
+            "                     into the new filesystem\n",
+            prog, MKFS_MAX_BLOCKSIZE,
+            HELLOFS_DEFAULT_JOURNAL_BLOCKS);
+}
+
+int main(int argc, char *argv[]) {
+    static const struct option options[] = {
+        { "blocksize", required_argument, NULL, 'b' },
+        { "inodes", required_argument, NULL, 'i' },
+        { "data-blocks", required_argument, NULL, 'd' },
+        { "journal", required_argument, NULL, 'j' },
+        { "populate", required_argument, NULL, 'p' },
+        { "help", no_argument, NULL, 'h' },
+        { NULL, 0, NULL, 0 },
     };
+    // Without -p the filesystem starts with a welcome file
+    static const char welcome_body[] = "Welcome Hellofs!!\n";
+    struct mkfs mkfs;
+    struct hellofs_superblock *hellofs_sb;
+    struct mkfs_node *root;
+    struct mkfs_node *welcome;
+    struct stat st;
+    const char *populate;
+    uint64_t blocksize;
+    uint64_t inode_count;
+    uint64_t data_block_count;
+    uint64_t journal_block_count;
+    uint64_t needed_inodes;
+    uint64_t needed_blocks;
+    off_t device_size;
+    ssize_t ret;
+    int opt;
+
+    memset(&mkfs, 0, sizeof(mkfs));
+    hellofs_sb = &mkfs.hellofs_sb;
+    blocksize = HELLOFS_DEFAULT_BLOCKSIZE;
+    inode_count = 0;
+    data_block_count = 0;
+    journal_block_count = HELLOFS_DEFAULT_JOURNAL_BLOCKS;
+    populate = NULL;
+    while (-1 != (opt = getopt_long(argc, argv, "b:i:d:j:p:h", options,
+                                    NULL))) {
+        switch (opt) {
+        case 'b':
+            blocksize = strtoull(optarg, NULL, 0);
+            break;
+        case 'i':
+            inode_count = strtoull(optarg, NULL, 0);
+            break;
+        case 'd':
+            data_block_count = strtoull(optarg, NULL, 0);
+            break;
+        case 'j':
+            journal_block_count = strtoull(optarg, NULL, 0);
+            break;
+        case 'p':
+            populate = optarg;
+            break;
+        default:
+            usage(argv[0]);
+            return 'h' == opt ? 0 : -1;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return -1;
+    }
+    if (blocksize < 512 || blocksize > MKFS_MAX_BLOCKSIZE
+            || 0 != (blocksize & (blocksize - 1))) {
+        fprintf(stderr, "Block size must be a power of two from 512 to %d\n",
+                MKFS_MAX_BLOCKSIZE);
+        return -1;
+    }
+    if (0 != journal_block_count
+            && journal_block_count < HELLOFS_MIN_JOURNAL_BLOCKS) {
+        fprintf(stderr, "The journal needs at least %d blocks\n",
+                HELLOFS_MIN_JOURNAL_BLOCKS);
+        return -1;
+    }
+
+    root = mkfs_new_node("", S_IFDIR | S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
+    if (!root) {
+        perror("Error allocating the root");
+        return -1;
+    }
+    needed_inodes = 1;
+    needed_blocks = 1;
+    if (populate) {
+        if (0 != stat(populate, &st) || !S_ISDIR(st.st_mode)) {
+            fprintf(stderr, "%s is not a directory\n", populate);
+            mkfs_free_node(root);
+            return -1;
+        }
+        root->inode.mode = st.st_mode;
+        root->path = strdup(populate);
+        if (!root->path
+                || 0 != mkfs_scan(root, blocksize, &needed_inodes,
+                                  &needed_blocks)) {
+            mkfs_free_node(root);
+            return -1;
+        }
+    } else {
+        welcome = mkfs_new_node("wel_helo.txt", S_IFREG | S_IRUSR | S_IWUSR
+                                                | S_IRGRP | S_IWGRP | S_IROTH);
+        if (!welcome || 0 != mkfs_add_child(root, welcome)) {
+            perror("Error allocating the welcome file");
+            free(welcome);
+            mkfs_free_node(root);
+            return -1;
+        }
+        welcome->data = welcome_body;
+        welcome->inode.file_size = sizeof(welcome_body);
+        needed_inodes += 1;
+    }
+
+    // By default, the tables fit the tree with room for extent blocks,
+    // and a quarter more for what is created after mounting it
+    if (0 == inode_count) {
+        needed_inodes += needed_inodes / 4;
+        inode_count = needed_inodes > HELLOFS_DEFAULT_INODE_TABLE_SIZE
+                      ? needed_inodes : HELLOFS_DEFAULT_INODE_TABLE_SIZE;
+    }
+    if (0 == data_block_count) {
+        needed_blocks += needed_blocks / 64 + 16;
+        needed_blocks += needed_blocks / 4;
+        data_block_count = needed_blocks > HELLOFS_DEFAULT_DATA_BLOCK_TABLE_SIZE
+                           ? needed_blocks
+                           : HELLOFS_DEFAULT_DATA_BLOCK_TABLE_SIZE;
+    }
+    if (inode_count < 2) {
+        fprintf(stderr, "At least 2 inodes are needed\n");
+        mkfs_free_node(root);
+        return -1;
+    }
+
+    mkfs.fd = open(argv[optind], O_RDWR);
+    if (mkfs.fd == -1) {
+        perror("Error opening the device");
+        mkfs_free_node(root);
+        return -1;
+    }
 
     ret = 0;
     do {
-        // write super block
-        if (sizeof(hellofs_sb)
-                != write(fd, &hellofs_sb, sizeof(hellofs_sb))) {
+        if (0 != mkfs_geometry(&mkfs, blocksize, inode_count,
+                               data_block_count, journal_block_count)) {
             ret = -1;
             break;
         }
-        if ((off_t)-1
-                == lseek(fd, hellofs_sb.blocksize, SEEK_SET)) {
+
+        device_size = lseek(mkfs.fd, 0, SEEK_END);
+        if (device_size == (off_t)-1 || device_size == 0) {
+            fprintf(stderr, "The device is empty or its size is unknown\n");
+            ret = -1;
+            break;
+        }
+        if ((uint64_t)device_size
+                < HELLOFS_DEVICE_BLOCKS_HSB(hellofs_sb) * blocksize) {
+            fprintf(stderr, "Device is too small, %llu blocks are needed\n",
+                    (unsigned long long)HELLOFS_DEVICE_BLOCKS_HSB(hellofs_sb));
+            ret = -1;
+            break;
+        }
+
+        // lay out the tree, root dir first, so that its first leaf is at
+        // HELLOFS_ROOTDIR_DATA_BLOCK_NO_OFFSET
+        if (0 != mkfs_take_inode(&mkfs, root)
+                || 0 != mkfs_layout_dir(&mkfs, root)) {
             ret = -2;
             break;
         }
+        hellofs_sb->inode_count = mkfs.next_inode_no;
+        hellofs_sb->data_block_count = mkfs.next_data_block;
 
-        // write inode bitmap
-        if (sizeof(inode_bitmap)
-                != write(fd, inode_bitmap, sizeof(inode_bitmap))) {
+        // write data block tables
+        if (0 != mkfs_write_dir(&mkfs, root)) {
             ret = -3;
             break;
         }
 
-        // write data block bitmap
-        if (sizeof(data_block_bitmap)
-                != write(fd, data_block_bitmap,
-                         sizeof(data_block_bitmap))) {
+        // write bitmaps and inode tables, which fills in the free counts
+        if (0 != mkfs_write_groups(&mkfs)) {
             ret = -4;
             break;
         }
 
-        // write root inode
-        if (sizeof(root_hellofs_inode)
-                != write(fd, &root_hellofs_inode,
-                         sizeof(root_hellofs_inode))) {
+        // write group descriptor table
+        if (0 != write_block(mkfs.fd, hellofs_sb,
+                             HELLOFS_GROUP_DESC_TABLE_START_BLOCK_NO,
+                             mkfs.group_descs, mkfs.group_desc_table_len)) {
             ret = -5;
             break;
         }
 
-        // write welcome file inode
-        if (sizeof(welcome_hellofs_inode)
-                != write(fd, &welcome_hellofs_inode,
-                         sizeof(welcome_hellofs_inode))) {
+        if (0 != mkfs_write_journal(&mkfs)) {
             ret = -6;
             break;
         }
 
-        // write root inode data block
-        if ((off_t)-1
-                == lseek(
-                    fd,
-                    HELLOFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&hellofs_sb)
-                        * hellofs_sb.blocksize,
-                    SEEK_SET)) {
+        // write super block last, a failed mkfs leaves no valid filesystem
+        if (0 != write_block(mkfs.fd, hellofs_sb, HELLOFS_SUPERBLOCK_BLOCK_NO,
+                             hellofs_sb, sizeof(*hellofs_sb))) {
             ret = -7;
             break;
         }
-        if (sizeof(root_dir_records)
-                != write(fd, root_dir_records,
-                         sizeof(root_dir_records))) {
-            ret = -8;
-            break;
-        }
 
-        // write welcome file inode data block
-        if ((off_t)-1
-                == lseek(
-                    fd,
-                    (HELLOFS_DATA_BLOCK_TABLE_START_BLOCK_NO_HSB(&hellofs_sb)
-                        + 1) * hellofs_sb.blocksize,
-                    SEEK_SET)) {
-            ret = -9;
-            break;
-        }
-        if (sizeof(welcome_body) != write(fd, welcome_body,
-                                          sizeof(welcome_body))) {
-            ret = -10;
+        if (0 != fsync(mkfs.fd)) {
+            ret = -8;
             break;
         }
     } while (0);
 
-    close(fd);
+    if (ret) {
+        fprintf(stderr, "Failed to make the filesystem (%d)\n", (int)ret);
+    }
+    free(mkfs.group_descs);
+    free(mkfs.nodes);
+    mkfs_free_node(root);
+    close(mkfs.fd);
     return ret;
 }
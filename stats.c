@@ -0,0 +1,121 @@
+#include "khellofs.h"
+
+#define CREATE_TRACE_POINTS
+#include "hellofs_trace.h"
+
+/* /sys/kernel/debug/hellofs, holding one directory per mount */
+static struct dentry *hellofs_debugfs_root = NULL;
+
+static const char *const hellofs_stat_names[HELLOFS_STAT_OPS] = {
+    [HELLOFS_STAT_LOOKUP] = "lookup",
+    [HELLOFS_STAT_CREATE] = "create",
+    [HELLOFS_STAT_READ] = "read",
+    [HELLOFS_STAT_WRITE] = "write",
+    [HELLOFS_STAT_ALLOC] = "alloc",
+    [HELLOFS_STAT_READDIR] = "readdir",
+};
+
+// What the extra counter of an operation counts, if anything
+static const char *const hellofs_stat_extra_names[HELLOFS_STAT_OPS] = {
+    [HELLOFS_STAT_READ] = "bytes",
+    [HELLOFS_STAT_WRITE] = "bytes",
+    [HELLOFS_STAT_ALLOC] = "bits_scanned",
+    [HELLOFS_STAT_READDIR] = "blocks",
+};
+
+/* One block per operation: totals, then the non-empty latency buckets,
+   each printed as its exclusive upper bound in ns */
+static int hellofs_stats_show(struct seq_file *m, void *v) {
+    struct super_block *sb = m->private;
+    struct hellofs_stats *stats;
+    u64 count, total_ns, extra;
+    u64 hist[HELLOFS_STAT_BUCKETS];
+    int cpu, op, i;
+
+    for (op = 0; op < HELLOFS_STAT_OPS; op++) {
+        count = 0;
+        total_ns = 0;
+        extra = 0;
+        memset(hist, 0, sizeof(hist));
+        for_each_possible_cpu(cpu) {
+            stats = per_cpu_ptr(HELLOFS_SB_INFO(sb)->stats, cpu);
+            count += stats->count[op];
+            total_ns += stats->total_ns[op];
+            extra += stats->extra[op];
+            for (i = 0; i < HELLOFS_STAT_BUCKETS; i++) {
+                hist[i] += stats->latency_hist[op][i];
+            }
+        }
+
+        seq_printf(m, "%s count %llu total_ns %llu", hellofs_stat_names[op],
+                   count, total_ns);
+        if (hellofs_stat_extra_names[op]) {
+            seq_printf(m, " %s %llu", hellofs_stat_extra_names[op], extra);
+        }
+        seq_puts(m, "\n  latency_ns");
+        for (i = 0; i < HELLOFS_STAT_BUCKETS - 1; i++) {
+            if (hist[i]) {
+                seq_printf(m, " <%llu:%llu", 1ULL << i, hist[i]);
+            }
+        }
+        if (hist[i]) {
+            seq_printf(m, " >=%llu:%llu", 1ULL << (i - 1), hist[i]);
+        }
+        seq_putc(m, '\n');
+    }
+
+    return 0;
+}
+
+static int hellofs_stats_open(struct inode *inode, struct file *file) {
+    return single_open(file, hellofs_stats_show, inode->i_private);
+}
+
+static const struct file_operations hellofs_stats_fops = {
+    .owner = THIS_MODULE,
+    .open = hellofs_stats_open,
+    .read = seq_read,
+    .llseek = seq_lseek,
+    .release = single_release,
+};
+
+/* debugfs is optional, hellofs works without it */
+void hellofs_stats_init(void) {
+    hellofs_debugfs_root = debugfs_create_dir("hellofs", NULL);
+    if (IS_ERR(hellofs_debugfs_root)) {
+        hellofs_debugfs_root = NULL;
+    }
+}
+
+void hellofs_stats_exit(void) {
+    debugfs_remove_recursive(hellofs_debugfs_root);
+}
+
+int hellofs_stats_mount(struct super_block *sb) {
+    struct hellofs_sb_info *sbi = HELLOFS_SB_INFO(sb);
+
+    sbi->stats = alloc_percpu(struct hellofs_stats);
+    if (!sbi->stats) {
+        return -ENOMEM;
+    }
+
+    if (hellofs_debugfs_root) {
+        sbi->debugfs_dir = debugfs_create_dir(sb->s_id, hellofs_debugfs_root);
+        if (IS_ERR_OR_NULL(sbi->debugfs_dir)) {
+            sbi->debugfs_dir = NULL;
+        } else {
+            debugfs_create_file("stats", S_IRUSR, sbi->debugfs_dir, sb,
+                                &hellofs_stats_fops);
+        }
+    }
+    return 0;
+}
+
+void hellofs_stats_unmount(struct super_block *sb) {
+    struct hellofs_sb_info *sbi = HELLOFS_SB_INFO(sb);
+
+    debugfs_remove_recursive(sbi->debugfs_dir);
+    sbi->debugfs_dir = NULL;
+    free_percpu(sbi->stats);
+    sbi->stats = NULL;
+}
@@ -1,10 +1,27 @@
 #include "khellofs.h"
 
+static void hellofs_release_sb_info(struct super_block *sb) {
+    struct hellofs_sb_info *sbi = HELLOFS_SB_INFO(sb);
+
+    if (!sbi) {
+        return;
+    }
+
+    /* Commits what is left, which needs the pinned buffers */
+    hellofs_journal_release(sb);
+    hellofs_release_groups(sb);
+    hellofs_stats_unmount(sb);
+    brelse(sbi->sb_bh);
+    kfree(sbi);
+    sb->s_fs_info = NULL;
+}
+
 static int hellofs_fill_super(struct super_block *sb, void *data, int silent) {
     struct inode *root_inode;
-    struct hellofs_inode *root_hellofs_inode;
     struct buffer_head *bh;
     struct hellofs_superblock *hellofs_sb;
+    struct hellofs_sb_info *sbi;
+    int blocksize;
     int ret = 0;
 
     bh = sb_bread(sb, HELLOFS_SUPERBLOCK_BLOCK_NO);
@@ -15,28 +32,75 @@ static int hellofs_fill_super(struct super_block *sb, void *data, int silent) {
                "The filesystem being mounted is not of type hellofs. "
                "Magic number mismatch: %llu != %llu\n",
                hellofs_sb->magic, (uint64_t)HELLOFS_MAGIC);
-        goto release;
+        brelse(bh);
+        return -EINVAL;
+    }
+    /* The superblock is at offset 0 whatever the block size, so it can be
+       read with the device's block size and read again with the one
+       mkfs-hellofs -b formatted with */
+    if (sb->s_blocksize != hellofs_sb->blocksize
+            && hellofs_sb->blocksize <= PAGE_SIZE) {
+        blocksize = hellofs_sb->blocksize;
+        brelse(bh);
+        if (!sb_set_blocksize(sb, blocksize)) {
+            printk(KERN_ERR "hellofs block size %d is not supported\n",
+                   blocksize);
+            return -EINVAL;
+        }
+        bh = sb_bread(sb, HELLOFS_SUPERBLOCK_BLOCK_NO);
+        if (!bh) {
+            return -EIO;
+        }
+        hellofs_sb = (struct hellofs_superblock *)bh->b_data;
     }
     if (unlikely(sb->s_blocksize != hellofs_sb->blocksize)) {
         printk(KERN_ERR
                "hellofs seem to be formatted with mismatching blocksize: %lu\n",
                sb->s_blocksize);
+        brelse(bh);
+        return -EINVAL;
+    }
+
+    /* The superblock buffer stays pinned until put_super */
+    sbi = kzalloc(sizeof(*sbi), GFP_KERNEL);
+    if (!sbi) {
+        brelse(bh);
+        return -ENOMEM;
+    }
+    sbi->sb_bh = bh;
+    sbi->hellofs_sb = hellofs_sb;
+    sb->s_fs_info = sbi;
+
+    ret = hellofs_stats_mount(sb);
+    if (0 != ret) {
+        goto release;
+    }
+
+    /* Replaying the journal may rewrite any metadata, including the
+       superblock, whose buffer is updated in place */
+    ret = hellofs_journal_load(sb);
+    if (0 != ret) {
+        goto release;
+    }
+
+    ret = hellofs_load_groups(sb);
+    if (0 != ret) {
         goto release;
     }
 
     sb->s_magic = hellofs_sb->magic;
-    sb->s_fs_info = hellofs_sb;
-    sb->s_maxbytes = hellofs_sb->blocksize;
+    /* Extents stay inside a group's data block table slice */
+    sb->s_maxbytes = min(hellofs_sb->data_block_table_size,
+                         HELLOFS_MAX_EXTENTS_HSB(hellofs_sb)
+                         * hellofs_sb->data_blocks_per_group)
+                     * hellofs_sb->blocksize;
     sb->s_op = &hellofs_sb_ops;
 
-    root_hellofs_inode = hellofs_get_hellofs_inode(sb, HELLOFS_ROOTDIR_INODE_NO);
-    root_inode = new_inode(sb);
-    if (!root_inode || !root_hellofs_inode) {
-        ret = -ENOMEM;
+    root_inode = hellofs_iget(sb, HELLOFS_ROOTDIR_INODE_NO);
+    if (IS_ERR(root_inode)) {
+        ret = PTR_ERR(root_inode);
         goto release;
     }
-    hellofs_fill_inode(sb, root_inode, root_hellofs_inode);
-    inode_init_owner(root_inode, NULL, root_inode->i_mode);
 
     sb->s_root = d_make_root(root_inode);
     if (!sb->s_root) {
@@ -44,8 +108,10 @@ static int hellofs_fill_super(struct super_block *sb, void *data, int silent) {
         goto release;
     }
 
+    return 0;
+
 release:
-    brelse(bh);
+    hellofs_release_sb_info(sb);
     return ret;
 }
 
@@ -71,19 +137,54 @@ void hellofs_kill_superblock(struct super_block *sb) {
     kill_block_super(sb);
 }
 
+/* sync_filesystem() has flushed everything else by now. With a journal
+   the superblock goes out with the last commit. */
 void hellofs_put_super(struct super_block *sb) {
-    return;
+    hellofs_fold_counters(sb);
+    if (!HELLOFS_SB_INFO(sb)->journal) {
+        sync_dirty_buffer(HELLOFS_SB_INFO(sb)->sb_bh);
+    }
+    hellofs_release_sb_info(sb);
 }
 
-void hellofs_save_sb(struct super_block *sb) {
-    struct buffer_head *bh;
-    struct hellofs_superblock *hellofs_sb = HELLOFS_SB(sb);
+/* Inodes, bitmaps and directory blocks are flushed with the block device
+   by sync_filesystem(). Write the superblock after them when waiting.
+   With a journal all of them are committed together. */
+int hellofs_sync_fs(struct super_block *sb, int wait) {
+    struct buffer_head *bh = HELLOFS_SB_INFO(sb)->sb_bh;
 
-    bh = sb_bread(sb, HELLOFS_SUPERBLOCK_BLOCK_NO);
-    BUG_ON(!bh);
+    hellofs_fold_counters(sb);
+    if (HELLOFS_SB_INFO(sb)->journal) {
+        return hellofs_journal_commit(sb, wait);
+    }
+    if (wait) {
+        sync_dirty_buffer(bh);
+        if (buffer_req(bh) && !buffer_uptodate(bh)) {
+            return -EIO;
+        }
+    }
+    return 0;
+}
 
-    bh->b_data = (char *)hellofs_sb;
-    mark_buffer_dirty(bh);
-    sync_dirty_buffer(bh);
-    brelse(bh);
-}
\ No newline at end of file
+/* Served from the per-cpu counters without taking any lock */
+int hellofs_statfs(struct dentry *dentry, struct kstatfs *buf) {
+    struct super_block *sb = dentry->d_sb;
+    struct hellofs_sb_info *sbi = HELLOFS_SB_INFO(sb);
+    struct hellofs_superblock *hellofs_sb = HELLOFS_SB(sb);
+    u64 id = huge_encode_dev(sb->s_bdev->bd_dev);
+
+    buf->f_type = HELLOFS_MAGIC;
+    buf->f_bsize = sb->s_blocksize;
+    buf->f_blocks = hellofs_sb->data_block_table_size;
+    buf->f_bfree = percpu_counter_read_positive(&sbi->free_data_blocks);
+    /* Blocks reserved by delayed writes are taken already */
+    buf->f_bavail = buf->f_bfree
+                    - min_t(u64, buf->f_bfree, percpu_counter_read_positive(
+                                  &sbi->reserved_data_blocks));
+    buf->f_files = hellofs_sb->inode_table_size;
+    buf->f_ffree = percpu_counter_read_positive(&sbi->free_inodes);
+    buf->f_namelen = HELLOFS_FILENAME_MAXLEN;
+    buf->f_fsid.val[0] = (u32)id;
+    buf->f_fsid.val[1] = (u32)(id >> 32);
+    return 0;
+}